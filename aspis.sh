@@ -17,8 +17,8 @@ asm_file=""
 asm_files=""
 input_files=""
 clang_options=
-eddi_options="-S"
-cfc_options="-S"
+aspis_options="-S"
+aspis_params=""
 llvm_bin=$(dirname "$(which clang)")
 suffix=""
 build_dir="."
@@ -29,6 +29,13 @@ verbose=false
 cleanup=true
 libstdcpp_added=false
 enable_profiling=false
+fault_injection=false
+fi_options=""
+collect_profile=false
+aspis_profile=""
+shadow_mem=false
+dup_heap=false
+jobs=0 # 0 = harden the linked program, N = harden each file with N parallel jobs
 
 # Check if the shell supports colors
 if [ -t 1 ]; then
@@ -126,6 +133,15 @@ parse_commands() {
                             termination, one for each line (wildcard * allowed).
         --no-cleanup        Does not remove the intermediate .ll files generated,
                             which might be useful for debug purposes.
+        --aspis-stats       Print the statistics of the ASPIS passes as JSON
+                            (requires an LLVM built with assertions or with
+                            -DLLVM_FORCE_ENABLE_STATS=ON).
+        -j <N>              Harden each file separately, running up to <N>
+                            jobs in parallel. Only the cross-module steps
+                            (calls to the duplicated functions of other files,
+                            inter-RASM, duplicated globals) are applied after
+                            linking. Cannot be used with --collect-profile or
+                            --aspis-profile.
 
     Hardening mechanism:
         --eddi              (Default) Enable EDDI.
@@ -149,6 +165,96 @@ parse_commands() {
                             at synchonization points, which can be used to trace where
                             consistency checks are executed.
 
+        --eddi-check-mode=<mode>
+                            Select how EDDI consistency checks are performed:
+                            "branch" (default) jumps to the error handler at
+                            every check, "accumulate" folds mismatches into a
+                            per-function flag checked only at flush points.
+
+        --eddi-flush-points=<points>
+                            Comma-separated list of points where the flag is
+                            checked in accumulate mode, among "exit",
+                            "backedge" and "calls" (default: all). Function
+                            exits and calls that do not return are always
+                            flush points.
+
+        --eddi-shadow-mem   Keep the duplicate of each memory object at a fixed
+                            offset from the original (shadow memory) instead
+                            of duplicating the objects, and pass the pointer
+                            arguments once. Needs a position-independent
+                            executable on x86-64 Linux.
+
+        --eddi-shadow-offset=<offset>
+                            Offset of the shadow memory from the original
+                            objects (default -0x400000000000).
+
+        --eddi-dup-heap     Allocate each heap object together with its
+                            duplicate, in a single block twice its size.
+
+        --eddi-replicas=<N> Number of copies of each value kept by EDDI: 2
+                            (default) detects the faults, 3 also masks them
+                            by majority voting.
+
+        --eddi-check-elim   Remove the EDDI consistency checks made redundant
+                            by a dominating check on the same values.
+
+        --eddi-loop-checks  Hoist the EDDI checks on loop-invariant values to
+                            the loop preheaders, and sink the checks on the
+                            loop-carried values written by stores to the loop
+                            exits in loops without calls.
+
+        --eddi-loop-check-period=<N>
+                            With --eddi-loop-checks, also test the sunk checks
+                            every N loop iterations.
+
+        --rasm-sig-storage=<storage>
+                            Where RASM keeps the runtime signatures: "memory"
+                            (default) uses volatile stack slots, "register"
+                            keeps them in SSA values. Not used by inter-RASM.
+
+        --rasm-sig-barrier=<barrier>
+                            With --rasm-sig-storage=register, the barrier that
+                            prevents the optimizer from folding the
+                            signatures: "asm" (default), "fake-use" or "none".
+
+        --racfed-batch-updates
+                            Keep the RACFED signature of each basic block in a
+                            register, writing it back to memory only before
+                            calls and at the end of the block.
+
+        --fault-injection   Instrument the binary for the fault injection
+                            campaigns of testing/fault_injection.py. The sites
+                            are listed in <build-dir>/fault_injection_sites.csv.
+
+        --fi-sites=<kinds>  With --fault-injection, the comma-separated kinds of
+                            sites: "value", "address", "branch" (default: all).
+
+        --lower-switch      Turn the switches into chains of branches before
+                            the hardening. By default the switches are kept,
+                            and RASM and RACFED select the signature update
+                            through a constant table indexed like the switch.
+
+        --aspis-seed=<N>
+                            Seed of the control-flow checking signatures. The
+                            signatures only depend on the seed and on the
+                            function names, so the same seed always produces
+                            the same binary.
+
+        --collect-profile   Build the program without hardening, counting the
+                            executions of the basic blocks (in all the
+                            threads). At exit the counts are written to
+                            <build-dir>/out.ll.aspis.profraw.
+
+        --aspis-profile=<file>
+                            Block counts written by a --collect-profile build
+                            of the same sources (and options).
+
+        --aspis-overhead-budget=<percent>
+                            With --aspis-profile, maximum overhead of the
+                            checks, as a percentage of the instructions
+                            executed by the unhardened program. The checks of
+                            the hottest blocks are relaxed to fit the budget.
+
 EOF
                         exit 0
                         ;;
@@ -177,6 +283,13 @@ EOF
                             suffix+=${opt##"--suffix="};
                         fi;
                         ;;
+                    -j*)
+                        if [[ ${#opt} -eq 2 ]]; then
+                            parse_state=8;
+                        else
+                            jobs=${opt##"-j"};
+                        fi;
+                        ;;
                     --exclude*)
                         if [[ ${#opt} -eq 9 ]]; then
                             parse_state=4;
@@ -225,18 +338,56 @@ EOF
                     --no-cfc)
                         cfc=-1
                         ;;
-                    --alternate-memmap)
-                        eddi_options="$eddi_options $opt=true";
+                    --alternate-memmap | --racfed-batch-updates)
+                        aspis_options="$aspis_options $opt=true";
+                        ;;
+                    --eddi-shadow-mem)
+                        aspis_options="$aspis_options $opt=true";
+                        shadow_mem=true;
+                        ;;
+                    --eddi-dup-heap)
+                        aspis_options="$aspis_options $opt=true";
+                        dup_heap=true;
+                        ;;
+                    --eddi-check-elim)
+                        aspis_params="$aspis_params;check-elim";
+                        ;;
+                    --eddi-loop-checks)
+                        aspis_params="$aspis_params;loop-checks";
+                        ;;
+                    --fault-injection)
+                        fault_injection=true;
+                        ;;
+                    --fi-sites=*)
+                        fi_options="$fi_options $opt";
+                        ;;
+                    --lower-switch)
+                        aspis_params="$aspis_params;lower-switch";
+                        ;;
+                    --collect-profile)
+                        collect_profile=true;
+                        ;;
+                    --aspis-stats)
+                        aspis_options="$aspis_options -stats -stats-json";
+                        fi_options="$fi_options -stats -stats-json";
+                        ;;
+                    --eddi-check-mode=* | --eddi-flush-points=* | --eddi-loop-check-period=* | --eddi-shadow-offset=* | --eddi-replicas=* | --rasm-sig-storage=* | --rasm-sig-barrier=* | --aspis-seed=* | --aspis-overhead-budget=*)
+                        aspis_options="$aspis_options $opt";
+                        ;;
+                    --aspis-profile=*)
+                        aspis_profile=${opt#*=};
+                        # opt may run in another directory (see harden_tu)
+                        [[ $aspis_profile != /* ]] && aspis_profile=$PWD/$aspis_profile;
+                        aspis_options="$aspis_options --aspis-profile=$aspis_profile";
                         ;;
                     --enable-profiling)
-                        eddi_options="$eddi_options $opt=true";
-                        cfc_options="$cfc_options $opt=true";
+                        aspis_options="$aspis_options $opt=true";
                         enable_profiling=true;
                         ;;
                     -g)
                         debug_enabled=true;
                         clang_options="$clang_options $opt";
-                        eddi_options="$eddi_options --debug-enabled=true";
+                        aspis_options="$aspis_options --debug-enabled=true";
                         ;;
                     --no-cleanup)
                         cleanup=false;
@@ -286,6 +437,10 @@ EOF
               suffix="-$opt";
               parse_state=0;
               ;;
+            8)
+                jobs="$opt";
+                parse_state=0;
+                ;;
       esac
     done
 
@@ -319,78 +474,120 @@ EOF
     fi;
 }
 
-run_aspis() {
-    if [[ -z ${input_files} ]]; then
-        error_msg "No input files provided."
-    fi
-
-    exe mkdir -p $build_dir
-    exe rm -f $build_dir/*.ll
+# Front-end and hardening of a single file, in its own directory as the passes
+# write their logs in the working directory.
+harden_tu() {
+    local input_file=$1
+    local tu_dir=$2
+    exe $CLANG "$input_file" $clang_options -S -emit-llvm -O0 -Xclang -disable-O0-optnone -o "$tu_dir/in.ll"
+    cd $tu_dir
+    exe $OPT -load-pass-plugin=$DIR/build/passes/libASPIS.so --passes="aspis<$aspis_pipeline;per-tu>" in.ll -o out.ll $aspis_options
+}
 
-    title_msg "Front-end and pre-processing"
+run_aspis_per_tu() {
+    title_msg "Front-end and ASPIS transformations ($jobs jobs)"
+    exe rm -rf $build_dir/tu
 
-    ## FRONTEND
+    local pids=""
     for input_file in $input_files; do
         # Extract the filename without extension
         filename=$(basename "$input_file" | sed 's/\.[^.]*$//')
-        # Compile the file to LLVM IR (.ll) and save it in the build directory
-        exe $CLANG "$input_file" $clang_options -S -emit-llvm -O0 -Xclang -disable-O0-optnone -o "$build_dir/$filename.ll"
+        exe mkdir -p $build_dir/tu/$filename
+        ( harden_tu "$input_file" $build_dir/tu/$filename ) &
+        pids="$pids $!"
+        while [[ $(jobs -rp | wc -l) -ge $jobs ]]; do
+            wait -n
+        done
+    done
+    for pid in $pids; do
+        wait $pid || error_msg "Hardening of the translation units FAILED."
+    done
+    success_msg "Applied data protection and CFC passes to each file."
+
+    ## LINK-TIME STEP
+    title_msg "Link-time ASPIS transformations"
+    exe $LLVM_LINK $build_dir/tu/*/out.ll -o $build_dir/out.ll
+    # merge the logs of the compiled functions
+    rm -f *.csv.tmp
+    for log in $build_dir/tu/*/*.csv; do
+        [[ -f "$log" ]] && cat $log >> $(basename $log).tmp
+    done
+    for log in *.csv.tmp; do
+        [[ -f "$log" ]] && mv $log ${log%.tmp}
     done
+    exe $OPT -load-pass-plugin=$DIR/build/passes/libASPIS.so --passes="aspis<$aspis_pipeline;link>" $build_dir/out.ll -o $build_dir/out.ll $aspis_options
+    success_msg "Linked and finalized the hardened files."
+}
 
-    ## LINK & PREPROCESS
-    exe $LLVM_LINK $build_dir/*.ll -o $build_dir/out.ll
+run_aspis() {
+    if [[ -z ${input_files} ]]; then
+        error_msg "No input files provided."
+    fi
 
-    success_msg "Emitted and linked IR."
+    exe mkdir -p $build_dir
+    exe rm -f $build_dir/*.ll
 
+    ## ASPIS PIPELINE
+    # the whole hardening runs in a single opt invocation (see passes/ASPIS.cpp)
+    if [[ $collect_profile == true ]]; then
+        # the counters are written at exit by the atexit hook of passes/Profiling/runtime.c
+        if [[ $jobs -gt 0 ]]; then
+            error_msg "--collect-profile requires the whole program, it cannot be used with -j."
+        fi
+        dup=-1
+        cfc=-1
+        aspis_params="$aspis_params;profile"
+    fi
+    if [[ -n "$aspis_profile" ]] && [[ $jobs -gt 0 ]]; then
+        # the block hash of each file never matches the one of the whole program
+        error_msg "--aspis-profile requires the whole program, it cannot be used with -j."
+    fi
+    case $dup in
+        0) aspis_pipeline="eddi" ;;
+        1) aspis_pipeline="seddi" ;;
+        2) aspis_pipeline="fdsc" ;;
+        *) aspis_pipeline="no-dup" ;;
+    esac
+    case $cfc in
+        0) aspis_pipeline="$aspis_pipeline;cfcss" ;;
+        1) aspis_pipeline="$aspis_pipeline;rasm" ;;
+        2) aspis_pipeline="$aspis_pipeline;inter-rasm" ;;
+        3) aspis_pipeline="$aspis_pipeline;racfed" ;;
+        *) aspis_pipeline="$aspis_pipeline;no-cfc" ;;
+    esac
+    aspis_pipeline="$aspis_pipeline$aspis_params"
     if [[ $debug_enabled == false ]]; then
-        exe $OPT --passes="strip" $build_dir/out.ll -o $build_dir/out.ll
-        echo "  Debug mode disabled, stripped debug symbols."
+        aspis_pipeline="$aspis_pipeline;strip"
+        echo "  Debug mode disabled, stripping debug symbols."
+    fi
+    # globals are duplicated after linking the excluded files
+    if [[ -n "$exclude_file" ]]; then
+        aspis_pipeline="$aspis_pipeline;defer-globals"
     fi
-    
-    exe $OPT --passes="lower-switch" $build_dir/out.ll -o $build_dir/out.ll
 
-    ## FuncRetToRef
-    if [[ dup -ne -1 ]]; then
-        exe $OPT -load-pass-plugin=$DIR/build/passes/libEDDI.so --passes="func-ret-to-ref" $build_dir/out.ll -o $build_dir/out.ll
-    fi;
+    if [[ $jobs -gt 0 ]]; then
+        run_aspis_per_tu
+    else
+        title_msg "Front-end and pre-processing"
 
-    title_msg "ASPIS transformations"
-    ## DATA PROTECTION
-    case $dup in
-        0) 
-            exe $OPT -load-pass-plugin=$DIR/build/passes/libEDDI.so --passes="eddi-verify" $build_dir/out.ll -o $build_dir/out.ll $eddi_options
-            ;;
-        1) 
-            exe $OPT -load-pass-plugin=$DIR/build/passes/libSEDDI.so --passes="eddi-verify" $build_dir/out.ll -o $build_dir/out.ll $eddi_options
-            ;;
-        2) 
-            exe $OPT -load-pass-plugin=$DIR/build/passes/libFDSC.so --passes="eddi-verify" $build_dir/out.ll -o $build_dir/out.ll $eddi_options
-            ;;
-        *)
-            echo -e "\t--no-dup specified!"
-    esac
-    success_msg "Applied data protection passes."
+        ## FRONTEND
+        for input_file in $input_files; do
+            # Extract the filename without extension
+            filename=$(basename "$input_file" | sed 's/\.[^.]*$//')
+            # Compile the file to LLVM IR (.ll) and save it in the build directory
+            exe $CLANG "$input_file" $clang_options -S -emit-llvm -O0 -Xclang -disable-O0-optnone -o "$build_dir/$filename.ll"
+        done
+
+        ## LINK & PREPROCESS
+        exe $LLVM_LINK $build_dir/*.ll -o $build_dir/out.ll
 
-    exe $OPT --passes="simplifycfg" $build_dir/out.ll -o $build_dir/out.ll
+        success_msg "Emitted and linked IR."
 
-    ## CONTROL-FLOW CHECKING
-    case $cfc in
-        0) 
-            exe $OPT -load-pass-plugin=$DIR/build/passes/libCFCSS.so --passes="cfcss-verify" $build_dir/out.ll -o $build_dir/out.ll $cfc_options
-            ;;
-        1) 
-            exe $OPT -load-pass-plugin=$DIR/build/passes/libRASM.so --passes="rasm-verify" $build_dir/out.ll -o $build_dir/out.ll $cfc_options
-            ;;
-        2) 
-            exe $OPT -load-pass-plugin=$DIR/build/passes/libINTER_RASM.so --passes="rasm-verify" $build_dir/out.ll -o $build_dir/out.ll $cfc_options
-            ;;
-        3)
-            exe $OPT -load-pass-plugin=$DIR/build/passes/libRACFED.so --passes="racfed-verify" $build_dir/out.ll -o $build_dir/out.ll $cfc_options
-            ;;
-        *)
-            echo -e "\t--no-cfc specified!"
-    esac
-    success_msg "Applied CFC passes."
+        ## ASPIS TRANSFORMATIONS
+        title_msg "ASPIS transformations"
+        exe $OPT -load-pass-plugin=$DIR/build/passes/libASPIS.so --passes="aspis<$aspis_pipeline>" $build_dir/out.ll -o $build_dir/out.ll $aspis_options
+        success_msg "Applied data protection and CFC passes."
+    fi
 
     if [[ -n "$exclude_file" ]]; then
         # scan the directories of excluded files
@@ -414,8 +611,8 @@ run_aspis() {
     success_msg "Linked excluded files to the compilation."
 
     ## DuplicateGlobals
-    if [[ dup -ne -1 ]]; then
-        exe $OPT -load-pass-plugin=$DIR/build/passes/libEDDI.so --passes="duplicate-globals" $build_dir/out.ll -o $build_dir/out.ll -S $eddi_options
+    if [[ dup -ne -1 ]] && [[ -n "$exclude_file" ]]; then
+        exe $OPT -load-pass-plugin=$DIR/build/passes/libASPIS.so --passes="duplicate-globals" $build_dir/out.ll -o $build_dir/out.ll $aspis_options
         success_msg "Duplicated globals."
     fi;
 
@@ -434,6 +631,7 @@ run_aspis() {
         title_msg "ASPIS Profiling"
         exe $OPT -load-pass-plugin=$DIR/build/passes/libPROFILER.so --passes="aspis-insert-check-profile" $build_dir/out.ll -o $build_dir/out.ll -S
         success_msg "Code instrumented."
+        asm_files="$asm_files $DIR/passes/Profiling/runtime.c -pthread"
 
         exe $CLANG $clang_options $build_dir/out.ll $asm_files -o $build_dir/$output_file 
         success_msg "Instrumented binary emitted."
@@ -446,12 +644,35 @@ run_aspis() {
         exit
     fi;
 
+    # runtime of the block counters of --collect-profile
+    if [[ "$collect_profile" == "true" ]]; then
+        asm_files="$asm_files $DIR/passes/Profiling/runtime.c -pthread"
+    fi
+
+    # runtime mapping the shadow memory of --eddi-shadow-mem
+    if [[ "$shadow_mem" == "true" ]]; then
+        asm_files="$asm_files $DIR/passes/ShadowMemory/runtime.c"
+    fi
+
+    # runtime of the duplicated heap of --eddi-dup-heap
+    if [[ "$dup_heap" == "true" ]]; then
+        asm_files="$asm_files $DIR/passes/DupHeap/runtime.c"
+    fi
+
+    if [[ "$fault_injection" == "true" ]]; then
+        title_msg "Fault injection"
+        exe $OPT -load-pass-plugin=$DIR/build/passes/libFAULT_INJECTION.so --passes="aspis-fault-injection" $build_dir/out.ll -o $build_dir/out.ll -S -fi-sites-file=$build_dir/fault_injection_sites.csv $fi_options
+        asm_files="$asm_files $DIR/passes/FaultInjection/runtime.c"
+        success_msg "Instrumented for fault injection."
+    fi;
+
     exe $CLANG $clang_options $build_dir/out.ll $asm_files -o $build_dir/$output_file 
     success_msg "Binary emitted."
 
     #Cleanup
     if [[ $cleanup == true ]]; then
         rm -f $build_dir/*.ll
+        rm -rf $build_dir/tu
         success_msg "Cleaned cached files."
     fi
 
@@ -0,0 +1,256 @@
+/**
+ * ************************************************************************************************
+ * @brief  Plugin registering the whole ASPIS hardening as a single pipeline,
+ *         so that it runs in one `opt` invocation on in-memory IR:
+ *
+ *           opt -load-pass-plugin=libASPIS.so -passes="aspis<eddi;rasm>" ...
+ *
+ *         The parameters of `aspis<...>` are separated by `;` and select:
+ *         - the data protection: eddi (default), seddi, fdsc, no-dup;
+ *         - the control-flow checking: cfcss (default), rasm, inter-rasm,
+ *           racfed, no-cfc;
+ *         - check-elim, loop-checks: run eddi-check-elim/eddi-loop-checks;
+ *         - strip: strip the debug symbols before the hardening;
+ *         - lower-switch: turn the switches into chains of branches before the
+ *           hardening (the CFC passes handle switches natively);
+ *         - profile: instrument the code with the counters of the basic
+ *           blocks instead of hardening it, to collect the profile read by
+ *           -aspis-profile (the same parameters must be used in both builds,
+ *           so that the blocks match);
+ *         - defer-globals: do not run duplicate-globals, which has to be run
+ *           later (e.g. after linking the files excluded from the hardening);
+ *         - per-tu: harden a single translation unit, leaving the cross-module
+ *           parts (calls to the _dup functions of other units, inter-RASM,
+ *           duplicate-globals) to the link step;
+ *         - link: run only the link step on the linked per-tu modules.
+ *
+ *         The same pipeline is added at the OptimizerLast extension point, so
+ *         that the plugin can be used with `clang -fpass-plugin=libASPIS.so`.
+ *         In that case it must be requested with
+ *         `-mllvm -aspis-pipeline=<params>`. With LTO it runs after the link,
+ *         as the link-time optimizations would remove the duplicates.
+ *
+ *         The individual passes of the EDDI, RASM, CFCSS, RACFED and PROFILER
+ *         libraries are registered as well.
+ * ************************************************************************************************
+*/
+#include "ASPIS.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO/StripSymbols.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Utils/LowerSwitch.h"
+#include <llvm/Support/CommandLine.h>
+
+using namespace llvm;
+
+llvm::PassPluginLibraryInfo getEDDIPluginInfo();
+llvm::PassPluginLibraryInfo getCFCSSPluginInfo();
+llvm::PassPluginLibraryInfo getRASMPluginInfo();
+llvm::PassPluginLibraryInfo getRACFEDPluginInfo();
+llvm::PassPluginLibraryInfo getASPISCheckProfilerPluginInfo();
+
+static cl::opt<std::string> ASPISPipeline(
+    "aspis-pipeline",
+    cl::desc("Parameters of the aspis<...> pipeline added at the end of the "
+             "optimization pipeline (e.g. with clang -fpass-plugin), empty "
+             "to disable it"),
+    cl::init(""));
+
+namespace {
+
+enum class DataProtection { None, EDDI, SEDDI, FDSC };
+enum class ControlFlowChecking { None, CFCSS, RASM, InterRASM, RACFED };
+
+struct ASPISPipelineOptions {
+  DataProtection Dup = DataProtection::EDDI;
+  ControlFlowChecking CFC = ControlFlowChecking::CFCSS;
+  bool CheckElim = false;
+  bool LoopChecks = false;
+  bool Strip = false;
+  bool LowerSwitch = false;
+  bool Profile = false;
+  bool DeferGlobals = false;
+  bool PerTU = false;
+  bool Link = false;
+};
+
+bool parseASPISPipelineOptions(StringRef Params, ASPISPipelineOptions &Opts) {
+  SmallVector<StringRef, 8> Elems;
+  Params.split(Elems, ';', -1, false);
+  for (StringRef Elem : Elems) {
+    Elem = Elem.trim();
+    if (Elem == "eddi") Opts.Dup = DataProtection::EDDI;
+    else if (Elem == "seddi") Opts.Dup = DataProtection::SEDDI;
+    else if (Elem == "fdsc") Opts.Dup = DataProtection::FDSC;
+    else if (Elem == "no-dup") Opts.Dup = DataProtection::None;
+    else if (Elem == "cfcss") Opts.CFC = ControlFlowChecking::CFCSS;
+    else if (Elem == "rasm") Opts.CFC = ControlFlowChecking::RASM;
+    else if (Elem == "inter-rasm") Opts.CFC = ControlFlowChecking::InterRASM;
+    else if (Elem == "racfed") Opts.CFC = ControlFlowChecking::RACFED;
+    else if (Elem == "no-cfc") Opts.CFC = ControlFlowChecking::None;
+    else if (Elem == "check-elim") Opts.CheckElim = true;
+    else if (Elem == "loop-checks") Opts.LoopChecks = true;
+    else if (Elem == "strip") Opts.Strip = true;
+    else if (Elem == "lower-switch") Opts.LowerSwitch = true;
+    else if (Elem == "profile") Opts.Profile = true;
+    else if (Elem == "defer-globals") Opts.DeferGlobals = true;
+    else if (Elem == "per-tu") Opts.PerTU = true;
+    else if (Elem == "link") Opts.Link = true;
+    else {
+      errs() << "aspis: unknown pipeline parameter '" << Elem << "'\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Adds to MPM the same sequence of passes applied by aspis.sh between the
+ * front-end and the back-end.
+ */
+void buildASPISPipeline(ModulePassManager &MPM,
+                        const ASPISPipelineOptions &Opts) {
+  if (Opts.Link) {
+    if (Opts.Dup != DataProtection::None) {
+      MPM.addPass(EDDILink());
+    }
+    if (Opts.CFC == ControlFlowChecking::InterRASM) {
+      MPM.addPass(RASM(true));
+    }
+    if (Opts.Dup != DataProtection::None && !Opts.DeferGlobals) {
+      MPM.addPass(DuplicateGlobals());
+    }
+    return;
+  }
+
+  if (Opts.Strip) {
+    MPM.addPass(StripSymbolsPass());
+  }
+  if (Opts.LowerSwitch) {
+    MPM.addPass(createModuleToFunctionPassAdaptor(LowerSwitchPass()));
+  }
+  if (Opts.Profile) {
+    MPM.addPass(ASPISInsertCheckProfiler());
+    return;
+  }
+  // the profile is attached to the code before it is transformed, i.e. to the
+  // same blocks counted by the profile build
+  MPM.addPass(ASPISLoadProfile());
+
+  // data protection
+  if (Opts.Dup != DataProtection::None) {
+    MPM.addPass(FuncRetToRef());
+    switch (Opts.Dup) {
+    case DataProtection::EDDI:
+      MPM.addPass(EDDI(false, true, true, true, Opts.PerTU));
+      break;
+    case DataProtection::SEDDI:
+      MPM.addPass(EDDI(false, false, true, true, Opts.PerTU));
+      break;
+    case DataProtection::FDSC:
+      MPM.addPass(EDDI(true, true, true, true, Opts.PerTU));
+      break;
+    default:
+      break;
+    }
+    if (Opts.CheckElim) {
+      MPM.addPass(EDDICheckElim());
+    }
+    if (Opts.LoopChecks) {
+      MPM.addPass(EDDILoopChecks());
+    }
+  }
+
+  MPM.addPass(createModuleToFunctionPassAdaptor(SimplifyCFGPass()));
+
+  // control-flow checking
+  switch (Opts.CFC) {
+  case ControlFlowChecking::CFCSS:
+    MPM.addPass(CFCSS());
+    break;
+  case ControlFlowChecking::RASM:
+    MPM.addPass(RASM(false));
+    break;
+  case ControlFlowChecking::InterRASM:
+    // the signatures of the callees are known only after linking
+    if (!Opts.PerTU) {
+      MPM.addPass(RASM(true));
+    }
+    break;
+  case ControlFlowChecking::RACFED:
+    MPM.addPass(RACFED());
+    break;
+  default:
+    break;
+  }
+
+  if (Opts.Dup != DataProtection::None && !Opts.DeferGlobals && !Opts.PerTU) {
+    MPM.addPass(DuplicateGlobals());
+  }
+}
+
+} // namespace
+
+//-----------------------------------------------------------------------------
+// New PM Registration
+//-----------------------------------------------------------------------------
+llvm::PassPluginLibraryInfo getASPISPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "aspis", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (!Name.consume_front("aspis")) {
+                    return false;
+                  }
+                  ASPISPipelineOptions Opts;
+                  if (!Name.empty() &&
+                      !(Name.consume_front("<") && Name.consume_back(">") &&
+                        parseASPISPipelineOptions(Name, Opts))) {
+                    return false;
+                  }
+                  buildASPISPipeline(MPM, Opts);
+                  return true;
+                });
+            PB.registerOptimizerLastEPCallback(
+                [](ModulePassManager &MPM, OptimizationLevel,
+                   ThinOrFullLTOPhase Phase) {
+                  // with LTO the hardening is applied after the link
+                  if (ASPISPipeline.empty() ||
+                      Phase == ThinOrFullLTOPhase::ThinLTOPreLink ||
+                      Phase == ThinOrFullLTOPhase::FullLTOPreLink) {
+                    return;
+                  }
+                  ASPISPipelineOptions Opts;
+                  if (parseASPISPipelineOptions(ASPISPipeline, Opts)) {
+                    buildASPISPipeline(MPM, Opts);
+                  }
+                });
+            // the full LTO pipeline does not run the OptimizerLast callbacks
+            PB.registerFullLinkTimeOptimizationLastEPCallback(
+                [](ModulePassManager &MPM, OptimizationLevel) {
+                  if (ASPISPipeline.empty()) {
+                    return;
+                  }
+                  ASPISPipelineOptions Opts;
+                  if (parseASPISPipelineOptions(ASPISPipeline, Opts)) {
+                    buildASPISPipeline(MPM, Opts);
+                  }
+                });
+
+            // the individual passes
+            getEDDIPluginInfo().RegisterPassBuilderCallbacks(PB);
+            getCFCSSPluginInfo().RegisterPassBuilderCallbacks(PB);
+            getRASMPluginInfo().RegisterPassBuilderCallbacks(PB);
+            getRACFEDPluginInfo().RegisterPassBuilderCallbacks(PB);
+            getASPISCheckProfilerPluginInfo().RegisterPassBuilderCallbacks(PB);
+          }};
+}
+
+// Overrides the weak definitions of the individual passes linked in the
+// library.
+extern "C" ::llvm::PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return getASPISPluginInfo();
+}
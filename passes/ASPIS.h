@@ -1,12 +1,17 @@
 #ifndef ASPIS_H
 #define ASPIS_H
 
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/Pass.h"
 #include <llvm/IR/Instructions.h>
 #include <map>
 #include <set>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "Utils/Utils.h"
 
 using namespace llvm;
 
@@ -30,45 +35,127 @@ class FuncRetToRef : public PassInfoMixin<FuncRetToRef> {
 
 class EDDI : public PassInfoMixin<EDDI> {
     private:
+        // Checking policy: checks only at the basic blocks with more than one
+        // successor (FDSC), and kind of synchronization points checked
+        bool SelectiveChecking;
+        bool CheckAtStores;
+        bool CheckAtCalls;
+        bool CheckAtBranch;
+
+        // Per-translation-unit hardening: the calls to external functions
+        // carry the duplicated arguments in an "aspis.dup" operand bundle, to
+        // be resolved by eddi-link once the whole program is linked
+        bool PerTU;
+
         std::set<Function*> CompiledFuncs;
         std::map<Value*, StringRef> FuncAnnotations;
         std::set<Function*> OriginalFunctions;
+
+        // Links to the _dup, _ret and _original counterparts
+        HardeningLinks Links;
         
         // Map of <original, duplicate> for which we need to always use the duplicate in place of the original
-        std::map<Value*, Value*> ValuesToAlwaysDup;
+        DenseMap<Value*, Value*> ValuesToAlwaysDup;
+
+        // Third copies of the duplicated values with -eddi-replicas=3
+        DenseMap<Value*, Value*> ThirdCopies;
+
+        // Reachability between the basic blocks of the function being compiled
+        BlockReachability Reachability;
+
+        // Error accumulator of the function being compiled (accumulate check mode)
+        AllocaInst *ErrAccumulator = nullptr;
+
+        // Minimum execution count of the blocks whose checks are relaxed to
+        // fit -aspis-overhead-budget
+        uint64_t HotThreshold = UINT64_MAX;
+
+        // Blocks entered when leaving the hot blocks of the function being
+        // compiled, where the relaxed checks are tested
+        SmallVector<BasicBlock *, 8> HotExitBBs;
 
         int isUsedByStore(Instruction &I, Instruction &Use);
-        Instruction* cloneInstr(Instruction &I, std::map<Value *, Value *> &DuplicatedInstructionMap);
-        void duplicateOperands (Instruction &I, std::map<Value *, Value *> &DuplicatedInstructionMap, BasicBlock &ErrBB);
+        Instruction* cloneInstr(Instruction &I, DenseMap<Value *, Value *> &DuplicatedInstructionMap);
+        void duplicateOperands (Instruction &I, DenseMap<Value *, Value *> &DuplicatedInstructionMap, BasicBlock &ErrBB);
         Value* getPtrFinalValue(Value &V);
         Value* comparePtrs(Value &V1, Value &V2, IRBuilder<> &B);
-        void addConsistencyChecks(Instruction &I, std::map<Value *, Value *> &DuplicatedInstructionMap, BasicBlock &ErrBB);
-        void fixFuncValsPassedByReference(Instruction &I, std::map<Value *, Value *> &DuplicatedInstructionMap, IRBuilder<> &B);
+        Value* votePtrs(Value &V1, Value &V2, IRBuilder<> &B);
+        Value* compareScalars(Value &V1, Value &V2, IRBuilder<> &B);
+        Value* compareAggregates(Value &V1, Value &V2, IRBuilder<> &B, DenseMap<Value *, Value *> &DuplicatedInstructionMap);
+        Value* voteCopies(Value &Original, Value &Dup, IRBuilder<> &B, std::vector<Value *> &Checks, DenseMap<Value *, Value *> &DuplicatedInstructionMap);
+        BasicBlock *splitVerificationBB(Instruction &I);
+        AllocaInst *getErrAccumulator(Function &Fn, DenseMap<Value *, Value *> &DuplicatedInstructionMap);
+        void accumulateCheck(Value &Check, IRBuilder<> &B, DenseMap<Value *, Value *> &DuplicatedInstructionMap);
+        void flushErrAccumulator(Instruction &I, BasicBlock &ErrBB);
+        void addAccumulatorFlushes(Function &Fn, BasicBlock &ErrBB);
+        void splitHotExits(Function &Fn);
+        uint64_t estimateChecksCost(BasicBlock &BB);
+        void addConsistencyChecks(Instruction &I, DenseMap<Value *, Value *> &DuplicatedInstructionMap, BasicBlock &ErrBB);
+        void fixFuncValsPassedByReference(Instruction &I, DenseMap<Value *, Value *> &DuplicatedInstructionMap, IRBuilder<> &B);
+        Value *getShadowPtr(Value *Ptr, IRBuilder<> &B, DenseMap<Value *, Value *> &DuplicatedInstructionMap);
+        void redirectToShadow(Instruction &IClone, DenseMap<Value *, Value *> &DuplicatedInstructionMap);
+        void syncShadow(Value &Ptr, IRBuilder<> &B, DenseMap<Value *, Value *> &DuplicatedInstructionMap);
+        void emitShadowOffset(Module &Md);
+        bool duplicateHeapCall(CallBase *CInstr, DenseMap<Value *, Value *> &DuplicatedInstructionMap, int &Res);
+        Value *getArgDuplicate(Value *Arg, DenseMap<Value *, Value *> &DuplicatedInstructionMap);
+        Value *getThirdCopy(Value *V);
+        bool deferDupCall(CallBase *CInstr, DenseMap<Value *, Value *> &DuplicatedInstructionMap);
+        void createOriginalFunction(Function &Fn);
+        void removeUnusedFunctions(Module &Md);
         Function *getFunctionDuplicate(Function *Fn);
         Function *getFunctionFromDuplicate(Function *Fn);
-        Constant *duplicateConstant(Constant *C, std::map<Value *, Value *> &DuplicatedInstructionMap);
-        void duplicateGlobals(Module &Md, std::map<Value *, Value *> &DuplicatedInstructionMap);
+        Constant *duplicateConstant(Constant *C, DenseMap<Value *, Value *> &DuplicatedInstructionMap);
+        void duplicateGlobals(Module &Md, DenseMap<Value *, Value *> &DuplicatedInstructionMap);
         bool isAllocaForExceptionHandling(AllocaInst &I);
-        int transformCallBaseInst(CallBase *CInstr, std::map<Value *, Value *> &DuplicatedInstructionMap, IRBuilder<> &B, BasicBlock &ErrBB);
-        int duplicateInstruction(Instruction &I, std::map<Value *, Value *> &DuplicatedInstructionMap, BasicBlock &ErrBB);
-        bool isValueDuplicated(std::map<Value *, Value *> &DuplicatedInstructionMap, Instruction &V);
-        Function *duplicateFnArgs(Function &Fn, Module &Md, std::map<Value *, Value *> &DuplicatedInstructionMap);
+        int transformCallBaseInst(CallBase *CInstr, DenseMap<Value *, Value *> &DuplicatedInstructionMap, IRBuilder<> &B, BasicBlock &ErrBB);
+        int duplicateInstruction(Instruction &I, DenseMap<Value *, Value *> &DuplicatedInstructionMap, BasicBlock &ErrBB);
+        bool isValueDuplicated(DenseMap<Value *, Value *> &DuplicatedInstructionMap, Instruction &V);
+        Function *duplicateFnArgs(Function &Fn, Module &Md, DenseMap<Value *, Value *> &DuplicatedInstructionMap);
 
     public:
+        EDDI();
+        EDDI(bool SelectiveChecking, bool CheckAtStores, bool CheckAtCalls, bool CheckAtBranch,
+             bool PerTU = false)
+            : SelectiveChecking(SelectiveChecking), CheckAtStores(CheckAtStores),
+              CheckAtCalls(CheckAtCalls), CheckAtBranch(CheckAtBranch), PerTU(PerTU) {}
+
         PreservedAnalyses run(Module &M,
                               ModuleAnalysisManager &);
 
         static bool isRequired() { return true; }
 };
 
+class EDDICheckElim : public PassInfoMixin<EDDICheckElim> {
+    public:
+        PreservedAnalyses run(Module &Md, ModuleAnalysisManager &AM);
+        static bool isRequired() { return true; }
+};
+
+class EDDILoopChecks : public PassInfoMixin<EDDILoopChecks> {
+    public:
+        PreservedAnalyses run(Module &Md, ModuleAnalysisManager &AM);
+        static bool isRequired() { return true; }
+};
+
+class EDDILink : public PassInfoMixin<EDDILink> {
+    private:
+        HardeningLinks Links;
+
+        bool resolveDupCall(Module &Md, CallBase *CInstr);
+
+    public:
+        PreservedAnalyses run(Module &Md, ModuleAnalysisManager &AM);
+        static bool isRequired() { return true; }
+};
+
 class DuplicateGlobals : public PassInfoMixin<DuplicateGlobals> {
     private: 
         std::map<GlobalVariable*, GlobalVariable*> DuplicatedGlobals;
+        HardeningLinks Links;
 
-        void getFunctionsToNotModify(std::string Filename, std::set<std::string> &FunctionsToNotModify);
         GlobalVariable* getDuplicatedGlobal(Module &Md, GlobalVariable &GV);
-        void duplicateCall(Module &Md, CallBase* UCall, Value* Original, Value* Copy);
-        void replaceCallsWithOriginalCalls(Module &Md, std::set<std::string> &FunctionsToNotModify);
+        void duplicateCall(Module &Md, CallBase* UCall, Value* Original, Value* Copy, Value* Third);
+        void replaceCallsWithOriginalCalls(Module &Md, std::set<Function*> &FunctionsToNotModify);
 
     public:
         PreservedAnalyses run(Module &M,
@@ -100,10 +187,54 @@ class ASPISInsertCheckProfiler : public PassInfoMixin<ASPISInsertCheckProfiler>
         static bool isRequired() { return true; }
 };
 
+// Attaches the block counts of -aspis-profile to the instructions, for the
+// profile-guided relaxation of the checks (-aspis-overhead-budget)
+class ASPISLoadProfile : public PassInfoMixin<ASPISLoadProfile> {
+    public:
+        PreservedAnalyses run(Module &M,
+                              ModuleAnalysisManager &);
+
+        static bool isRequired() { return true; }
+};
+
+// FAULT INJECTION
+enum FISiteKind { FIValue, FIAddress, FIBranch };
+
+class FaultInjection : public PassInfoMixin<FaultInjection> {
+    private:
+        struct FISite {
+            FISiteKind Kind;
+            std::string FnName;
+            unsigned Bits;
+            std::string Location;
+            // name and type of the value corrupted
+            std::string Name;
+            std::string Type;
+        };
+        std::vector<FISite> Sites;
+        FunctionCallee InjectFn;
+
+        Value *createInjection(IRBuilder<> &B, Value *V, uint32_t Site, Instruction *&Head);
+        void addSite(Instruction &I, Value &V, FISiteKind Kind, unsigned Bits);
+        void injectValue(Instruction &I, const DataLayout &DL);
+        void injectOperand(Instruction &I, unsigned OpIdx, FISiteKind Kind, const DataLayout &DL);
+        void instrumentHandlers(Module &Md);
+        void persistSites();
+
+    public:
+        PreservedAnalyses run(Module &M,
+                              ModuleAnalysisManager &);
+
+        static bool isRequired() { return true; }
+};
+
 // CONTROL-FLOW CHECKING
 class CFCSS : public PassInfoMixin<CFCSS> {
     private:
         std::map<Value*, StringRef> FuncAnnotations;
+        // Minimum execution count of the blocks whose signature is updated
+        // but not checked, to fit -aspis-overhead-budget
+        uint64_t HotThreshold = UINT64_MAX;
 
         #if (LOG_COMPILED_FUNCS == 1)
         std::set<Function*> CompiledFuncs;
@@ -113,7 +244,7 @@ class CFCSS : public PassInfoMixin<CFCSS> {
         BasicBlock* getFirstPredecessor(BasicBlock &BB, const std::map<BasicBlock*, int> &BBSigs);
         int getNeighborSig(BasicBlock &BB, const std::map<BasicBlock*, int> &BBSigs);
         bool hasNPredecessorsOrMore(BasicBlock &BB, int N, const std::map<BasicBlock*, int> &BBSigs);
-        void sortBasicBlocks(const std::map<BasicBlock *, int> &BBSigs, const std::map<int, BasicBlock *> &NewBBs, const std::map<Function*, BasicBlock*> &FuncErrBBs);
+        void sortBasicBlocks(const std::vector<BasicBlock *> &FnBBs, const std::map<BasicBlock *, int> &BBSigs, const std::map<int, BasicBlock *> &NewBBs, BasicBlock &ErrBB);
         void createCFGVerificationBB (BasicBlock &BB,
                                  const std::map<BasicBlock *, int> &BBSigs,
                                  std::map<int, BasicBlock *> *NewBBs,
@@ -129,18 +260,37 @@ class CFCSS : public PassInfoMixin<CFCSS> {
 
 class RASM : public PassInfoMixin<RASM> {
     private:
+        // Enables the checks across function calls (inter-RASM)
+        bool InterFunctionCFC;
+
         std::map<Value*, StringRef> FuncAnnotations;
         std::map<BasicBlock*, BasicBlock*> NewBBs;
+        // Minimum execution count of the blocks whose signature is updated
+        // but not checked, to fit -aspis-overhead-budget
+        uint64_t HotThreshold = UINT64_MAX;
+
+        // inter-RASM only: calls at the end of the split blocks, entry blocks
+        // of the functions and successors of the split blocks
+        std::map<BasicBlock*, CallBase *> CallBBs;
+        std::map<Function*, BasicBlock*> FuncEntryBlocks;
+        std::map<BasicBlock*, BasicBlock*> SplitBBs;
+
+        // intra-function RASM only: the signatures are promoted to SSA values
+        // after the instrumentation (see -rasm-sig-storage)
+        bool RegisterSig = false;
 
         #if (LOG_COMPILED_FUNCS == 1)
         std::set<Function*> CompiledFuncs;
         #endif
 
         void initializeBlocksSignatures(Module &Md, std::map<BasicBlock*, int> &RandomNumberBBs, std::map<BasicBlock*, int> &SubRanPrevVals);
+        Value *loadSig(IRBuilder<> &B, Value &Sig);
+        void storeSig(IRBuilder<> &B, Value *Val, Value &Sig);
         void splitBBsAtCalls(Module &Md);
         CallBase *isCallBB (BasicBlock &BB);
         void initializeEntryBlocksMap(Module &Md);
         Value *getCondition(Instruction &I);
+        void redirectPredecessors(BasicBlock &BB, BasicBlock &NewBB);
         void createCFGVerificationBB (  BasicBlock &BB, 
                                     std::map<BasicBlock*, int> &RandomNumberBBs, 
                                     std::map<BasicBlock*, int> &SubRanPrevVals, 
@@ -149,6 +299,9 @@ class RASM : public PassInfoMixin<RASM> {
                                     BasicBlock &ErrBB);
 
     public:
+        RASM();
+        RASM(bool InterFunctionCFC) : InterFunctionCFC(InterFunctionCFC) {}
+
         PreservedAnalyses run(Module &M,
                               ModuleAnalysisManager &);
 
@@ -163,6 +316,12 @@ class RACFED : public PassInfoMixin<RACFED> {
 private:
   std::map<Value *, StringRef> FuncAnnotations;
 
+  /**
+   * Minimum execution count of the blocks whose signature is updated but not
+   * checked, to fit -aspis-overhead-budget.
+   */
+  uint64_t HotThreshold = UINT64_MAX;
+
   /**
    * Compile time signature map.
    *
@@ -185,6 +344,13 @@ private:
    */
   std::unordered_map<BasicBlock *, uint64_t> sumIntraInstruction;
 
+  /**
+   * Compile time signatures and compileTimeSig + subRanPrevVal sums already
+   * assigned in the module, to draw unique values in constant time.
+   */
+  std::unordered_set<uint32_t> usedCompileTimeSigs;
+  std::unordered_set<uint32_t> usedSigSums;
+
 
   #if (LOG_COMPILED_FUNCS == 1)
   std::set<Function *> CompiledFuncs;
@@ -233,7 +399,7 @@ private:
   Instruction *checkOnReturn(BasicBlock &BB, 
 			GlobalVariable *RuntimeSigGV, 
 			Type *IntType, BasicBlock &ErrBB,
-			Value *BckupRunSig);
+			Value *BckupRunSig, SignatureGenerator &RetRNG);
 
 public:
   PreservedAnalyses run(Module &Md, ModuleAnalysisManager &);
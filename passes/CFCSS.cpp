@@ -7,6 +7,7 @@
  * ************************************************************************************************
 */
 #include "ASPIS.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/Attributes.h"
 #include "llvm/IR/Function.h"
@@ -34,13 +35,20 @@ using namespace llvm;
  * @param BBSigs an associative map containing Md's basic blocks associated with their signatures
  */
 void CFCSS::initializeBlocksSignatures(Module &Md, std::map<BasicBlock*, int> &BBSigs) {
-  int Counter = 1;
+  // the signatures are positive (-1 and 0 have a special meaning) and unique
+  // in the module
+  std::unordered_set<int> UsedSigs;
   for (Function &Fn : Md) {
     if (shouldCompile(Fn, FuncAnnotations)) {
+      SignatureGenerator RNG(Fn, "cfcss.sig");
       for (BasicBlock &BB : Fn) {
-        if (!BB.getName().equals_insensitive("errbb")) // we skip this since "errbb" Basic Blocks are generated by EDDI
-          BBSigs.insert(std::pair<BasicBlock *, int>(&BB, Counter));
-        Counter++;
+        if (!BB.getName().equals_insensitive("errbb")) { // we skip this since "errbb" Basic Blocks are generated by EDDI
+          int Sig;
+          do {
+            Sig = RNG.next(1, 0x7fffffff);
+          } while (!UsedSigs.insert(Sig).second);
+          BBSigs.insert(std::pair<BasicBlock *, int>(&BB, Sig));
+        }
       }
     }
   }
@@ -112,31 +120,45 @@ bool CFCSS::hasNPredecessorsOrMore(BasicBlock &BB, int N, const std::map<BasicBl
 }
 
 /**
- *
+ * Moves the CFG-verification basic blocks of Fn before the blocks they check
+ * and redirects the predecessors of each checked block to its CFG-verification
+ * block.
+ * @param FnBBs The original basic blocks of Fn (i.e. the ones having a signature)
  * @param BBSigs
  * @param NewBBs
- * 
+ * @param ErrBB The error basic block of Fn
  */
-void CFCSS::sortBasicBlocks(const std::map<BasicBlock *, int> &BBSigs, const std::map<int, BasicBlock *> &NewBBs, const std::map<Function*, BasicBlock*> &FuncErrBBs) {
-  for (auto Pair : BBSigs) { // for each element in the original set of blocks
-    int BBSig = Pair.second;
-    auto *BB = Pair.first;
+void CFCSS::sortBasicBlocks(const std::vector<BasicBlock *> &FnBBs, const std::map<BasicBlock *, int> &BBSigs, const std::map<int, BasicBlock *> &NewBBs, BasicBlock &ErrBB) {
+  for (auto *BB : FnBBs) { // for each original block of the function
+    int BBSig = BBSigs.find(BB)->second;
     if (NewBBs.find(BBSig) != NewBBs.end()) { // check if a new basic block has been created for the signature
       auto *CFGVerificationBB = NewBBs.find(BBSig)->second;
+
+      // collect the predecessors before adding the branch from CFGVerificationBB
+      // to BB. Only the original blocks are redirected, so that the
+      // CFG-verification blocks keep branching to the block they check
+      SmallPtrSet<BasicBlock *, 4> Preds;
+      for (auto *Pred : predecessors(BB)) {
+        if (BBSigs.find(Pred) != BBSigs.end()) {
+          Preds.insert(Pred);
+        }
+      }
+
       // re-insert the CFGVerificationBB into the function in the right position
       CFGVerificationBB->removeFromParent();
-      CFGVerificationBB->insertInto(BB->getParent(), Pair.first);
+      CFGVerificationBB->insertInto(BB->getParent(), BB);
 
       IRBuilder<> B(CFGVerificationBB);
-      // errs()<<"cond for "<<CFGVerificationBB->getName()<<": "<<
-      // Cond->getValueName() <<"\n";
 
-      if (!isa<InvokeInst>(BB->getTerminator())) {
+      if (!isa<InvokeInst>(BB->getTerminator()) &&
+          getProfileCount(*BB) < HotThreshold) {
         Value *Cond = &CFGVerificationBB->back();
-        B.CreateCondBr(Cond, BB, FuncErrBBs.find(BB->getParent())->second);
+        B.CreateCondBr(Cond, BB, &ErrBB);
       }
       else {
-        //if the BB has an invoke at the end branch unconditionally
+        //if the BB has an invoke at the end, or it is a hot block whose check
+        //does not fit -aspis-overhead-budget, branch unconditionally (G is
+        //still updated, so the error is caught by the next check)
         B.CreateBr(BB);
       }
       // move all the phi instructions from the next BB into the CFGVerificationBB
@@ -145,16 +167,14 @@ void CFCSS::sortBasicBlocks(const std::map<BasicBlock *, int> &BBSigs, const std
         PHIInst.removeFromParent();
         PHIInst.insertBefore(&CFGVerificationBB->front());
       }
-      
+
       // update each predecessor Pred of BB replacing their successors BB with CFGVerificationBB
-      for (auto Inner : BBSigs) {
-        auto *Pred = Inner.first;
-        auto *I = Pred->getTerminator();
-        I->replaceSuccessorWith(BB, CFGVerificationBB);
+      for (auto *Pred : Preds) {
+        Pred->getTerminator()->replaceSuccessorWith(BB, CFGVerificationBB);
       }
     }
-    }
   }
+}
 
 /**
  * Creates a new basic block for the CFG verification of basic block BB.
@@ -243,12 +263,17 @@ PreservedAnalyses CFCSS::run(Module &Md, ModuleAnalysisManager &AM) {
   std::map<BasicBlock *, int> BBSigs;
   initializeBlocksSignatures(Md, BBSigs);
 
+  // the comparison and the branch checking each block, to apply
+  // -aspis-overhead-budget
+  std::vector<std::pair<uint64_t, uint64_t>> ChecksCosts;
+  for (auto &[BB, Sig] : BBSigs) {
+    ChecksCosts.push_back({getProfileCount(*BB), 2});
+  }
+  HotThreshold = getHotBlockThreshold(Md, ChecksCosts);
+
   // map of signatures of basic blocks and their CFG-verification basic blocks
   std::map<int, BasicBlock *> NewBBs;
 
-  // collection of Error Basic Blocks for each function
-  std::map<Function*, BasicBlock*> ErrBBs;
-  
   for (Function &Fn : Md) {
     if (shouldCompile(Fn, FuncAnnotations)) {
       #if (LOG_COMPILED_FUNCS == 1)
@@ -284,13 +309,20 @@ PreservedAnalyses CFCSS::run(Module &Md, ModuleAnalysisManager &AM) {
         B.CreateStore(InstrD, D);
       }
 
+      // the original blocks of the function, collected before adding new ones
+      std::vector<BasicBlock *> FnBBs;
+      for (BasicBlock &BB : Fn) {
+        if (BBSigs.find(&BB) != BBSigs.end()) {
+          FnBBs.push_back(&BB);
+        }
+      }
+
       // add the error basic block to jump to in case of error
       BasicBlock *ErrBB = BasicBlock::Create(Fn.getContext(), "ErrBB", &Fn);
 
       // insert the actual cfg verification basic blocks in the function
-      for (auto &Elem : BBSigs) {
-        BasicBlock *BB = Elem.first;
-        if (!BB->isEntryBlock() && BB->getParent() == &Fn) { 
+      for (auto *BB : FnBBs) {
+        if (!BB->isEntryBlock()) {
           createCFGVerificationBB(*BB, BBSigs, &NewBBs, *ErrBB, G, D);
         }
       }
@@ -301,13 +333,14 @@ PreservedAnalyses CFCSS::run(Module &Md, ModuleAnalysisManager &AM) {
           getLinkageName(linkageMap,"SigMismatch_Handler"), FunctionType::getVoidTy(Md.getContext()));
       ErrB.CreateCall(CalleeF)->setDebugLoc(debugLoc);
       ErrB.CreateUnreachable();
-      ErrBBs.insert(std::pair<Function*, BasicBlock*>(&Fn, ErrBB));
+
+      // reorder the basic blocks, fixing predecessors and successors. This is
+      // done once all the CFG-verification blocks of Fn have been created, as
+      // they are computed on the original CFG
+      sortBasicBlocks(FnBBs, BBSigs, NewBBs, *ErrBB);
     }
   }
 
-  // reorder the basic blocks, fixing predecessors and successors.
-  sortBasicBlocks(BBSigs, NewBBs, ErrBBs);
-
   #if (LOG_COMPILED_FUNCS == 1)
   persistCompiledFunctions(CompiledFuncs, "compiled_cfcss_functions.csv");
   #endif
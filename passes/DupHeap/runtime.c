@@ -0,0 +1,81 @@
+/**
+ * ************************************************************************************************
+ * @brief  Runtime of the duplicated heap of EDDI (-eddi-dup-heap), linked to the
+ *         hardened binaries by `aspis.sh --eddi-dup-heap`.
+ *
+ *         Each heap object shares its block with its duplicate, which starts
+ *         at the size of the object rounded up to ASPIS_DUP_HEAP_ALIGN. EDDI
+ *         doubles the size passed to malloc and operator new at the call
+ *         site, and redirects calloc and realloc to the functions below.
+ *         Blocks allocated by code that is not hardened have no duplicate.
+ * ************************************************************************************************
+*/
+#define _GNU_SOURCE
+#include <malloc.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* as DupHeapAlign in EDDI.cpp */
+#define ASPIS_DUP_HEAP_ALIGN 16
+
+/* defined by the hardened program */
+void DataCorruption_Handler(void);
+
+static size_t aspis_dup_stride(size_t size) {
+  return (size + ASPIS_DUP_HEAP_ALIGN - 1) & ~(size_t)(ASPIS_DUP_HEAP_ALIGN - 1);
+}
+
+/* returns NULL if the block would not fit */
+static void *aspis_dup_malloc(size_t size) {
+  if (size > (SIZE_MAX >> 1) - (ASPIS_DUP_HEAP_ALIGN - 1)) {
+    return NULL;
+  }
+  return malloc(aspis_dup_stride(size) << 1);
+}
+
+void *aspis_dup_calloc(size_t nmemb, size_t size) {
+  if (size != 0 && nmemb > SIZE_MAX / size) {
+    return NULL;
+  }
+  size_t total = nmemb * size;
+  if (total > (SIZE_MAX >> 1) - (ASPIS_DUP_HEAP_ALIGN - 1)) {
+    return NULL;
+  }
+  return calloc(1, aspis_dup_stride(total) << 1);
+}
+
+/* replica is the duplicate of ptr, equal to it if the block has none */
+void *aspis_dup_realloc(void *ptr, void *replica, size_t size) {
+  if (ptr == NULL) {
+    return aspis_dup_malloc(size);
+  }
+  if (size == 0) {
+    free(ptr);
+    return NULL;
+  }
+
+  size_t usable = malloc_usable_size(ptr);
+  size_t old_stride;
+  const char *old_replica;
+  if ((uintptr_t)replica > (uintptr_t)ptr) {
+    old_stride = (uintptr_t)replica - (uintptr_t)ptr;
+    old_replica = replica;
+    if (old_stride > usable / 2) {
+      DataCorruption_Handler();
+    }
+  } else {
+    old_stride = usable;
+    old_replica = ptr;
+  }
+
+  char *new_ptr = aspis_dup_malloc(size);
+  if (new_ptr == NULL) {
+    return NULL;
+  }
+  size_t copied = old_stride < size ? old_stride : size;
+  memcpy(new_ptr, ptr, copied);
+  memcpy(new_ptr + aspis_dup_stride(size), old_replica, copied);
+  free(ptr);
+  return new_ptr;
+}
@@ -31,22 +31,6 @@ using namespace llvm;
 #define DEBUG_TYPE "eddi_verification"
 
 
-/**
- * Reads the file `Filename` and populates the set with the entries of the file.
- * They represent the names of the functions for which we don't want to perform the duplication
-*/
-void DuplicateGlobals::getFunctionsToNotModify(std::string Filename, std::set<std::string> &FunctionsToNotModify) {
-  std::string line;
-  std::ifstream file;
-  file.open(Filename);
-  if (file.is_open()) {
-    while ( getline (file,line) ) {
-      FunctionsToNotModify.insert(line);
-    }
-    file.close();
-  }
-}
-
 /**
  * Returns the duplicate of GV in Md if it exists, NULL otherwise.
 */
@@ -54,63 +38,55 @@ GlobalVariable* DuplicateGlobals::getDuplicatedGlobal(Module &Md, GlobalVariable
   if (DuplicatedGlobals.find(&GV) != DuplicatedGlobals.end()) {
     return DuplicatedGlobals.find(&GV)->second;
   }
-  else if (GV.getName().ends_with("_dup")) {
-    return NULL;
-  }
   else {
-    return Md.getGlobalVariable(GV.getName().str() + "_dup");
+    return dyn_cast_or_null<GlobalVariable>(Links.get(&GV, HardeningLinks::Dup));
   }
 }
 
 /**
  * Modifies the call instruction `UCall` making it call the _dup version of the called function.
- * Moreover, it substitutes Original with Copy in the copied argument of the function called.
+ * Moreover, it substitutes Original with Copy (and with Third, its third copy with
+ * -eddi-replicas=3) in the copied arguments of the function called.
 */
-void DuplicateGlobals::duplicateCall(Module &Md, CallBase* UCall, Value* Original, Value* Copy) {
+void DuplicateGlobals::duplicateCall(Module &Md, CallBase* UCall, Value* Original, Value* Copy, Value* Third) {
   if (UCall->getCalledFunction() == NULL || !UCall->getCalledFunction()->hasName()) {
     return;
   }
+  Function *Callee = UCall->getCalledFunction();
   // if the function is already a _dup function, we just duplicate the operand corresponding to our global
-  if (UCall->getCalledFunction()->getName().ends_with("_dup")) {
-    int i = 0;
-    for (auto &Op : UCall->args()) {
-      if (Op == Original) {
-        if (AlternateMemMapEnabled == false) {
-          UCall->setOperand(i + UCall->arg_size()/2, Copy);
-        } else {
-          UCall->setOperand(i+1, Copy);
+  if (auto *FnOrig = dyn_cast_or_null<Function>(Links.getSource(Callee, HardeningLinks::Dup))) {
+    DupArgLayout Layout = getDupArgLayout(FnOrig->getFunctionType());
+    for (unsigned i = 0; i < FnOrig->arg_size(); i++) {
+      if (UCall->getArgOperand(Layout.Orig[i]) == Original) {
+        if (Layout.Dup[i] >= 0) {
+          UCall->setArgOperand(Layout.Dup[i], Copy);
+        }
+        if (Layout.Third[i] >= 0) {
+          UCall->setArgOperand(Layout.Third[i], Third);
         }
       }
-      i++;
     }
   }
   else {
     // try to get the dup function
-    StringRef name = UCall->getCalledFunction()->getName();
-    auto *Fn = Md.getFunction(name.str() + "_dup");
+    auto *Fn = dyn_cast_or_null<Function>(Links.get(Callee, HardeningLinks::Dup));
     // if the function exists, we substitute the original with the duplicate
     if (Fn != NULL) {
-      std::vector<Value*> args;
-      int i=0;
-      for (Value *Old : UCall->args()) {
-        args.push_back(Old);
-        if (AlternateMemMapEnabled == false) {
-          if (Old == Original) {
-            args.insert(args.begin() + i, Copy);
-          }
-          else {
-            args.insert(args.begin() + i, Old);
-          }
+      DupArgLayout Layout = getDupArgLayout(Callee->getFunctionType());
+      std::vector<Value*> args(Layout.NumArgs);
+      for (unsigned i = 0; i < Callee->arg_size(); i++) {
+        Value *Old = UCall->getArgOperand(i);
+        args[Layout.Orig[i]] = Old;
+        if (Layout.Dup[i] >= 0) {
+          args[Layout.Dup[i]] = Old == Original ? Copy : Old;
         }
-        else {
-          if (Old == Original) {
-            args.push_back(Copy);
-          }
-          else {
-            args.push_back(Old);
-          }
+        if (Layout.Third[i] >= 0) {
+          args[Layout.Third[i]] = Old == Original ? Third : Old;
         }
-        i++;
+      }
+      // the variadic arguments are passed once
+      for (unsigned i = Callee->arg_size(); i < UCall->arg_size(); i++) {
+        args.push_back(UCall->getArgOperand(i));
       }
       // replace the original with the dup function
       IRBuilder<> B(UCall);
@@ -124,15 +100,16 @@ void DuplicateGlobals::duplicateCall(Module &Md, CallBase* UCall, Value* Origina
 /**
  * Replaces the calls in the excluded functions with the 
 */
-void DuplicateGlobals::replaceCallsWithOriginalCalls(Module &Md, std::set<std::string> &FunctionsToNotModify) {
+void DuplicateGlobals::replaceCallsWithOriginalCalls(Module &Md, std::set<Function*> &FunctionsToNotModify) {
   for (Function &Fn : Md) {
-    if (Fn.hasName() && FunctionsToNotModify.find(Fn.getName().str()) == FunctionsToNotModify.end()) {
+    if (FunctionsToNotModify.find(&Fn) == FunctionsToNotModify.end()) {
       for (BasicBlock &BB : Fn) {
         for (Instruction &I : BB) {
           if (isa<CallBase>(I)) {
             CallBase *ICall = &(cast<CallBase>(I));
-            if (ICall->getCalledFunction() != NULL && ICall->getCalledFunction()->hasName()) {
-              Function *OriginalFn = Md.getFunction(ICall->getCalledFunction()->getName().str() + "_original");
+            if (ICall->getCalledFunction() != NULL) {
+              auto *OriginalFn = dyn_cast_or_null<Function>(
+                  Links.get(ICall->getCalledFunction(), HardeningLinks::Original));
               if (OriginalFn != NULL) {
                 ICall->setCalledFunction(OriginalFn);
               }
@@ -149,13 +126,20 @@ void DuplicateGlobals::replaceCallsWithOriginalCalls(Module &Md, std::set<std::s
  * @return
  */
 PreservedAnalyses DuplicateGlobals::run(Module &Md, ModuleAnalysisManager &AM) {
+  // in shadow memory mode the globals are not duplicated, and the _dup
+  // functions take the pointers once
+  if (ShadowMemEnabled) {
+    return PreservedAnalyses::all();
+  }
 
   std::map<Value*, StringRef> FuncAnnotations;
   getFuncAnnotations(Md, FuncAnnotations);
 
+  Links.load(Md);
+
   // we find the functions not to modify between the ones we already compiled with EDDI
-  std::set<std::string> FunctionsToNotModify;
-  getFunctionsToNotModify("compiled_eddi_functions.csv", FunctionsToNotModify);
+  std::set<Function*> FunctionsToNotModify;
+  getCompiledFunctions(Md, "aspis.eddi.compiled", FunctionsToNotModify);
 
   std::list<GlobalVariable*> Globals;
   for (GlobalVariable &GV : Md.globals()) {
@@ -171,7 +155,7 @@ PreservedAnalyses DuplicateGlobals::run(Module &Md, ModuleAnalysisManager &AM) {
     if (! (GV->getType()->isFunctionTy() || GV->isConstant() || GV->getValueType()->isStructTy() || GV->getValueType()->isArrayTy() || GV->getValueType()->isPointerTy())
         || toDuplicate/* && ! GV.getName().ends_with("_dup") */) {
       // see if the global variable has already been cloned
-      GlobalVariable *GVCopy = Md.getGlobalVariable((GV->getName() + "_dup").str(), true);
+      GlobalVariable *GVCopy = dyn_cast_or_null<GlobalVariable>(Links.get(GV, HardeningLinks::Dup));
       Constant *Initializer = NULL;
       if (GV->hasInitializer()) {
         Initializer = GV->getInitializer();
@@ -181,8 +165,15 @@ PreservedAnalyses DuplicateGlobals::run(Module &Md, ModuleAnalysisManager &AM) {
           GVCopy->setInitializer(Initializer);
           GVCopy->setExternallyInitialized(GV->isExternallyInitialized());
         }
+        // the same holds for the third copy with -eddi-replicas=3
+        auto *GVThird = dyn_cast_or_null<GlobalVariable>(Links.get(GV, HardeningLinks::Third));
+        if (GVThird != NULL && !GVThird->isExternallyInitialized()) {
+          GVThird->setInitializer(Initializer);
+          GVThird->setExternallyInitialized(GV->isExternallyInitialized());
+        }
       }
-      if (GVCopy == NULL && !GV->getName().ends_with_insensitive("_dup")) {
+      if (GVCopy == NULL && !Links.getSource(GV, HardeningLinks::Dup) &&
+          !Links.getSource(GV, HardeningLinks::Third)) {
         // get a copy of the global variable
         GVCopy = new GlobalVariable(
                                       Md,
@@ -198,10 +189,29 @@ PreservedAnalyses DuplicateGlobals::run(Module &Md, ModuleAnalysisManager &AM) {
                                       );
         GVCopy->setAlignment(GV->getAlign());
         DuplicatedGlobals.insert(std::pair<GlobalVariable*, GlobalVariable*>(GV, GVCopy));
+        Links.add(*GV, *GVCopy, HardeningLinks::Dup);
+
+        if (EDDIReplicas == 3) {
+          GlobalVariable *GVThird = new GlobalVariable(
+                                      Md,
+                                      GV->getValueType(),
+                                      false,
+                                      GV->getLinkage(),
+                                      Initializer,
+                                      GV->getName()+"_tmr",
+                                      GV,
+                                      GV->getThreadLocalMode(),
+                                      GV->getAddressSpace(),
+                                      GV->isExternallyInitialized()
+                                      );
+          GVThird->setAlignment(GV->getAlign());
+          Links.add(*GV, *GVThird, HardeningLinks::Third);
+        }
       }
     }
 
     GlobalVariable *GVCopy = getDuplicatedGlobal(Md, *GV);
+    auto *GVThird = dyn_cast_or_null<GlobalVariable>(Links.get(GV, HardeningLinks::Third));
     if (GVCopy != NULL) {
       // clone all the stores performed on GV
 
@@ -210,7 +220,7 @@ PreservedAnalyses DuplicateGlobals::run(Module &Md, ModuleAnalysisManager &AM) {
         Users.push_back(U);
       }
       for (User *U : Users) {
-        if (isa<Instruction>(U) && FunctionsToNotModify.find(cast<Instruction>(U)->getParent()->getParent()->getName().str()) == FunctionsToNotModify.end()) {
+        if (isa<Instruction>(U) && FunctionsToNotModify.find(cast<Instruction>(U)->getParent()->getParent()) == FunctionsToNotModify.end()) {
           // the user has to be a store of a excluded function writing the global 
           if (isa<StoreInst>(U) && 
               cast<StoreInst>(U)->getPointerOperand() == GV) {
@@ -221,6 +231,12 @@ PreservedAnalyses DuplicateGlobals::run(Module &Md, ModuleAnalysisManager &AM) {
 
             // change the operand
             IClone->setOperand(IClone->getPointerOperandIndex(), GVCopy);
+
+            if (GVThird != NULL) {
+              StoreInst *IThird = cast<StoreInst>(I->clone());
+              IThird->insertAfter(IClone);
+              IThird->setOperand(IThird->getPointerOperandIndex(), GVThird);
+            }
           }
           else if (isa<LoadInst>(U)) {
             for (User *URec : U->users()) {
@@ -231,14 +247,20 @@ PreservedAnalyses DuplicateGlobals::run(Module &Md, ModuleAnalysisManager &AM) {
                 ULoadClone->insertAfter(ULoad);
                 int id = ULoad->getPointerOperandIndex();
                 ULoadClone->setOperand(id, GVCopy);
+                Instruction *ULoadThird = NULL;
+                if (GVThird != NULL) {
+                  ULoadThird = ULoad->clone();
+                  ULoadThird->insertAfter(ULoadClone);
+                  ULoadThird->setOperand(id, GVThird);
+                }
                 
-                duplicateCall(Md, cast<CallBase>(URec), ULoad, ULoadClone);
+                duplicateCall(Md, cast<CallBase>(URec), ULoad, ULoadClone, ULoadThird);
                 break;
               }
             }
           }
         else if (isa<CallBase>(U)) {
-            duplicateCall(Md, cast<CallBase>(U), GV, GVCopy);
+            duplicateCall(Md, cast<CallBase>(U), GV, GVCopy, GVThird);
           }
         }
       }
@@ -247,12 +269,12 @@ PreservedAnalyses DuplicateGlobals::run(Module &Md, ModuleAnalysisManager &AM) {
 
   std::set<Function*> Excluded;
   for (Function &Fn : Md) {
-    if (FunctionsToNotModify.find(Fn.getName().str()) == FunctionsToNotModify.end()){
+    if (FunctionsToNotModify.find(&Fn) == FunctionsToNotModify.end()){
       for (BasicBlock &BB : Fn) {
         for (Instruction &I : BB) {
           if (isa<CallBase>(I)) {
             Function *CalledFn = cast<CallBase>(I).getCalledFunction();
-            if (CalledFn != NULL && CalledFn->hasName() && FunctionsToNotModify.find(CalledFn->getName().str()) != FunctionsToNotModify.end()) {
+            if (CalledFn != NULL && FunctionsToNotModify.find(CalledFn) != FunctionsToNotModify.end()) {
               Excluded.insert(CalledFn);
             }
           }
@@ -8,11 +8,18 @@
  * ************************************************************************************************
  */
 #include "ASPIS.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/Attributes.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Metadata.h"
 #include "llvm/Pass.h"
 #include "llvm/Passes/PassBuilder.h"
@@ -33,6 +40,7 @@
 #include <llvm/Support/Errc.h>
 #include <llvm/Support/ModRef.h>
 #include <map>
+#include <optional>
 #include <queue>
 #include <unordered_set>
 
@@ -42,11 +50,15 @@ using namespace llvm;
 
 #define DEBUG_TYPE "eddi_verification"
 
+STATISTIC(NumChecksRelaxed, "Number of EDDI checks folded into the error accumulator to fit -aspis-overhead-budget");
+
 #ifndef DC_HANDLER_INLINE
 //#define DC_HANDLER_INLINE
 #endif
 
 /**
+ * Default checking policy (see the EDDI, FDSC and SEDDI libraries), can be
+ * overridden with the EDDI constructor.
  * - 0: EDDI (Add checks at every basic block)
  * - 1: FDSC (Add checks only at basic blocks with more than one predecessor)
  */
@@ -56,6 +68,69 @@ using namespace llvm;
 // #define CHECK_AT_CALLS
 // #define CHECK_AT_BRANCH
 
+#if (SELECTIVE_CHECKING == 1)
+#define SELECTIVE_CHECKING_DEFAULT true
+#else
+#define SELECTIVE_CHECKING_DEFAULT false
+#endif
+#ifdef CHECK_AT_STORES
+#define CHECK_AT_STORES_DEFAULT true
+#else
+#define CHECK_AT_STORES_DEFAULT false
+#endif
+#ifdef CHECK_AT_CALLS
+#define CHECK_AT_CALLS_DEFAULT true
+#else
+#define CHECK_AT_CALLS_DEFAULT false
+#endif
+#ifdef CHECK_AT_BRANCH
+#define CHECK_AT_BRANCH_DEFAULT true
+#else
+#define CHECK_AT_BRANCH_DEFAULT false
+#endif
+
+EDDI::EDDI()
+    : EDDI(SELECTIVE_CHECKING_DEFAULT, CHECK_AT_STORES_DEFAULT,
+           CHECK_AT_CALLS_DEFAULT, CHECK_AT_BRANCH_DEFAULT) {}
+
+enum class CheckMode { Branch, Accumulate };
+static cl::opt<CheckMode> EDDICheckMode(
+    "eddi-check-mode", cl::desc("Select how consistency checks are performed"),
+    cl::init(CheckMode::Branch),
+    cl::values(clEnumValN(CheckMode::Branch, "branch",
+                          "Branch to the error handler at every consistency "
+                          "check (default)"),
+               clEnumValN(CheckMode::Accumulate, "accumulate",
+                          "Fold mismatches into a per-function error "
+                          "accumulator, checked only at flush points")));
+
+enum FlushPoint { FlushAtExit, FlushAtBackEdge, FlushAtCalls };
+static cl::bits<FlushPoint> EDDIFlushPoints(
+    "eddi-flush-points",
+    cl::desc("Points where the error accumulator is checked when "
+             "-eddi-check-mode=accumulate (default: all). Function exits, "
+             "including the calls that do not return, are always flush points"),
+    cl::CommaSeparated,
+    cl::values(clEnumValN(FlushAtExit, "exit", "Function exits"),
+               clEnumValN(FlushAtBackEdge, "backedge", "Loop back-edges"),
+               clEnumValN(FlushAtCalls, "calls",
+                          "Calls to functions not defined in the module")));
+
+static bool isFlushPointEnabled(FlushPoint FP) {
+  return FP == FlushAtExit || EDDIFlushPoints.getBits() == 0 ||
+         EDDIFlushPoints.isSet(FP);
+}
+
+static cl::opt<bool> EDDIDupHeap(
+    "eddi-dup-heap",
+    cl::desc("Allocate each heap object together with its duplicate, in a "
+             "single block twice its size (DupHeap/runtime.c)"),
+    cl::init(false));
+
+// Alignment of the duplicate of a heap object within its block, as
+// ASPIS_DUP_HEAP_ALIGN in DupHeap/runtime.c
+static const uint64_t DupHeapAlign = 16;
+
 /**
  * Determines whether a instruction &I is used by store instructions different
  * than &Use
@@ -69,6 +144,12 @@ int EDDI::isUsedByStore(Instruction &I, Instruction &Use) {
   for (User *U : I.users()) {
     if (isa<StoreInst>(U) && U != &Use) {
       Instruction *U_st = cast<StoreInst>(U);
+      // use the precomputed reachability when both blocks have been analyzed
+      if (Reachability.isKnown(*U_st->getParent()) && Reachability.isKnown(*BB)) {
+        if (Reachability.isReachable(*U_st->getParent(), *BB))
+          return 1;
+        continue;
+      }
       // find BB in U_st successors
       std::unordered_set<BasicBlock *> reachable;
       std::queue<BasicBlock *> worklist;
@@ -96,10 +177,12 @@ int EDDI::isUsedByStore(Instruction &I, Instruction &Use) {
 /**
  * Clones instruction `I` and adds the pair <I, IClone> to
  * DuplicatedInstructionMap, inserting the clone right after the original.
+ * With -eddi-replicas=3, a third copy is also inserted after the clone and
+ * recorded in ThirdCopies.
  */
 Instruction *
 EDDI::cloneInstr(Instruction &I,
-                 std::map<Value *, Value *> &DuplicatedInstructionMap) {
+                 DenseMap<Value *, Value *> &DuplicatedInstructionMap) {
   Instruction *IClone = I.clone();
 
   if (!I.getType()->isVoidTy() && I.hasName()) {
@@ -114,10 +197,21 @@ EDDI::cloneInstr(Instruction &I,
   else {
     IClone->insertAfter(&I);
   }
-  DuplicatedInstructionMap.insert(
-      std::pair<Instruction *, Instruction *>(&I, IClone));
-  DuplicatedInstructionMap.insert(
-      std::pair<Instruction *, Instruction *>(IClone, &I));
+  DuplicatedInstructionMap.insert({&I, IClone});
+  DuplicatedInstructionMap.insert({IClone, &I});
+
+  if (EDDIReplicas == 3) {
+    Instruction *IThird = I.clone();
+    // the third copies are recognized by name (e.g. in the fault injection
+    // sites), also when the original has none
+    if (!I.getType()->isVoidTy()) {
+      IThird->setName(I.getName() + "_tmr");
+    }
+    IThird->insertAfter(IClone);
+    ThirdCopies.insert({&I, IThird});
+    // the third copy must not be duplicated in turn
+    DuplicatedInstructionMap.insert({IThird, IThird});
+  }
   return IClone;
 }
 
@@ -131,7 +225,7 @@ EDDI::cloneInstr(Instruction &I,
  * the recursive duplicateInstruction call
  */
 void EDDI::duplicateOperands(
-    Instruction &I, std::map<Value *, Value *> &DuplicatedInstructionMap,
+    Instruction &I, DenseMap<Value *, Value *> &DuplicatedInstructionMap,
     BasicBlock &ErrBB) {
   Instruction *IClone = NULL;
   // see if I has a clone
@@ -141,6 +235,7 @@ void EDDI::duplicateOperands(
       IClone = cast<Instruction>(VClone);
     }
   }
+  Instruction *IThird = dyn_cast_or_null<Instruction>(ThirdCopies.lookup(&I));
 
   int J = 0;
   // iterate over the operands and switch them with their duplicates in the
@@ -194,6 +289,13 @@ void EDDI::duplicateOperands(
         IClone->setOperand(J, Duplicate->second);
       }
     }
+
+    if (IThird != NULL) {
+      auto Duplicate = ValuesToAlwaysDup.find(V);
+      IThird->setOperand(J, Duplicate != ValuesToAlwaysDup.end()
+                                ? Duplicate->second
+                                : getThirdCopy(V));
+    }
     J++;
   }
 }
@@ -246,34 +348,383 @@ Value *EDDI::comparePtrs(Value &V1, Value &V2, IRBuilder<> &B) {
   if (F1 != NULL && F2 != NULL && !F1->getType()->isPointerTy() && !F2->getType()->isPointerTy()) {
     Instruction *L1 = B.CreateLoad(F1->getType(), F1);
     Instruction *L2 = B.CreateLoad(F2->getType(), F2);
-    if (L1->getType()->isFloatingPointTy()) {
-      return B.CreateCmp(CmpInst::FCMP_UEQ, L1, L2);
-    } else if (L1->getType()->isIntegerTy()) {
-      return B.CreateCmp(CmpInst::ICMP_EQ, L1, L2);
+    return compareScalars(*L1, *L2, B);
+  }
+  return NULL;
+}
+
+/**
+ * With -eddi-replicas=3, follows the three copies of the pointer V1 (V2 being
+ * its duplicate) like comparePtrs() and votes the values they point to: the
+ * result is true if at least two of them agree, so that a single corrupted
+ * copy of the pointer or of the memory it points to does not reach the error
+ * handler. Without a third copy, the pointers are compared by comparePtrs().
+ * @returns the i1 result of the vote, or NULL if the values cannot be compared
+ */
+Value *EDDI::votePtrs(Value &V1, Value &V2, IRBuilder<> &B) {
+  Value *V3 = getThirdCopy(&V1);
+  if (EDDIReplicas != 3 || V3 == &V1) {
+    return comparePtrs(V1, V2, B);
+  }
+  Value *F1 = getPtrFinalValue(V1);
+  Value *F2 = getPtrFinalValue(V2);
+  Value *F3 = getPtrFinalValue(*V3);
+  if (F1 == NULL || F2 == NULL || F3 == NULL || F1->getType()->isPointerTy() ||
+      F2->getType()->isPointerTy() || F3->getType()->isPointerTy()) {
+    return NULL;
+  }
+  Instruction *L1 = B.CreateLoad(F1->getType(), F1);
+  Instruction *L2 = B.CreateLoad(F2->getType(), F2);
+  Instruction *L3 = B.CreateLoad(F3->getType(), F3);
+  Value *L1EqL2 = compareScalars(*L1, *L2, B);
+  if (L1EqL2 == NULL) {
+    return NULL;
+  }
+  Value *L1EqL3 = compareScalars(*L1, *L3, B);
+  Value *L2EqL3 = compareScalars(*L2, *L3, B);
+  return B.CreateOr(B.CreateOr(L1EqL2, L1EqL3), L2EqL3);
+}
+
+/**
+ * Compares two integer or floating-point values. Floating-point values are
+ * compared on their bit patterns, so that a fault producing a NaN is not
+ * hidden by an unordered compare.
+ * @returns the i1 result of the comparison (true if equal), or NULL if the
+ *          values are neither integers nor floating-point values
+ */
+Value *EDDI::compareScalars(Value &V1, Value &V2, IRBuilder<> &B) {
+  Type *Ty = V1.getType();
+  if (Ty->isFloatingPointTy()) {
+    Type *IntTy = B.getIntNTy(Ty->getPrimitiveSizeInBits().getFixedValue());
+    return B.CreateICmpEQ(B.CreateBitCast(&V1, IntTy),
+                          B.CreateBitCast(&V2, IntTy));
+  } else if (Ty->isIntegerTy()) {
+    return B.CreateICmpEQ(&V1, &V2);
+  }
+  return NULL;
+}
+
+/**
+ * Returns the type of the elements of an array or of a struct having all the
+ * elements of the same integer or floating-point type, NULL otherwise.
+ */
+static Type *getHomogeneousScalarType(Type *AggTy) {
+  Type *ElemTy = NULL;
+  if (auto *ArrTy = dyn_cast<ArrayType>(AggTy)) {
+    ElemTy = ArrTy->getElementType();
+  } else if (auto *STy = dyn_cast<StructType>(AggTy)) {
+    if (STy->getNumElements() == 0) {
+      return NULL;
     }
+    ElemTy = STy->getElementType(0);
+    for (Type *T : STy->elements()) {
+      if (T != ElemTy) {
+        return NULL;
+      }
+    }
+  }
+  if (ElemTy != NULL && (ElemTy->isIntegerTy() || ElemTy->isFloatingPointTy())) {
+    return ElemTy;
   }
   return NULL;
 }
 
-int syncpt_id = 0;
+/**
+ * Compares two arrays or structs whose elements have all the same integer or
+ * floating-point type. The elements are packed into a <N x iK> vector (SSA
+ * aggregates cannot be bitcast directly), so that the whole aggregate is
+ * checked with a single vector compare and an or-reduction.
+ * @returns the i1 result of the comparison (true if equal), or NULL if the
+ *          aggregate is not homogeneous
+ */
+Value *EDDI::compareAggregates(
+    Value &V1, Value &V2, IRBuilder<> &B,
+    DenseMap<Value *, Value *> &DuplicatedInstructionMap) {
+  Type *AggTy = V1.getType();
+  Type *ElemTy = getHomogeneousScalarType(AggTy);
+  if (ElemTy == NULL) {
+    return NULL;
+  }
+  unsigned NumElems = isa<ArrayType>(AggTy)
+                          ? AggTy->getArrayNumElements()
+                          : cast<StructType>(AggTy)->getNumElements();
+  if (NumElems == 0) {
+    return NULL;
+  }
+  Type *IntTy = B.getIntNTy(ElemTy->getPrimitiveSizeInBits().getFixedValue());
+  if (NumElems == 1) {
+    Value *E1 = B.CreateExtractValue(&V1, 0);
+    Value *E2 = B.CreateExtractValue(&V2, 0);
+    DuplicatedInstructionMap.insert({E1, E2});
+    DuplicatedInstructionMap.insert({E2, E1});
+    return compareScalars(*E1, *E2, B);
+  }
+
+  auto *VecTy = FixedVectorType::get(IntTy, NumElems);
+  Value *Vec1 = PoisonValue::get(VecTy);
+  Value *Vec2 = PoisonValue::get(VecTy);
+  for (unsigned i = 0; i < NumElems; i++) {
+    Value *E1 = B.CreateExtractValue(&V1, i);
+    Value *E2 = B.CreateExtractValue(&V2, i);
+    DuplicatedInstructionMap.insert({E1, E2});
+    DuplicatedInstructionMap.insert({E2, E1});
+    Vec1 = B.CreateInsertElement(Vec1, B.CreateBitCast(E1, IntTy), i);
+    Vec2 = B.CreateInsertElement(Vec2, B.CreateBitCast(E2, IntTy), i);
+  }
+  Value *Mismatch = B.CreateOrReduce(B.CreateICmpNE(Vec1, Vec2));
+  return B.CreateNot(Mismatch);
+}
 
 /**
- * Adds a consistency check on the instruction I
+ * With -eddi-replicas=3, emits the majority vote of the copies of Original: Dup
+ * if it agrees with the third copy, Original otherwise, so that a single
+ * corrupted copy is outvoted without branches. The condition that at least two
+ * copies agree, the only one leading to the error handler, is appended to
+ * Checks.
+ * @returns the voted value, or NULL if Original has no third copy or its
+ *          copies cannot be compared
  */
-void EDDI::addConsistencyChecks(
-    Instruction &I, std::map<Value *, Value *> &DuplicatedInstructionMap,
-    BasicBlock &ErrBB) {
-  std::vector<Value *> CmpInstructions;
+Value *EDDI::voteCopies(Value &Original, Value &Dup, IRBuilder<> &B,
+                        std::vector<Value *> &Checks,
+                        DenseMap<Value *, Value *> &DuplicatedInstructionMap) {
+  Value *Third = getThirdCopy(&Original);
+  if (EDDIReplicas != 3 || Third == &Original) {
+    return NULL;
+  }
+  auto compare = [&](Value &V1, Value &V2) {
+    Value *CmpInstr = compareAggregates(V1, V2, B, DuplicatedInstructionMap);
+    return CmpInstr != NULL ? CmpInstr : compareScalars(V1, V2, B);
+  };
+  Value *DupEqThird = compare(Dup, *Third);
+  if (DupEqThird == NULL) {
+    return NULL;
+  }
+  Value *OrigEqDup = compare(Original, Dup);
+  Value *OrigEqThird = compare(Original, *Third);
+  Checks.push_back(B.CreateOr(B.CreateOr(OrigEqDup, OrigEqThird), DupEqThird));
+  return B.CreateSelect(DupEqThird, &Dup, &Original);
+}
+
+int syncpt_id = 0;
 
-  // split and add the verification BB
+/**
+ * Splits the basic block of I right before I, and adds an empty
+ * VerificationBB between the two halves. The terminator of VerificationBB has
+ * to be added by the caller.
+ * @returns the VerificationBB
+ */
+BasicBlock *EDDI::splitVerificationBB(Instruction &I) {
   auto BBpred = I.getParent()->splitBasicBlockBefore(&I);
   BasicBlock *VerificationBB =
       BasicBlock::Create(I.getContext(), "VerificationBB",
                          I.getParent()->getParent(), I.getParent());
+  // the new blocks are pieces of the block of I, so the reachability does not
+  // need to be recomputed
+  Reachability.recordSplit(*BBpred, *I.getParent());
+  Reachability.recordSplit(*VerificationBB, *I.getParent());
   I.getParent()->replaceUsesWithIf(BBpred, IsNotAPHINode);
   auto BI = cast<BranchInst>(BBpred->getTerminator());
   BI->setSuccessor(0, VerificationBB);
+  return VerificationBB;
+}
+
+/**
+ * Returns the error accumulator of the function Fn, creating it at the
+ * beginning of the function if it does not exist yet. The accumulator is an
+ * i1 stack slot initialized to false, set to true as soon as a consistency
+ * check fails.
+ */
+AllocaInst *EDDI::getErrAccumulator(
+    Function &Fn, DenseMap<Value *, Value *> &DuplicatedInstructionMap) {
+  if (ErrAccumulator == nullptr) {
+    IRBuilder<> B(&*Fn.getEntryBlock().getFirstInsertionPt());
+    ErrAccumulator = B.CreateAlloca(B.getInt1Ty(), nullptr, "eddi_acc");
+    Instruction *Init = B.CreateStore(B.getFalse(), ErrAccumulator);
+    // the accumulator must not be duplicated
+    DuplicatedInstructionMap.insert({ErrAccumulator, ErrAccumulator});
+    DuplicatedInstructionMap.insert({Init, Init});
+  }
+  return ErrAccumulator;
+}
+
+/**
+ * Folds the result of a consistency check (true if no mismatch has been found)
+ * into the error accumulator, inserting the instructions with the builder B.
+ */
+void EDDI::accumulateCheck(
+    Value &Check, IRBuilder<> &B,
+    DenseMap<Value *, Value *> &DuplicatedInstructionMap) {
+  Function &Fn = *B.GetInsertBlock()->getParent();
+  AllocaInst *Acc = getErrAccumulator(Fn, DuplicatedInstructionMap);
+  Value *Mismatch = B.CreateNot(&Check);
+  Instruction *AccVal = B.CreateLoad(B.getInt1Ty(), Acc);
+  Value *NewAccVal = B.CreateOr(AccVal, Mismatch);
+  Instruction *AccStore = B.CreateStore(NewAccVal, Acc);
+  for (Value *V : {Mismatch, (Value *)AccVal, NewAccVal, (Value *)AccStore}) {
+    DuplicatedInstructionMap.insert({V, V});
+  }
+}
+
+/**
+ * Checks the error accumulator right before the instruction I, jumping to
+ * ErrBB if a mismatch has been accumulated.
+ */
+void EDDI::flushErrAccumulator(Instruction &I, BasicBlock &ErrBB) {
+  BasicBlock *VerificationBB = splitVerificationBB(I);
   IRBuilder<> B(VerificationBB);
+  Value *AccVal = B.CreateLoad(B.getInt1Ty(), ErrAccumulator);
+  auto CondBrInst = B.CreateCondBr(AccVal, &ErrBB, I.getParent());
+  if (DebugEnabled) {
+    CondBrInst->setDebugLoc(I.getDebugLoc());
+  }
+}
+
+/**
+ * Returns true if the check at the synchronization point I may be folded into
+ * the error accumulator when its block does not fit -aspis-overhead-budget.
+ * The checks at branches are always kept, as a corrupted condition would drive
+ * both copies down the same path, and so are the ones at the calls to
+ * functions out of the module, whose arguments leave the hardened code.
+ */
+static bool isRelaxableCheck(Instruction &I) {
+  if (I.isTerminator()) {
+    return false;
+  }
+  if (auto *CInstr = dyn_cast<CallBase>(&I)) {
+    Function *Callee = CInstr->getCalledFunction();
+    return Callee != nullptr &&
+           (!Callee->isDeclaration() || Callee->isIntrinsic());
+  }
+  return true;
+}
+
+/**
+ * Splits the head of the blocks entered from the hot blocks whose checks are
+ * relaxed to fit -aspis-overhead-budget, so that the accumulated mismatches
+ * can be tested when leaving the hot code (see addAccumulatorFlushes).
+ */
+void EDDI::splitHotExits(Function &Fn) {
+  HotExitBBs.clear();
+  // in accumulate mode the relaxed checks are tested at the flush points
+  if (HotThreshold == UINT64_MAX || EDDICheckMode == CheckMode::Accumulate) {
+    return;
+  }
+  SmallVector<BasicBlock *, 8> ColdSuccs;
+  for (BasicBlock &BB : Fn) {
+    if (BB.isEHPad() || getProfileCount(BB) >= HotThreshold) {
+      continue;
+    }
+    if (any_of(predecessors(&BB), [this](BasicBlock *Pred) {
+          return getProfileCount(*Pred) >= HotThreshold;
+        })) {
+      ColdSuccs.push_back(&BB);
+    }
+  }
+  for (BasicBlock *BB : ColdSuccs) {
+    // the new block takes the phis and the predecessors of BB
+    HotExitBBs.push_back(
+        BB->splitBasicBlockBefore(BB->getFirstInsertionPt(), "HotExitBB"));
+  }
+}
+
+/**
+ * Adds the checks on the error accumulator at the flush points of Fn
+ * selected with -eddi-flush-points. In branch mode the accumulator only holds
+ * the checks relaxed in the hot blocks, which are tested at the exits of the
+ * function, before the calls out of the module and when leaving the hot code.
+ */
+void EDDI::addAccumulatorFlushes(Function &Fn, BasicBlock &ErrBB) {
+  bool RelaxedOnly = EDDICheckMode != CheckMode::Accumulate;
+  // a latch ending with a call (e.g. an invoke) is a flush point only once
+  SetVector<Instruction *> FlushPts;
+
+  for (BasicBlock &BB : Fn) {
+    if (&BB == &ErrBB)
+      continue;
+    for (Instruction &I : BB) {
+      if (isa<ReturnInst, ResumeInst>(I) && isFlushPointEnabled(FlushAtExit)) {
+        // a musttail call must stay right before the ret, so we flush before
+        // the call
+        if (CallInst *MustTailCall = BB.getTerminatingMustTailCall()) {
+          FlushPts.insert(MustTailCall);
+        } else {
+          FlushPts.insert(&I);
+        }
+      }
+      else if (auto *CInstr = dyn_cast<CallBase>(&I)) {
+        auto *Callee = CInstr->getCalledFunction();
+        bool IsHandler =
+            Callee != nullptr &&
+            (Callee->getName().contains("DataCorruption_Handler") ||
+             Callee->getName().contains("SigMismatch_Handler"));
+        // the calls that do not return (exit, abort, longjmp) leave the
+        // function as well, so they are always flush points
+        if (CInstr->doesNotReturn() && !IsHandler &&
+            isFlushPointEnabled(FlushAtExit)) {
+          FlushPts.insert(&I);
+        }
+        // we flush before calls that leave the module, as the callee may
+        // expose corrupted data
+        else if ((RelaxedOnly || isFlushPointEnabled(FlushAtCalls)) &&
+                 (Callee == nullptr ||
+                  (Callee->isDeclaration() && !Callee->isIntrinsic() &&
+                   !IsHandler && !Callee->getName().starts_with("aspis.")))) {
+          FlushPts.insert(&I);
+        }
+      }
+    }
+  }
+
+  if (RelaxedOnly) {
+    for (BasicBlock *HotExitBB : HotExitBBs) {
+      FlushPts.insert(HotExitBB->getTerminator());
+    }
+  }
+  else if (isFlushPointEnabled(FlushAtBackEdge)) {
+    DominatorTree DT(Fn);
+    LoopInfo LI(DT);
+    for (Loop *L : LI.getLoopsInPreorder()) {
+      SmallVector<BasicBlock *, 4> Latches;
+      L->getLoopLatches(Latches);
+      for (BasicBlock *Latch : Latches) {
+        FlushPts.insert(Latch->getTerminator());
+      }
+    }
+  }
+
+  for (Instruction *I : FlushPts) {
+    flushErrAccumulator(*I, ErrBB);
+  }
+}
+
+/**
+ * Adds a consistency check on the instruction I
+ */
+void EDDI::addConsistencyChecks(
+    Instruction &I, DenseMap<Value *, Value *> &DuplicatedInstructionMap,
+    BasicBlock &ErrBB) {
+  std::vector<Value *> CmpInstructions;
+  // copies of the operands (-eddi-replicas=3) and the value they voted
+  DenseMap<Value *, Value *> VotedOperands;
+
+  // the checks of the hot blocks do not fit -aspis-overhead-budget: the ones
+  // that can be relaxed are folded into the error accumulator, which is tested
+  // when leaving the hot code
+  bool Accumulate = EDDICheckMode == CheckMode::Accumulate ||
+                    (getProfileCount(*I.getParent()) >= HotThreshold &&
+                     isRelaxableCheck(I));
+
+  IRBuilder<> B(I.getContext());
+  BasicBlock *VerificationBB = nullptr;
+  if (Accumulate) {
+    // in accumulate mode the comparisons are placed right before I, without
+    // splitting the basic block
+    B.SetInsertPoint(&I);
+  } else {
+    // split and add the verification BB
+    VerificationBB = splitVerificationBB(I);
+    B.SetInsertPoint(VerificationBB);
+  }
 
   // add a comparison for each operand
   for (Value *V : I.operand_values()) {
@@ -295,51 +746,61 @@ void EDDI::addConsistencyChecks(
         Value *Original = Duplicate->first;
         Value *Copy = Duplicate->second;
 
+        // in shadow memory mode the two copies of a pointer are equal, except
+        // for the duplicated allocas
+        if (ShadowMemEnabled && Original->getType()->isPointerTy() &&
+            !isa<AllocaInst>(Original)) {
+          CmpInstructions.push_back(B.CreateICmpEQ(Original, Copy));
+        }
         // if the operand is a pointer we try to get a compare on pointers
-        if (Original->getType()->isPointerTy()) {
-          Value *CmpInstr = comparePtrs(*Original, *Copy, B);
+        // (a vote on the values they point to, with three copies)
+        else if (Original->getType()->isPointerTy()) {
+          Value *CmpInstr = votePtrs(*Original, *Copy, B);
           if (CmpInstr != NULL) {
             CmpInstructions.push_back(CmpInstr);
           }
         }
-        // if the operand is an array we have to compare all its elements
+        // with three copies the operand is corrected by majority voting
+        else if (Value *Voted = voteCopies(*Original, *Copy, B, CmpInstructions,
+                                           DuplicatedInstructionMap)) {
+          for (Value *C : {Original, Copy, getThirdCopy(Original)}) {
+            VotedOperands.insert({C, Voted});
+          }
+        }
+        // homogeneous arrays and structs are compared as a whole
+        else if (Value *CmpInstr = compareAggregates(
+                     *Original, *Copy, B, DuplicatedInstructionMap)) {
+          CmpInstructions.push_back(CmpInstr);
+        }
+        // if the operand is an array of pointers we have to compare all its
+        // elements
         else if (Original->getType()->isArrayTy()) {
-          if (!Original->getType()->getArrayElementType()->isAggregateType()) {
+          if (Original->getType()->getArrayElementType()->isPointerTy()) {
             int arraysize = Original->getType()->getArrayNumElements();
 
             for (int i = 0; i < arraysize; i++) {
               Value *OriginalElem = B.CreateExtractValue(Original, i);
               Value *CopyElem = B.CreateExtractValue(Copy, i);
-              DuplicatedInstructionMap.insert(
-                  std::pair<Value *, Value *>(OriginalElem, CopyElem));
-              DuplicatedInstructionMap.insert(
-                  std::pair<Value *, Value *>(CopyElem, OriginalElem));
-
-              if (OriginalElem->getType()->isPointerTy()) {
-                Value *CmpInstr = comparePtrs(*OriginalElem, *CopyElem, B);
-                if (CmpInstr != NULL) {
-                  CmpInstructions.push_back(CmpInstr);
-                }
-              } else {
-                if (OriginalElem->getType()->isFloatingPointTy()) {
-                  CmpInstructions.push_back(
-                      B.CreateCmp(CmpInst::FCMP_UEQ, OriginalElem, CopyElem));
-                } else if (OriginalElem->getType()->isIntegerTy()){
-                  CmpInstructions.push_back(
-                      B.CreateCmp(CmpInst::ICMP_EQ, OriginalElem, CopyElem));
-                }
+              DuplicatedInstructionMap.insert({OriginalElem, CopyElem});
+              DuplicatedInstructionMap.insert({CopyElem, OriginalElem});
+              Value *Third = getThirdCopy(Original);
+              if (Third != Original) {
+                ThirdCopies.insert(
+                    {OriginalElem, B.CreateExtractValue(Third, i)});
+              }
+
+              Value *CmpInstr = votePtrs(*OriginalElem, *CopyElem, B);
+              if (CmpInstr != NULL) {
+                CmpInstructions.push_back(CmpInstr);
               }
             }
           }
         }
         // else we just add a compare
         else {
-          if (Original->getType()->isFloatingPointTy()) {
-            CmpInstructions.push_back(
-                B.CreateCmp(CmpInst::FCMP_UEQ, Original, Copy));
-          } else if (Original->getType()->isIntegerTy()) {
-            CmpInstructions.push_back(
-                B.CreateCmp(CmpInst::ICMP_EQ, Original, Copy));
+          Value *CmpInstr = compareScalars(*Original, *Copy, B);
+          if (CmpInstr != NULL) {
+            CmpInstructions.push_back(CmpInstr);
           }
         }
       }
@@ -349,6 +810,15 @@ void EDDI::addConsistencyChecks(
   // if in the end we have a set of compare instructions, we check that all of
   // them are true
   if (!CmpInstructions.empty()) {
+    // tag the checks with the kind of synchronization point, so that later
+    // passes (e.g. eddi-check-elim) can recognize them
+    MDNode *CheckMD = MDNode::get(
+        I.getContext(), MDString::get(I.getContext(), I.getOpcodeName()));
+    for (Value *CmpInstr : CmpInstructions) {
+      if (isa<Instruction>(CmpInstr)) {
+        cast<Instruction>(CmpInstr)->setMetadata("aspis.check", CheckMD);
+      }
+    }
     // all comparisons must be true
     if (ProfilingEnabled) {
       IRBuilder<> BProfiler(cast<Instruction>(CmpInstructions.front()));
@@ -358,13 +828,35 @@ void EDDI::addConsistencyChecks(
       EndCall->insertAfter(cast<Instruction>(CmpInstructions.back()));
     }
     Value *AndInstr = B.CreateAnd(CmpInstructions);
-    auto CondBrInst = B.CreateCondBr(AndInstr, I.getParent(), &ErrBB);
-    if (DebugEnabled) {
-      CondBrInst->setDebugLoc(I.getDebugLoc());
+    if (Accumulate) {
+      accumulateCheck(*AndInstr, B, DuplicatedInstructionMap);
+      if (EDDICheckMode != CheckMode::Accumulate) {
+        NumChecksRelaxed++;
+      }
+    } else {
+      auto CondBrInst = B.CreateCondBr(AndInstr, I.getParent(), &ErrBB);
+      if (DebugEnabled) {
+        CondBrInst->setDebugLoc(I.getDebugLoc());
+      }
     }
   }
 
-  if (VerificationBB->size() == 0) {
+  // the synchronization point and its copies use the voted values, so that
+  // the memory and the control flow get the corrected ones
+  if (!VotedOperands.empty()) {
+    for (Value *C : {(Value *)&I, DuplicatedInstructionMap.lookup(&I),
+                     ThirdCopies.lookup(&I)}) {
+      if (auto *CInstr = dyn_cast_or_null<Instruction>(C)) {
+        for (Use &U : CInstr->operands()) {
+          if (Value *Voted = VotedOperands.lookup(U.get())) {
+            U.set(Voted);
+          }
+        }
+      }
+    }
+  }
+
+  if (VerificationBB != nullptr && VerificationBB->size() == 0) {
     auto BrInst = B.CreateBr(I.getParent());
     if (DebugEnabled) {
       BrInst->setDebugLoc(I.getDebugLoc());
@@ -377,6 +869,28 @@ void EDDI::addConsistencyChecks(
   }
 }
 
+/**
+ * Estimates the instructions executed by the consistency checks of BB that
+ * can be relaxed (see isRelaxableCheck) at each execution, i.e. the cost that
+ * -aspis-overhead-budget can save
+ */
+uint64_t EDDI::estimateChecksCost(BasicBlock &BB) {
+  bool MultipleSuccs = BB.getTerminator()->getNumSuccessors() > 1;
+  if (SelectiveChecking && !MultipleSuccs) {
+    return 0;
+  }
+  uint64_t SyncPts = 0;
+  for (Instruction &I : BB) {
+    if (((CheckAtStores && isa<StoreInst, AtomicRMWInst, AtomicCmpXchgInst>(I)) ||
+         (CheckAtCalls && isa<CallBase>(I) && !isa<DbgInfoIntrinsic>(I))) &&
+        isRelaxableCheck(I)) {
+      SyncPts++;
+    }
+  }
+  // about a comparison, an and and a branch for each synchronization point
+  return 3 * SyncPts;
+}
+
 // Given an instruction, loads and stores the pointers passed to the
 // instruction. This is useful in the case I is a CallBase, since the function
 // called might not be in the compilation unit, and the function called may
@@ -384,7 +898,7 @@ void EDDI::addConsistencyChecks(
 // objective of synchronize pointers after some non-duplicated instruction
 // execution.
 void EDDI::fixFuncValsPassedByReference(
-    Instruction &I, std::map<Value *, Value *> &DuplicatedInstructionMap,
+    Instruction &I, DenseMap<Value *, Value *> &DuplicatedInstructionMap,
     IRBuilder<> &B) {
   int numOps = I.getNumOperands();
   for (int i = 0; i < numOps; i++) {
@@ -396,57 +910,366 @@ void EDDI::fixFuncValsPassedByReference(
         Value *Original = Duplicate->first;
         Value *Copy = Duplicate->second;
 
+        if (ShadowMemEnabled) {
+          syncShadow(*Original, B, DuplicatedInstructionMap);
+          continue;
+        }
+
         Type *OriginalType = Original->getType();
         Instruction *TmpLoad = B.CreateLoad(OriginalType, Original);
         Instruction *TmpStore = B.CreateStore(TmpLoad, Copy);
-        DuplicatedInstructionMap.insert(
-            std::pair<Instruction *, Instruction *>(TmpLoad, TmpLoad));
-        DuplicatedInstructionMap.insert(
-            std::pair<Instruction *, Instruction *>(TmpStore, TmpStore));
+        DuplicatedInstructionMap.insert({TmpLoad, TmpLoad});
+        DuplicatedInstructionMap.insert({TmpStore, TmpStore});
+        Value *Third = getThirdCopy(Original);
+        if (Third != Original) {
+          Instruction *ThirdStore = B.CreateStore(TmpLoad, Third);
+          DuplicatedInstructionMap.insert({ThirdStore, ThirdStore});
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Shadow memory mode: emits the address of the shadow of Ptr before the
+ * insertion point of B. The instructions computing it are not duplicated.
+ */
+Value *EDDI::getShadowPtr(Value *Ptr, IRBuilder<> &B,
+                          DenseMap<Value *, Value *> &DuplicatedInstructionMap) {
+  Value *Shadow = createShadowPtr(B, Ptr);
+  for (auto *I = dyn_cast<Instruction>(Shadow); I != nullptr && I != Ptr;
+       I = dyn_cast<Instruction>(I->getOperand(0))) {
+    DuplicatedInstructionMap.insert({I, I});
+  }
+  return Shadow;
+}
+
+// allocas whose address is only loaded from and stored to: they are still
+// duplicated in shadow memory mode, as both copies end up in registers
+static bool isDirectlyAccessedAlloca(AllocaInst &AI) {
+  for (User *U : AI.users()) {
+    if (auto *LI = dyn_cast<LoadInst>(U)) {
+      if (LI->isVolatile()) return false;
+    } else if (auto *SI = dyn_cast<StoreInst>(U)) {
+      if (SI->isVolatile() || SI->getValueOperand() == &AI) return false;
+    } else if (auto *II = dyn_cast<IntrinsicInst>(U)) {
+      if (!II->isLifetimeStartOrEnd()) return false;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Shadow memory mode: makes the memory accesses of the duplicated instruction
+ * IClone (loads, stores, atomics and memory intrinsics) use the shadow of
+ * their addresses. The reads of the globals defined out of the module (e.g. in
+ * the C library) and of the thread-local ones keep the original address, as
+ * these may be written by code that does not update the shadow.
+ */
+void EDDI::redirectToShadow(Instruction &IClone,
+                            DenseMap<Value *, Value *> &DuplicatedInstructionMap) {
+  IRBuilder<> B(&IClone);
+  auto redirect = [&](unsigned OpIdx, bool IsRead) {
+    Value *Ptr = IClone.getOperand(OpIdx);
+    if (Ptr->getType()->getPointerAddressSpace() != 0) {
+      return;
+    }
+    // the duplicated allocas are accessed directly
+    auto Duplicate = DuplicatedInstructionMap.find(Ptr);
+    if (isa<AllocaInst>(Ptr) && Duplicate != DuplicatedInstructionMap.end() &&
+        Duplicate->second != Ptr) {
+      return;
+    }
+    if (auto *GV = dyn_cast<GlobalVariable>(getUnderlyingObject(Ptr))) {
+      if (IsRead && (GV->isDeclaration() || GV->isThreadLocal())) {
+        return;
       }
     }
+    IClone.setOperand(OpIdx, getShadowPtr(Ptr, B, DuplicatedInstructionMap));
+  };
+
+  if (auto *LI = dyn_cast<LoadInst>(&IClone)) {
+    redirect(LI->getPointerOperandIndex(), true);
+  } else if (auto *SI = dyn_cast<StoreInst>(&IClone)) {
+    redirect(SI->getPointerOperandIndex(), false);
+  } else if (auto *RMW = dyn_cast<AtomicRMWInst>(&IClone)) {
+    redirect(RMW->getPointerOperandIndex(), false);
+  } else if (auto *CmpXchg = dyn_cast<AtomicCmpXchgInst>(&IClone)) {
+    redirect(CmpXchg->getPointerOperandIndex(), false);
+  } else if (isa<MemTransferInst>(IClone)) {
+    redirect(0, false);
+    redirect(1, true);
+  } else if (isa<MemSetInst>(IClone)) {
+    redirect(0, false);
   }
 }
 
+/**
+ * Shadow memory mode: copies the object pointed by Ptr to its shadow after a
+ * call to a function that is not hardened, which may have written it. When
+ * the object is unknown, only the first word is copied, as done for the
+ * duplicated memory.
+ */
+void EDDI::syncShadow(Value &Ptr, IRBuilder<> &B,
+                      DenseMap<Value *, Value *> &DuplicatedInstructionMap) {
+  if (Ptr.getType()->getPointerAddressSpace() != 0) {
+    return;
+  }
+  const DataLayout &DL = B.GetInsertBlock()->getModule()->getDataLayout();
+  Value *Obj = getUnderlyingObject(&Ptr);
+  std::optional<TypeSize> Size;
+  if (auto *AI = dyn_cast<AllocaInst>(Obj)) {
+    Size = AI->getAllocationSize(DL);
+  } else if (auto *GV = dyn_cast<GlobalVariable>(Obj)) {
+    if (GV->isConstant() || GV->isDeclaration() || GV->isThreadLocal()) {
+      return;
+    }
+    Size = DL.getTypeAllocSize(GV->getValueType());
+  }
+
+  Instruction *Copy;
+  if (Size && !Size->isScalable()) {
+    Copy = B.CreateMemCpy(getShadowPtr(Obj, B, DuplicatedInstructionMap),
+                          MaybeAlign(), Obj, MaybeAlign(), Size->getFixedValue());
+  } else {
+    Instruction *TmpLoad = B.CreateLoad(Ptr.getType(), &Ptr);
+    DuplicatedInstructionMap.insert({TmpLoad, TmpLoad});
+    Copy = B.CreateStore(TmpLoad, getShadowPtr(&Ptr, B, DuplicatedInstructionMap));
+  }
+  DuplicatedInstructionMap.insert({Copy, Copy});
+}
+
+/**
+ * Shadow memory mode: defines aspis_shadow_offset, read by the runtime that
+ * maps the shadow memory (ShadowMemory/runtime.c).
+ */
+void EDDI::emitShadowOffset(Module &Md) {
+  if (Md.getGlobalVariable("aspis_shadow_offset") != nullptr) {
+    return;
+  }
+  Type *Int64Ty = Type::getInt64Ty(Md.getContext());
+  // weak_odr, so that the definitions of the translation units are merged
+  auto *OffsetGV = new GlobalVariable(
+      Md, Int64Ty, true, GlobalValue::WeakODRLinkage,
+      ConstantInt::get(Int64Ty, ShadowMemOffset, true), "aspis_shadow_offset");
+  OffsetGV->setDSOLocal(true);
+}
+
+/**
+ * Handles the direct calls to the heap functions of the C library and to the
+ * replaceable operator new/delete. The memory they free is not synchronized
+ * after the call, as done for the other calls that are not hardened. In shadow
+ * memory mode, calloc and realloc are redirected to the runtime, which keeps
+ * the shadow of the block in sync. With -eddi-dup-heap, each object is
+ * allocated together with its duplicate, placed after it in a block of twice
+ * its size, so that a single allocator call serves both copies.
+ * @param Res is set to 1 if CInstr has been replaced and has to be removed
+ * @returns true if CInstr calls a heap function, in which case no further
+ *          handling of the call is needed
+ */
+bool EDDI::duplicateHeapCall(CallBase *CInstr,
+                             DenseMap<Value *, Value *> &DuplicatedInstructionMap,
+                             int &Res) {
+  Function *Callee = CInstr->getCalledFunction();
+  if (Callee == nullptr || !Callee->isDeclaration()) {
+    return false;
+  }
+  StringRef Name = Callee->getName();
+  bool IsFree = Name == "free" || Name.starts_with("_ZdlPv") ||
+                Name.starts_with("_ZdaPv");
+  bool IsNew = Name == "_Znwm" || Name == "_Znam";
+  bool IsNothrowNew = Name == "_ZnwmRKSt9nothrow_t" || Name == "_ZnamRKSt9nothrow_t";
+  bool IsMalloc = Name == "malloc" || IsNew || IsNothrowNew;
+  bool IsCalloc = Name == "calloc";
+  bool IsRealloc = Name == "realloc";
+  if (!IsFree && !IsMalloc && !IsCalloc && !IsRealloc) {
+    return false;
+  }
+
+  bool DupHeap = EDDIDupHeap && !ShadowMemEnabled;
+  Module &Md = *CInstr->getModule();
+  IRBuilder<> B(CInstr);
+  auto markNotDuplicated = [&](Value *V) {
+    if (isa<Instruction>(V)) {
+      DuplicatedInstructionMap.insert({V, V});
+    }
+  };
+  // distance of the duplicate of an object of Size bytes from the object
+  auto getStride = [&](Value *Size) {
+    Value *Padded =
+        B.CreateAdd(Size, ConstantInt::get(Size->getType(), DupHeapAlign - 1));
+    Value *Stride =
+        B.CreateAnd(Padded, ConstantInt::get(Size->getType(), ~(DupHeapAlign - 1)));
+    markNotDuplicated(Padded);
+    markNotDuplicated(Stride);
+    return Stride;
+  };
+  // size of the block holding the object and its duplicate, SIZE_MAX (i.e. an
+  // allocation failure) if it does not fit
+  auto getBlockSize = [&](Value *Size, Value *Stride) {
+    auto *SizeTy = cast<IntegerType>(Size->getType());
+    APInt MaxSize =
+        APInt::getSignedMaxValue(SizeTy->getBitWidth()) - (DupHeapAlign - 1);
+    Value *TooBig = B.CreateICmpUGT(Size, ConstantInt::get(SizeTy, MaxSize));
+    Value *Doubled = B.CreateShl(Stride, 1);
+    Value *BlockSize =
+        B.CreateSelect(TooBig, Constant::getAllOnesValue(SizeTy), Doubled);
+    markNotDuplicated(TooBig);
+    markNotDuplicated(Doubled);
+    markNotDuplicated(BlockSize);
+    return BlockSize;
+  };
+
+  if (IsFree) {
+    // the sized operator delete gets the size of the whole block
+    if (DupHeap && (Name == "_ZdlPvm" || Name == "_ZdaPvm")) {
+      Value *Size = CInstr->getArgOperand(1);
+      CInstr->setArgOperand(1, getBlockSize(Size, getStride(Size)));
+    }
+    markNotDuplicated(CInstr);
+    return true;
+  }
+
+  if (ShadowMemEnabled && (IsCalloc || IsRealloc)) {
+    CInstr->setCalledFunction(Md.getOrInsertFunction(
+        ("aspis_shadow_" + Name).str(), Callee->getFunctionType()));
+  }
+  // the duplicate is computed where the allocation dominates its uses
+  BasicBlock *NormalDest = nullptr;
+  if (auto *Invoke = dyn_cast<InvokeInst>(CInstr)) {
+    NormalDest = Invoke->getNormalDest();
+  }
+  if (!DupHeap || (NormalDest != nullptr &&
+                   (IsRealloc || NormalDest->getSinglePredecessor() == nullptr))) {
+    markNotDuplicated(CInstr);
+    return IsCalloc || IsRealloc;
+  }
+
+  Value *Size = CInstr->getArgOperand(IsRealloc ? 1 : 0);
+  if (IsCalloc) {
+    Size = B.CreateMul(Size, CInstr->getArgOperand(1));
+    markNotDuplicated(Size);
+  }
+  Value *Stride = getStride(Size);
+  Instruction *Alloc = CInstr;
+  if (IsMalloc) {
+    CInstr->setArgOperand(0, getBlockSize(Size, Stride));
+  } else if (IsCalloc) {
+    CInstr->setCalledFunction(
+        Md.getOrInsertFunction("aspis_dup_calloc", Callee->getFunctionType()));
+  } else {
+    // the runtime finds the size of the old block from its duplicate
+    Value *Ptr = CInstr->getArgOperand(0);
+    FunctionCallee DupRealloc = Md.getOrInsertFunction(
+        "aspis_dup_realloc", CInstr->getType(), Ptr->getType(), Ptr->getType(),
+        Size->getType());
+    Alloc = B.CreateCall(
+        DupRealloc, {Ptr, getArgDuplicate(Ptr, DuplicatedInstructionMap), Size});
+    Alloc->takeName(CInstr);
+    CInstr->replaceNonMetadataUsesWith(Alloc);
+    Res = 1;
+  }
+
+  if (NormalDest != nullptr) {
+    B.SetInsertPoint(&*NormalDest->getFirstInsertionPt());
+  } else {
+    B.SetInsertPoint(Alloc->getNextNode());
+  }
+  Value *Replica = B.CreateGEP(B.getInt8Ty(), Alloc, Stride);
+  // a failed allocation has no duplicate (operator new throws instead)
+  if (!IsNew) {
+    markNotDuplicated(Replica);
+    Value *IsNull = B.CreateIsNull(Alloc);
+    markNotDuplicated(IsNull);
+    Replica = B.CreateSelect(IsNull, Constant::getNullValue(Alloc->getType()),
+                             Replica);
+  }
+  DuplicatedInstructionMap.insert({Alloc, Replica});
+  DuplicatedInstructionMap.insert({Replica, Alloc});
+  return true;
+}
+
+// Creates the unhardened copy <name>_original of Fn if Fn is called by
+// functions that are not hardened (e.g. the excluded ones), and redirects those
+// calls to it. Must be called before Fn is transformed.
+void EDDI::createOriginalFunction(Function &Fn) {
+  SmallVector<CallBase *, 4> UnhardenedCalls;
+  for (Use &U : Fn.uses()) {
+    auto *CInstr = dyn_cast<CallBase>(U.getUser());
+    if (CInstr != nullptr && CInstr->isCallee(&U) &&
+        !shouldCompile(*CInstr->getFunction(), FuncAnnotations)) {
+      UnhardenedCalls.push_back(CInstr);
+    }
+  }
+  if (UnhardenedCalls.empty()) {
+    return;
+  }
+
+  ValueToValueMapTy Params;
+  Function *OriginalFn = CloneFunction(&Fn, Params);
+  OriginalFunctions.insert(OriginalFn);
+  OriginalFn->setName(Fn.getName().str() + "_original");
+  for (CallBase *CInstr : UnhardenedCalls) {
+    CInstr->setCalledFunction(OriginalFn);
+  }
+  Links.add(Fn, *OriginalFn, HardeningLinks::Original);
+}
+
+// Removes the _dup, _ret and _original functions left without users
+void EDDI::removeUnusedFunctions(Module &Md) {
+  sweepUnusedFunctions(Md, [this](Function &Fn) {
+    bool IsDup = Links.getSource(&Fn, HardeningLinks::Dup) != nullptr;
+    if (!(IsDup || Links.getSource(&Fn, HardeningLinks::Ret) ||
+          Links.getSource(&Fn, HardeningLinks::Original))) {
+      return false;
+    }
+    // in per-TU mode the exported _dup functions may be called by other
+    // translation units, eddi-link removes them if they are not
+    return !(PerTU && IsDup && !Fn.hasLocalLinkage());
+  });
+}
+
 // Given Fn, it returns the version of the function with duplicated arguments,
 // or the function Fn itself if it is already the version with duplicated
 // arguments
 Function *EDDI::getFunctionDuplicate(Function *Fn) {
-  // If Fn ends with "_dup" we have already the duplicated function.
+  // If Fn is a _dup function we have already the duplicated function.
   // If Fn is NULL, it means that we don't have a duplicate
-  if (Fn == NULL || Fn->getName().ends_with("_dup")) {
+  if (Fn == NULL || Links.getSource(Fn, HardeningLinks::Dup)) {
     return Fn;
   }
 
-  // Otherwise, we try to get the "_dup" version or the "_ret_dup" version
-  Function *FnDup = Fn->getParent()->getFunction(Fn->getName().str() + "_dup");
+  // Otherwise, we try to get the _dup version or the _ret_dup version
+  GlobalValue *FnDup = Links.get(Fn, HardeningLinks::Dup);
   if (FnDup == NULL) {
-    FnDup = Fn->getParent()->getFunction(Fn->getName().str() + "_ret_dup");
+    if (GlobalValue *FnRet = Links.get(Fn, HardeningLinks::Ret)) {
+      FnDup = Links.get(FnRet, HardeningLinks::Dup);
+    }
   }
-  return FnDup;
+  return cast_or_null<Function>(FnDup);
 }
 
 // Given Fn, it returns the version of the function without the duplicated
 // arguments, or the function Fn itself if it is already the version without
 // duplicated arguments
 Function *EDDI::getFunctionFromDuplicate(Function *Fn) {
-  // If Fn ends with "_dup" we have already the duplicated function.
+  // If Fn is not a _dup function we have already the original function.
   // If Fn is NULL, it means that we don't have a duplicate
-  if (Fn == NULL || !Fn->getName().ends_with("_dup")) {
+  GlobalValue *FnOrig = Links.getSource(Fn, HardeningLinks::Dup);
+  if (Fn == NULL || FnOrig == NULL) {
     return Fn;
   }
 
-  // Otherwise, we try to get the non-"_dup" version
-  Function *FnDup = Fn->getParent()->getFunction(
-      Fn->getName().str().substr(0, Fn->getName().str().length() - 8));
-  if (FnDup == NULL) {
-    FnDup = Fn->getParent()->getFunction(
-        Fn->getName().str().substr(0, Fn->getName().str().length() - 4));
+  // Otherwise, we get the version the _dup (or _ret_dup) one was cloned from
+  if (GlobalValue *FnNoRet = Links.getSource(FnOrig, HardeningLinks::Ret)) {
+    FnOrig = FnNoRet;
   }
-  return FnDup;
+  return cast<Function>(FnOrig);
 }
 
-Constant *EDDI::duplicateConstant(Constant *C, std::map<Value *, Value *> &DuplicatedInstructionMap) {
+Constant *EDDI::duplicateConstant(Constant *C, DenseMap<Value *, Value *> &DuplicatedInstructionMap) {
   Constant *ret = C;
 
   if(isa<Function>(C)) {
@@ -476,7 +1299,7 @@ Constant *EDDI::duplicateConstant(Constant *C, std::map<Value *, Value *> &Dupli
 int globcnt = 0;
 
 void EDDI::duplicateGlobals(
-    Module &Md, std::map<Value *, Value *> &DuplicatedInstructionMap) {
+    Module &Md, DenseMap<Value *, Value *> &DuplicatedInstructionMap) {
   Value *RuntimeSig;
   Value *RetSig;
   std::list<GlobalVariable *> GVars;
@@ -506,7 +1329,7 @@ void EDDI::duplicateGlobals(
     bool isStruct = GV->getValueType()->isStructTy();
     bool isArray = GV->getValueType()->isArrayTy();
     bool isPointer = GV->getValueType()->isPointerTy();
-    bool endsWithDup = GV->getName().ends_with("_dup");
+    bool endsWithDup = Links.getSource(GV, HardeningLinks::Dup) != nullptr;
     bool hasExternalLinkage = GV->isExternallyInitialized() || GV->hasExternalLinkage();
     bool isMetadataInfo = GV->getSection() == "llvm.metadata";
     bool toExclude = !isa<Function>(GV) &&
@@ -562,11 +1385,28 @@ void EDDI::duplicateGlobals(
 
       // Save the duplicated global so that the duplicate can be used as operand
       // of other duplicated instructions
-      DuplicatedInstructionMap.insert(std::pair<Value *, Value *>(GV, GVCopy));
-      DuplicatedInstructionMap.insert(std::pair<Value *, Value *>(GVCopy, GV));
+      DuplicatedInstructionMap.insert({GV, GVCopy});
+      DuplicatedInstructionMap.insert({GVCopy, GV});
+      Links.add(*GV, *GVCopy, HardeningLinks::Dup);
+
+      if (EDDIReplicas == 3) {
+        Constant *ThirdInitializer = nullptr;
+        if (GV->hasInitializer()) {
+          ThirdInitializer = duplicateConstant(GV->getInitializer(), ThirdCopies);
+        }
+        GlobalVariable *GVThird = new GlobalVariable(
+            Md, GV->getValueType(), false, GV->getLinkage(), ThirdInitializer,
+            GV->getName() + "_tmr", InsertBefore, GV->getThreadLocalMode(),
+            GV->getAddressSpace(), GV->isExternallyInitialized());
+        GVThird->setSection(GVCopy->getSection());
+        GVThird->setAlignment(GV->getAlign());
+        GVThird->setDSOLocal(GV->isDSOLocal());
+        ThirdCopies.insert({GV, GVThird});
+        Links.add(*GV, *GVThird, HardeningLinks::Third);
+      }
 
       if (isStructOfFunctions) 
-        ValuesToAlwaysDup.insert(std::pair(GV, GVCopy));
+        ValuesToAlwaysDup.insert({GV, GVCopy});
     }
   }
 }
@@ -588,7 +1428,97 @@ void EDDI::duplicateGlobals(
     return false;
 }
 
-int EDDI::transformCallBaseInst(CallBase *CInstr, std::map<Value *, Value *> &DuplicatedInstructionMap,
+/**
+ * @returns the value to pass as duplicate of the call argument Arg, that is
+ * Arg itself if it has no duplicate.
+ */
+Value *EDDI::getArgDuplicate(Value *Arg,
+                             DenseMap<Value *, Value *> &DuplicatedInstructionMap) {
+  // see if Original has a copy
+  if (DuplicatedInstructionMap.find(Arg) != DuplicatedInstructionMap.end()) {
+    return DuplicatedInstructionMap.find(Arg)->second;
+  }
+  if (isa<GEPOperator>(Arg) && isa<ConstantExpr>(Arg)) {
+    GEPOperator *GEPOperand = cast<GEPOperator>(Arg);
+    Value *PtrOperand = GEPOperand->getPointerOperand();
+    // update the duplicate GEP operator using the duplicate of the pointer
+    // operand
+    if (DuplicatedInstructionMap.find(PtrOperand) !=
+        DuplicatedInstructionMap.end()) {
+      std::vector<Value *> indices;
+      for (auto &Idx : GEPOperand->indices()) {
+        indices.push_back(Idx);
+      }
+      return cast<ConstantExpr>(GEPOperand)
+          ->getInBoundsGetElementPtr(
+              GEPOperand->getSourceElementType(),
+              cast<Constant>(DuplicatedInstructionMap.find(PtrOperand)->second),
+              ArrayRef<Value *>(indices));
+    }
+  }
+  return Arg;
+}
+
+/**
+ * @returns the third copy of V with -eddi-replicas=3, that is V itself if it
+ * has none (e.g. the constants and the values returned by the calls to
+ * functions that are not hardened).
+ */
+Value *EDDI::getThirdCopy(Value *V) {
+  auto Third = ThirdCopies.find(V);
+  if (Third != ThirdCopies.end()) {
+    return Third->second;
+  }
+  if (isa<GEPOperator>(V) && isa<ConstantExpr>(V)) {
+    GEPOperator *GEPOperand = cast<GEPOperator>(V);
+    auto PtrThird = ThirdCopies.find(GEPOperand->getPointerOperand());
+    if (PtrThird != ThirdCopies.end()) {
+      std::vector<Value *> indices;
+      for (auto &Idx : GEPOperand->indices()) {
+        indices.push_back(Idx);
+      }
+      return cast<ConstantExpr>(GEPOperand)
+          ->getInBoundsGetElementPtr(GEPOperand->getSourceElementType(),
+                                     cast<Constant>(PtrThird->second),
+                                     ArrayRef<Value *>(indices));
+    }
+  }
+  return V;
+}
+
+/**
+ * Per-TU mode: the callee of CInstr is defined in another translation unit,
+ * so its _dup version is not visible yet. The duplicates of the fixed
+ * arguments are attached to the call in an "aspis.dup" operand bundle, which
+ * eddi-link uses after linking to call the _dup version (or just drops).
+ * @returns true if CInstr has been replaced and has to be removed
+ */
+bool EDDI::deferDupCall(CallBase *CInstr,
+                        DenseMap<Value *, Value *> &DuplicatedInstructionMap) {
+  Function *Callee = CInstr->getCalledFunction();
+  if (Callee == NULL || !Callee->isDeclaration() || Callee->isIntrinsic() ||
+      !Callee->hasName() || Callee->getName().starts_with("aspis.") ||
+      CInstr->isInlineAsm() || CInstr->getOperandBundle("aspis.dup")) {
+    return false;
+  }
+
+  std::vector<Value *> Copies;
+  for (unsigned i = 0; i < Callee->getFunctionType()->getNumParams(); i++) {
+    Copies.push_back(
+        getArgDuplicate(CInstr->getArgOperand(i), DuplicatedInstructionMap));
+  }
+  SmallVector<OperandBundleDef, 2> Bundles;
+  CInstr->getOperandBundlesAsDefs(Bundles);
+  Bundles.emplace_back("aspis.dup", Copies);
+
+  CallBase *NewCInstr = CallBase::Create(CInstr, Bundles, CInstr);
+  NewCInstr->takeName(CInstr);
+  CInstr->replaceNonMetadataUsesWith(NewCInstr);
+  DuplicatedInstructionMap.insert({NewCInstr, NewCInstr});
+  return true;
+}
+
+int EDDI::transformCallBaseInst(CallBase *CInstr, DenseMap<Value *, Value *> &DuplicatedInstructionMap,
   IRBuilder<> &B, BasicBlock &ErrBB) {
   int res = 0;
   SmallVector<Value *, 6> args;
@@ -602,61 +1532,36 @@ int EDDI::transformCallBaseInst(CallBase *CInstr, std::map<Value *, Value *> &Du
     return 0;
   }
 
-  for (unsigned i = 0; i < CInstr->arg_size(); i++) {
+  // Duplicating only fixed parameters, passing just one time the variadic
+  // arguments. Indirect calls are assumed not to be variadic
+  unsigned NumFixedArgs = Callee != NULL
+                              ? Callee->getFunctionType()->getNumParams()
+                              : CInstr->arg_size();
+  SmallVector<Type *, 6> FixedTypes;
+  for (unsigned i = 0; i < NumFixedArgs; i++) {
+    FixedTypes.push_back(CInstr->getArgOperand(i)->getType());
+  }
+  DupArgLayout Layout =
+      getDupArgLayout(FunctionType::get(CInstr->getType(), FixedTypes, false));
+  args.resize(Layout.NumArgs);
+  ParamTypes.resize(Layout.NumArgs);
+  for (unsigned i = 0; i < NumFixedArgs; i++) {
     // Populate args and ParamTypes from the original instruction
     Value *Arg = CInstr->getArgOperand(i);
-    Value *Copy = Arg;
-
-    // see if Original has a copy
-    if(DuplicatedInstructionMap.find(Arg) != DuplicatedInstructionMap.end()) {
-      Copy = DuplicatedInstructionMap.find(Arg)->second;
+    args[Layout.Orig[i]] = Arg;
+    ParamTypes[Layout.Orig[i]] = Arg->getType();
+    if (Layout.Dup[i] >= 0) {
+      args[Layout.Dup[i]] = getArgDuplicate(Arg, DuplicatedInstructionMap);
+      ParamTypes[Layout.Dup[i]] = Arg->getType();
     }
-    else if (isa<GEPOperator>(Arg) && isa<ConstantExpr>(Arg)) {
-      GEPOperator *GEPOperand = cast<GEPOperator>(Arg);
-      Value *PtrOperand = GEPOperand->getPointerOperand();
-      // update the duplicate GEP operator using the duplicate of the pointer
-      // operand
-      if (DuplicatedInstructionMap.find(PtrOperand) !=
-          DuplicatedInstructionMap.end()) {
-        std::vector<Value *> indices;
-        for (auto &Idx : GEPOperand->indices()) {
-          indices.push_back(Idx);
-        }
-        Constant *CloneGEPOperand =
-            cast<ConstantExpr>(GEPOperand)
-                ->getInBoundsGetElementPtr(
-                    GEPOperand->getSourceElementType(),
-                    cast<Constant>(
-                        DuplicatedInstructionMap.find(PtrOperand)->second),
-                    ArrayRef<Value *>(indices));
-        Copy = CloneGEPOperand;
-      }
-    }
-
-    // Duplicating only fixed parameters, passing just one time the variadic arguments
-    if(Callee != NULL && Callee->getFunctionType() != NULL && i >= Callee->getFunctionType()->getNumParams()) {
-      args.push_back(Arg);
-      if(Callee == NULL) {
-        ParamTypes.push_back(Arg->getType());
-      }
-    } else {
-      if (!AlternateMemMapEnabled) {
-        args.insert(args.begin() + i, Copy);
-        args.push_back(Arg);
-        if(Callee == NULL) {
-          ParamTypes.insert(ParamTypes.begin() + i, Arg->getType());
-          ParamTypes.push_back(Arg->getType());
-        }
-      } else {
-        args.push_back(Copy);
-        args.push_back(Arg);
-        if(Callee == NULL) {
-          ParamTypes.push_back(Arg->getType());
-          ParamTypes.push_back(Arg->getType());
-        }
-      }
+    if (Layout.Third[i] >= 0) {
+      args[Layout.Third[i]] = getThirdCopy(Arg);
+      ParamTypes[Layout.Third[i]] = Arg->getType();
     }
   }
+  for (unsigned i = NumFixedArgs; i < CInstr->arg_size(); i++) {
+    args.push_back(CInstr->getArgOperand(i));
+  }
 
   // In case of duplication of an indirect call, call the function with doubled parameters
   if (Callee == NULL) {
@@ -690,13 +1595,12 @@ int EDDI::transformCallBaseInst(CallBase *CInstr, std::map<Value *, Value *> &Du
       AttributeSet ParamAttrs = CInstr->getAttributes().getParamAttrs(i);
       for(auto &attr : ParamAttrs) {
         if(attr.getKindAsEnum() != Attribute::AttrKind::StructRet){
-          // Assuming that indirect function calls aren't variadic
-          if (!AlternateMemMapEnabled) {
-            cast<CallBase>(NewCInstr)->addParamAttr(i, attr);
-            cast<CallBase>(NewCInstr)->addParamAttr(i + CInstr->arg_size(), attr);
-          } else {
-            cast<CallBase>(NewCInstr)->addParamAttr(i*2, attr);
-            cast<CallBase>(NewCInstr)->addParamAttr(i*2 + 1 , attr);
+          cast<CallBase>(NewCInstr)->addParamAttr(Layout.Orig[i], attr);
+          if (Layout.Dup[i] >= 0) {
+            cast<CallBase>(NewCInstr)->addParamAttr(Layout.Dup[i], attr);
+          }
+          if (Layout.Third[i] >= 0) {
+            cast<CallBase>(NewCInstr)->addParamAttr(Layout.Third[i], attr);
           }
         }
       }
@@ -710,7 +1614,7 @@ int EDDI::transformCallBaseInst(CallBase *CInstr, std::map<Value *, Value *> &Du
     // Replace the old instruction with the new one
     CInstr->replaceNonMetadataUsesWith(NewCInstr);
 
-    DuplicatedInstructionMap.insert(std::pair(NewCInstr, NewCInstr));
+    DuplicatedInstructionMap.insert({NewCInstr, NewCInstr});
     // Remove original instruction since we created the duplicated version
     res = 1;
   } else {
@@ -727,7 +1631,7 @@ int EDDI::transformCallBaseInst(CallBase *CInstr, std::map<Value *, Value *> &Du
       NewCInstr->setDebugLoc(CInstr->getDebugLoc());
     }
     CInstr->replaceNonMetadataUsesWith(NewCInstr);
-    DuplicatedInstructionMap.insert(std::pair(NewCInstr, NewCInstr));
+    DuplicatedInstructionMap.insert({NewCInstr, NewCInstr});
     res = 1;
   }
 
@@ -743,7 +1647,7 @@ int EDDI::transformCallBaseInst(CallBase *CInstr, std::map<Value *, Value *> &Du
  * @returns 1 if the cloned instruction has to be removed, 0 otherwise
  */
 int EDDI::duplicateInstruction(
-    Instruction &I, std::map<Value *, Value *> &DuplicatedInstructionMap,
+    Instruction &I, DenseMap<Value *, Value *> &DuplicatedInstructionMap,
     BasicBlock &ErrBB) {
   if (isValueDuplicated(DuplicatedInstructionMap, I)) {
     return 0;
@@ -756,7 +1660,12 @@ int EDDI::duplicateInstruction(
     
     if (!isAllocaForExceptionHandling(cast<AllocaInst>(I))){
       
-      cloneInstr(I, DuplicatedInstructionMap);
+      // in shadow memory mode the duplicate lives in the shadow of the stack
+      if (ShadowMemEnabled && !isDirectlyAccessedAlloca(cast<AllocaInst>(I))) {
+        DuplicatedInstructionMap.insert({&I, &I});
+      } else {
+        cloneInstr(I, DuplicatedInstructionMap);
+      }
 
     };
 
@@ -768,10 +1677,14 @@ int EDDI::duplicateInstruction(
   else if (isa<BinaryOperator, UnaryInstruction, LoadInst, GetElementPtrInst,
                CmpInst, PHINode, SelectInst,InsertValueInst>(I)) {
     // duplicate the instruction
-    cloneInstr(I, DuplicatedInstructionMap);
+    Instruction *IClone = cloneInstr(I, DuplicatedInstructionMap);
 
     // duplicate the operands
     duplicateOperands(I, DuplicatedInstructionMap, ErrBB);
+
+    if (ShadowMemEnabled && isa<LoadInst>(I)) {
+      redirectToShadow(*IClone, DuplicatedInstructionMap);
+    }
   }
 
   // if the instruction is a store instruction we need to duplicate it and its
@@ -782,19 +1695,26 @@ int EDDI::duplicateInstruction(
     // duplicate the operands
     duplicateOperands(I, DuplicatedInstructionMap, ErrBB);
 
+    if (ShadowMemEnabled) {
+      redirectToShadow(*IClone, DuplicatedInstructionMap);
+    }
+
     // add consistency checks on I
 
-#ifdef CHECK_AT_STORES
-#if (SELECTIVE_CHECKING == 1)
-    if (I.getParent()->getTerminator()->getNumSuccessors() > 1)
-#endif
+    if (CheckAtStores && (!SelectiveChecking ||
+                          I.getParent()->getTerminator()->getNumSuccessors() > 1))
       addConsistencyChecks(I, DuplicatedInstructionMap, ErrBB);
-#endif
     // it may happen that I duplicate a store but don't change its operands, if
-    // that happens I just remove the duplicate
+    // that happens I just remove the duplicate and keep I marked as processed
     if (IClone->isIdenticalTo(&I)) {
+      DuplicatedInstructionMap.erase(IClone);
+      DuplicatedInstructionMap[&I] = &I;
       IClone->eraseFromParent();
-      DuplicatedInstructionMap.erase(DuplicatedInstructionMap.find(&I));
+      if (Instruction *IThird = dyn_cast_or_null<Instruction>(ThirdCopies.lookup(&I))) {
+        ThirdCopies.erase(&I);
+        DuplicatedInstructionMap.erase(IThird);
+        IThird->eraseFromParent();
+      }
     }
   }
 
@@ -805,11 +1725,9 @@ int EDDI::duplicateInstruction(
     // duplicate the operands
     duplicateOperands(I, DuplicatedInstructionMap, ErrBB);
 
-// add consistency checks on I
-#ifdef CHECK_AT_BRANCH
-    if (I.getParent()->getTerminator()->getNumSuccessors() > 1)
+    // add consistency checks on I
+    if (CheckAtBranch && I.getParent()->getTerminator()->getNumSuccessors() > 1)
       addConsistencyChecks(I, DuplicatedInstructionMap, ErrBB);
-#endif
   }
 
   // if the istruction is a call, we duplicate the operands and add consistency
@@ -825,31 +1743,29 @@ int EDDI::duplicateInstruction(
          (*FuncAnnotations.find(Callee)).second.starts_with("to_duplicate")) ||
         isIntrinsicToDuplicate(CInstr)) {
       // duplicate the instruction
-      cloneInstr(*CInstr, DuplicatedInstructionMap);
+      Instruction *IClone = cloneInstr(*CInstr, DuplicatedInstructionMap);
 
       // duplicate the operands
       duplicateOperands(I, DuplicatedInstructionMap, ErrBB);
 
-// add consistency checks on I
-#ifdef CHECK_AT_CALLS
-#if (SELECTIVE_CHECKING == 1)
-      if (I.getParent()->getTerminator()->getNumSuccessors() > 1)
-#endif
+      if (ShadowMemEnabled) {
+        redirectToShadow(*IClone, DuplicatedInstructionMap);
+      }
+
+      // add consistency checks on I
+      if (CheckAtCalls && (!SelectiveChecking ||
+                           I.getParent()->getTerminator()->getNumSuccessors() > 1))
         addConsistencyChecks(I, DuplicatedInstructionMap, ErrBB);
-#endif
     }
 
     else {
       // duplicate the operands
       duplicateOperands(I, DuplicatedInstructionMap, ErrBB);
 
-// add consistency checks on I
-#ifdef CHECK_AT_CALLS
-#if (SELECTIVE_CHECKING == 1)
-      if (I.getParent()->getTerminator()->getNumSuccessors() > 1)
-#endif
+      // add consistency checks on I
+      if (CheckAtCalls && (!SelectiveChecking ||
+                           I.getParent()->getTerminator()->getNumSuccessors() > 1))
         addConsistencyChecks(I, DuplicatedInstructionMap, ErrBB);
-#endif
 
       IRBuilder<> B(CInstr);
       if (!isa<InvokeInst>(CInstr)) {
@@ -862,10 +1778,15 @@ int EDDI::duplicateInstruction(
       Function *Fn = getFunctionDuplicate(CInstr->getCalledFunction());
       // if the _dup function exists, we substitute the call instruction with a
       // call to the function with duplicated arguments
-      if (CInstr->getCalledFunction() == NULL || (Fn != NULL && Fn != CInstr->getCalledFunction())) {
+      if (duplicateHeapCall(CInstr, DuplicatedInstructionMap, res)) {
+        // the heap functions need no other handling
+      } else if (CInstr->getCalledFunction() == NULL || (Fn != NULL && Fn != CInstr->getCalledFunction())) {
         res = transformCallBaseInst(CInstr, DuplicatedInstructionMap, B, ErrBB);
       } else {
         fixFuncValsPassedByReference(*CInstr, DuplicatedInstructionMap, B);
+        if (PerTU) {
+          res = deferDupCall(CInstr, DuplicatedInstructionMap);
+        }
       }
     }
   }
@@ -875,16 +1796,13 @@ int EDDI::duplicateInstruction(
 
 /**
  * @returns True if the value V is present in the DuplicatedInstructionMap
- * either as a key or as value
+ * either as a key or as value. Since every pair is inserted in both directions
+ * (or as a self-mapping for values that are not cloned), it is enough to look
+ * up V among the keys.
  */
 bool EDDI::isValueDuplicated(
-    std::map<Value *, Value *> &DuplicatedInstructionMap, Instruction &V) {
-  for (auto Elem : DuplicatedInstructionMap) {
-    if (Elem.first == &V || Elem.second == &V) {
-      return true;
-    }
-  }
-  return false;
+    DenseMap<Value *, Value *> &DuplicatedInstructionMap, Instruction &V) {
+  return DuplicatedInstructionMap.count(&V) != 0;
 }
 
 Instruction *getSingleReturnInst(Function &F) {
@@ -898,20 +1816,21 @@ Instruction *getSingleReturnInst(Function &F) {
 
 Function *
 EDDI::duplicateFnArgs(Function &Fn, Module &Md,
-                      std::map<Value *, Value *> &DuplicatedInstructionMap) {
+                      DenseMap<Value *, Value *> &DuplicatedInstructionMap) {
   Type *RetType = Fn.getReturnType();
   FunctionType *FnType = Fn.getFunctionType();
 
   // create the param type lists
-  std::vector<Type *> paramTypeVec;
+  DupArgLayout Layout = getDupArgLayout(FnType);
+  std::vector<Type *> paramTypeVec(Layout.NumArgs);
   for (int i = 0; i < Fn.arg_size(); i++) {
     Type *ParamType = FnType->params()[i];
-    if (AlternateMemMapEnabled == false) { // sequential
-      paramTypeVec.insert(paramTypeVec.begin() + i, ParamType);
-      paramTypeVec.push_back(ParamType);
-    } else {
-      paramTypeVec.push_back(ParamType);
-      paramTypeVec.push_back(ParamType); // two times
+    paramTypeVec[Layout.Orig[i]] = ParamType;
+    if (Layout.Dup[i] >= 0) {
+      paramTypeVec[Layout.Dup[i]] = ParamType;
+    }
+    if (Layout.Third[i] >= 0) {
+      paramTypeVec[Layout.Third[i]] = ParamType;
     }
   }
 
@@ -925,13 +1844,10 @@ EDDI::duplicateFnArgs(Function &Fn, Module &Md,
                                    Fn.getName() + "_dup", Fn.getParent());
   ValueToValueMapTy Params;
   for (int i = 0; i < Fn.arg_size(); i++) {
-    if (AlternateMemMapEnabled == false) {
-      Params[Fn.getArg(i)] = ClonedFunc->getArg(Fn.arg_size() + i);
-    } else {
-      Params[Fn.getArg(i)] = ClonedFunc->getArg(i * 2);
-    }
+    Params[Fn.getArg(i)] = ClonedFunc->getArg(Layout.Orig[i]);
   }
   SmallVector<ReturnInst *, 8> returns;
+  Links.add(Fn, *ClonedFunc, HardeningLinks::Dup);
   CloneFunctionInto(ClonedFunc, &Fn, Params,
                     CloneFunctionChangeType::GlobalChanges, returns);
 
@@ -961,6 +1877,19 @@ PreservedAnalyses EDDI::run(Module &Md, ModuleAnalysisManager &AM) {
   getFuncAnnotations(Md, FuncAnnotations);
   LLVM_DEBUG(dbgs() << "[done]\n");
 
+  Links.load(Md);
+  ThirdCopies.clear();
+
+  if (EDDIReplicas != 2 && EDDIReplicas != 3) {
+    errs() << "ERROR - -eddi-replicas must be 2 or 3\n";
+    abort();
+  }
+  if (EDDIReplicas == 3 && (ShadowMemEnabled || EDDIDupHeap || PerTU)) {
+    errs() << "ERROR - -eddi-replicas=3 is not supported with "
+              "-eddi-shadow-mem, -eddi-dup-heap and the per-TU hardening\n";
+    abort();
+  }
+
   createFtFuncs(Md);
   LinkageMap linkageMap = mapFunctionLinkageNames(Md);
 
@@ -983,9 +1912,10 @@ PreservedAnalyses EDDI::run(Module &Md, ModuleAnalysisManager &AM) {
     }
   }
 
-  std::map<Value *, Value *>
-      DuplicatedInstructionMap; // is a map containing the instructions
-                                // and their duplicates
+  // map containing the instructions and their duplicates, in both directions
+  // (<original, copy> and <copy, original>) so that both can be looked up in
+  // constant time
+  DenseMap<Value *, Value *> DuplicatedInstructionMap;
 
   // store the functions that are currently in the module
   std::list<Function *> FnList;
@@ -999,12 +1929,12 @@ PreservedAnalyses EDDI::run(Module &Md, ModuleAnalysisManager &AM) {
       cnt++;
       // LLVM_DEBUG(dbgs() << "Found: " << cnt << "\r");
       FnList.push_back(&Fn);
-      ValueToValueMapTy Params;
-      Function *OriginalFn = CloneFunction(&Fn, Params);
-      OriginalFunctions.insert(OriginalFn);
-      OriginalFn->setName(Fn.getName().str() + "_original");
     }
   }
+  // the unhardened copies are created only where they are called
+  for (Function *Fn : FnList) {
+    createOriginalFunction(*Fn);
+  }
 
   LLVM_DEBUG(dbgs() << "Found: " << FnList.size() << "\n");
 
@@ -1023,20 +1953,32 @@ PreservedAnalyses EDDI::run(Module &Md, ModuleAnalysisManager &AM) {
     });
   }
 
-  LLVM_DEBUG(dbgs() << "Duplicating globals... ");
-  duplicateGlobals(Md, DuplicatedInstructionMap);
-  LLVM_DEBUG(dbgs() << "[done]\n");
+  // in shadow memory mode the runtime copies the globals to their shadow
+  if (ShadowMemEnabled) {
+    emitShadowOffset(Md);
+  } else {
+    LLVM_DEBUG(dbgs() << "Duplicating globals... ");
+    duplicateGlobals(Md, DuplicatedInstructionMap);
+    LLVM_DEBUG(dbgs() << "[done]\n");
+  }
 
   // list of duplicated instructions to remove since they are equal to the
   // original
   std::list<Instruction *> InstructionsToRemove;
   int i = -1;
   int tot_funcs = 0;
+  // execution count and cost of the checks of each block, to apply
+  // -aspis-overhead-budget
+  std::vector<std::pair<uint64_t, uint64_t>> ChecksCosts;
   for (Function &Fn : Md) {
     if (shouldCompile(Fn, FuncAnnotations, OriginalFunctions)) {
       tot_funcs++;
+      for (BasicBlock &BB : Fn) {
+        ChecksCosts.push_back({getProfileCount(BB), estimateChecksCost(BB)});
+      }
     }
   }
+  HotThreshold = getHotBlockThreshold(Md, ChecksCosts);
   LLVM_DEBUG(dbgs() << "Iterating over the module functions...\n");
   for (Function &Fn : Md) {
     if (shouldCompile(Fn, FuncAnnotations, OriginalFunctions)) {
@@ -1044,33 +1986,41 @@ PreservedAnalyses EDDI::run(Module &Md, ModuleAnalysisManager &AM) {
       LLVM_DEBUG(dbgs() << "Compiling " << i << "/" << tot_funcs << ": "
                         << Fn.getName() << "\n");
       CompiledFuncs.insert(&Fn);
+      ErrAccumulator = nullptr;
+      splitHotExits(Fn);
       BasicBlock *ErrBB = BasicBlock::Create(Fn.getContext(), "ErrBB", &Fn);
+      Reachability.compute(Fn);
 
       // If the function is a duplicated one, we need to
       // iterate over the function arguments and duplicate
       // them in order to access them during the instruction
       // duplication phase
       if (DuplicatedFns.find(&Fn) != DuplicatedFns.end()) {
+        auto *FnOrig = cast<Function>(Links.getSource(&Fn, HardeningLinks::Dup));
+        DupArgLayout Layout = getDupArgLayout(FnOrig->getFunctionType());
         // save the function arguments and their duplicates
-        for (int i = 0; i < Fn.arg_size(); i++) {
-          Value *Arg, *ArgClone;
-          if (AlternateMemMapEnabled == false) {
-            if (i >= Fn.arg_size() / 2) {
-              break;
-            }
-            Arg = Fn.getArg(i);
-            ArgClone = Fn.getArg(i + Fn.arg_size() / 2);
-          } else {
-            if (i % 2 == 1)
-              continue;
-            Arg = Fn.getArg(i);
-            ArgClone = Fn.getArg(i + 1);
+        for (int i = 0; i < FnOrig->arg_size(); i++) {
+          if (Layout.Dup[i] < 0) {
+            continue;
           }
-          DuplicatedInstructionMap.insert(
-              std::pair<Value *, Value *>(Arg, ArgClone));
-          DuplicatedInstructionMap.insert(
-              std::pair<Value *, Value *>(ArgClone, Arg));
-          for (User *U : Arg->users()) {
+          Value *Arg = Fn.getArg(Layout.Orig[i]);
+          Value *ArgClone = Fn.getArg(Layout.Dup[i]);
+          DuplicatedInstructionMap.insert({Arg, ArgClone});
+          DuplicatedInstructionMap.insert({ArgClone, Arg});
+          if (Layout.Third[i] >= 0) {
+            ThirdCopies.insert({Arg, Fn.getArg(Layout.Third[i])});
+          }
+        }
+        // all the copies are known before duplicating the users, which may
+        // take more arguments
+        for (int i = 0; i < FnOrig->arg_size(); i++) {
+          if (Layout.Dup[i] < 0) {
+            continue;
+          }
+          Value *Arg = Fn.getArg(Layout.Orig[i]);
+          // the votes at the synchronization points may replace the uses
+          SmallVector<User *, 8> ArgUsers(Arg->users());
+          for (User *U : ArgUsers) {
             if (isa<Instruction>(U)) {
               auto *I = cast<Instruction>(U);
               if (!isValueDuplicated(DuplicatedInstructionMap, *I)) {
@@ -1112,6 +2062,18 @@ PreservedAnalyses EDDI::run(Module &Md, ModuleAnalysisManager &AM) {
         }
       }
 
+      // the callers do not write the shadow of the arguments passed by value
+      if (ShadowMemEnabled) {
+        IRBuilder<> EntryB(&*Fn.getEntryBlock().getFirstInsertionPt());
+        for (Argument &Arg : Fn.args()) {
+          if (Type *ByValTy = Arg.getParamByValType()) {
+            EntryB.CreateMemCpy(createShadowPtr(EntryB, &Arg), MaybeAlign(),
+                                &Arg, MaybeAlign(),
+                                Md.getDataLayout().getTypeAllocSize(ByValTy));
+          }
+        }
+      }
+
       // insert the code for calling the error basic block in case of a mismatch
       IRBuilder<> ErrB(ErrBB);
 
@@ -1124,6 +2086,12 @@ PreservedAnalyses EDDI::run(Module &Md, ModuleAnalysisManager &AM) {
       auto *CallI = ErrB.CreateCall(CalleeF);
       ErrB.CreateUnreachable();
 
+      // check the accumulator at the flush points (in branch mode, if some
+      // checks have been relaxed)
+      if (ErrAccumulator != nullptr) {
+        addAccumulatorFlushes(Fn, *ErrBB);
+      }
+
       #ifdef DC_HANDLER_INLINE
       std::list<Instruction *> errBranches;
       for (User *U : ErrBB->users()) {
@@ -1170,38 +2138,15 @@ PreservedAnalyses EDDI::run(Module &Md, ModuleAnalysisManager &AM) {
     I2rm->eraseFromParent();
   }
 
-  persistCompiledFunctions(CompiledFuncs, "compiled_eddi_functions.csv");
+  // handed to DuplicateGlobals
+  recordCompiledFunctions(Md, "aspis.eddi.compiled", CompiledFuncs);
 
-  std::list<Function*> FnsToRemove;
-  int removed;
-  do {
-    FnsToRemove.clear();
-    removed = 0;
-    for (Function &Fn : Md) {
-      if ((Fn.getName().ends_with("_dup") || Fn.getName().ends_with("_ret") || Fn.getName().ends_with("original") )) {
-        bool shouldRemove = true;
-        for (auto U : Fn.users()) {
-          if (isa<Instruction>(U) || isa<Constant>(U)) {
-            shouldRemove = false; 
-            break;
-          }
-        }
-        if (shouldRemove) FnsToRemove.push_back(&Fn);
-      }
-      else {
-        //auto FnDup = getFunctionDuplicate(&Fn);
-        /* if (!Fn.getName().equals("main") && !Fn.getName().equals("DataCorruption_Handler") && !Fn.getName().equals("SigMismatch_Handler") && !Fn.isDeclaration() && Fn.getNumUses() == 0) {
-          FnsToRemove.push_back(&Fn);
-        } */
-      }
-    }
+  // tell eddi-link that the deferred calls have to be resolved
+  if (PerTU) {
+    Md.addModuleFlag(Module::Max, "aspis.per-tu", 1);
+  }
 
-    for (auto Fn : FnsToRemove) {
-      //errs() << "Erasing: " << Fn->getName() << "\n";
-      Fn->eraseFromParent();
-      removed++;
-    }
-  } while (removed > 0);
+  removeUnusedFunctions(Md);
   return PreservedAnalyses::none();
 }
 
@@ -1229,6 +2174,33 @@ llvm::PassPluginLibraryInfo getEDDIPluginInfo() {
                   }
                   return false;
                 });
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &FPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "eddi-check-elim") {
+                    FPM.addPass(EDDICheckElim());
+                    return true;
+                  }
+                  return false;
+                });
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &FPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "eddi-loop-checks") {
+                    FPM.addPass(EDDILoopChecks());
+                    return true;
+                  }
+                  return false;
+                });
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &FPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "eddi-link") {
+                    FPM.addPass(EDDILink());
+                    return true;
+                  }
+                  return false;
+                });
             PB.registerPipelineParsingCallback(
                 [](StringRef Name, ModulePassManager &FPM,
                    ArrayRef<PassBuilder::PipelineElement>) {
@@ -0,0 +1,181 @@
+/**
+ * ************************************************************************************************
+ * @brief  LLVM pass removing the EDDI consistency checks that are made
+ *         redundant by a dominating check on the same pair of values (see
+ *         EDDI.cpp). It must run after eddi-verify, which tags each check with
+ *         the `aspis.check` metadata.
+ *
+ *         A check comparing A and A' is redundant if a check on the same pair
+ *         dominates it: the execution reaches the second check only if the
+ *         first one succeeded, and SSA values cannot change in between. Values
+ *         loaded from memory are identified by their pointer and by the
+ *         MemorySSA access clobbering them, so two loads of the same location
+ *         with no store in between are considered the same value.
+ * ************************************************************************************************
+*/
+#include "ASPIS.h"
+#include "llvm/ADT/ScopedHashTable.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/MemorySSA.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+#include <tuple>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "eddi_check_elim"
+
+STATISTIC(NumChecks, "Number of EDDI consistency checks analyzed");
+STATISTIC(NumChecksRemoved, "Number of redundant EDDI consistency checks removed");
+
+namespace {
+
+// <value or pointer, clobbering access (loads only), loaded type (loads only)>
+using OperandKey = std::tuple<Value *, MemoryAccess *, Type *>;
+// <predicate, first operand, second operand>, the operands are sorted
+using CheckKey = std::tuple<unsigned, Value *, MemoryAccess *, Type *, Value *,
+                            MemoryAccess *, Type *>;
+using CheckTable = ScopedHashTable<CheckKey, Instruction *>;
+
+/**
+ * Returns the value that is actually compared by a check operand, skipping
+ * the bitcasts and the vector packing of aggregates done by EDDI.
+ */
+Value *getComparedValue(Value *V) {
+  while (true) {
+    if (auto *BC = dyn_cast<BitCastInst>(V)) {
+      V = BC->getOperand(0);
+    } else if (auto *IE = dyn_cast<InsertElementInst>(V)) {
+      // aggregates are packed element by element, the packed aggregate is the
+      // source of the extracted elements
+      Value *Elem = IE->getOperand(1);
+      while (auto *BC = dyn_cast<BitCastInst>(Elem)) {
+        Elem = BC->getOperand(0);
+      }
+      if (auto *EV = dyn_cast<ExtractValueInst>(Elem)) {
+        return EV->getAggregateOperand();
+      }
+      return V;
+    } else {
+      return V;
+    }
+  }
+}
+
+OperandKey getOperandKey(Value *V, MemorySSA &MSSA) {
+  V = getComparedValue(V);
+  if (auto *LI = dyn_cast<LoadInst>(V)) {
+    if (LI->isSimple()) {
+      MemoryAccess *Clobber =
+          MSSA.getWalker()->getClobberingMemoryAccess(LI);
+      return {LI->getPointerOperand(), Clobber, LI->getType()};
+    }
+  }
+  return {V, nullptr, nullptr};
+}
+
+/**
+ * Computes the key of a check produced by EDDI: either `icmp eq A, A'` or
+ * `not(vector.reduce.or(icmp ne A, A'))` for packed aggregates.
+ * @returns true if the check has a known shape
+ */
+bool getCheckKey(Instruction &Check, MemorySSA &MSSA, CheckKey &Key) {
+  ICmpInst *Cmp = dyn_cast<ICmpInst>(&Check);
+  if (Cmp == nullptr && Check.getOpcode() == Instruction::Xor) {
+    auto *Reduce = dyn_cast<IntrinsicInst>(Check.getOperand(0));
+    if (Reduce != nullptr &&
+        Reduce->getIntrinsicID() == Intrinsic::vector_reduce_or) {
+      Cmp = dyn_cast<ICmpInst>(Reduce->getArgOperand(0));
+    }
+  }
+  if (Cmp == nullptr || !Cmp->isEquality()) {
+    return false;
+  }
+
+  OperandKey K1 = getOperandKey(Cmp->getOperand(0), MSSA);
+  OperandKey K2 = getOperandKey(Cmp->getOperand(1), MSSA);
+  // equality is symmetric
+  if (K2 < K1) {
+    std::swap(K1, K2);
+  }
+  Key = std::tuple_cat(std::make_tuple((unsigned)Cmp->getPredicate()), K1, K2);
+  return true;
+}
+
+} // namespace
+
+PreservedAnalyses EDDICheckElim::run(Module &Md, ModuleAnalysisManager &AM) {
+  auto &FAM =
+      AM.getResult<FunctionAnalysisManagerModuleProxy>(Md).getManager();
+  bool Changed = false;
+
+  for (Function &Fn : Md) {
+    if (Fn.isDeclaration()) {
+      continue;
+    }
+    DominatorTree &DT = FAM.getResult<DominatorTreeAnalysis>(Fn);
+    MemorySSA &MSSA = FAM.getResult<MemorySSAAnalysis>(Fn).getMSSA();
+
+    std::vector<Instruction *> Redundant;
+    unsigned FnChecks = 0;
+
+    // visit the dominator tree in depth-first order, keeping a scope of the
+    // verified pairs for each node
+    CheckTable AvailableChecks;
+    struct StackEntry {
+      DomTreeNode *Node;
+      DomTreeNode::const_iterator NextChild;
+      std::unique_ptr<CheckTable::ScopeTy> Scope;
+    };
+    SmallVector<StackEntry, 32> Stack;
+    auto Enter = [&](DomTreeNode *Node) {
+      Stack.push_back({Node, Node->begin(),
+                       std::make_unique<CheckTable::ScopeTy>(AvailableChecks)});
+      for (Instruction &I : *Node->getBlock()) {
+        if (!I.hasMetadata("aspis.check")) {
+          continue;
+        }
+        FnChecks++;
+        CheckKey Key;
+        if (!getCheckKey(I, MSSA, Key)) {
+          continue;
+        }
+        if (AvailableChecks.count(Key)) {
+          Redundant.push_back(&I);
+        } else {
+          AvailableChecks.insert(Key, &I);
+        }
+      }
+    };
+
+    Enter(DT.getRootNode());
+    while (!Stack.empty()) {
+      StackEntry &Top = Stack.back();
+      if (Top.NextChild == Top.Node->end()) {
+        Stack.pop_back();
+        continue;
+      }
+      DomTreeNode *Child = *Top.NextChild;
+      ++Top.NextChild;
+      Enter(Child);
+    }
+
+    NumChecks += FnChecks;
+    NumChecksRemoved += Redundant.size();
+    LLVM_DEBUG(dbgs() << "[eddi-check-elim] " << Fn.getName() << ": removed "
+                      << Redundant.size() << "/" << FnChecks << " checks\n");
+
+    if (!Redundant.empty()) {
+      // MemorySSA is not kept up to date while removing the loads
+      FAM.invalidate(Fn, PreservedAnalyses::none());
+      removeConsistencyChecks(Fn, Redundant);
+      Changed = true;
+    }
+  }
+
+  return Changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+}
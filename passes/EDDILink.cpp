@@ -0,0 +1,191 @@
+/**
+ * ************************************************************************************************
+ * @brief  Link-time step of the per-translation-unit EDDI hardening (see
+ *         EDDI.cpp and aspis.sh -j).
+ *
+ *         When the translation units are hardened separately, the calls to a
+ *         function defined in another unit cannot be redirected to its _dup
+ *         version, which is not visible yet. EDDI then attaches the duplicated
+ *         arguments to the call in an "aspis.dup" operand bundle. Once the
+ *         units are linked, this pass replaces such calls with calls to the
+ *         _dup (or _ret_dup) functions, drops the bundles that cannot be
+ *         resolved (e.g. calls to library functions), and removes the exported
+ *         _dup functions that end up being unused.
+ * ************************************************************************************************
+*/
+#include "ASPIS.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+#include <list>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "eddi_link"
+
+STATISTIC(NumCallsResolved, "Number of cross-module calls redirected to the _dup functions");
+STATISTIC(NumRetCallsResolved, "Number of cross-module calls redirected to the _ret_dup functions");
+STATISTIC(NumBundlesDropped, "Number of aspis.dup bundles dropped");
+STATISTIC(NumDupFnsRemoved, "Number of unused _dup functions removed");
+
+/**
+ * Redirects CInstr to the _dup or _ret_dup version of its callee, using the
+ * duplicated arguments of its aspis.dup bundle.
+ * @returns true if the call has been replaced
+ */
+bool EDDILink::resolveDupCall(Module &Md, CallBase *CInstr) {
+  Function *Callee = CInstr->getCalledFunction();
+  auto Bundle = CInstr->getOperandBundle("aspis.dup");
+  if (Callee == NULL || !Bundle) {
+    return false;
+  }
+
+  // functions returning a value have been turned into _ret functions by
+  // func-ret-to-ref, which return it through a pointer passed as last arg
+  bool RetByRef = false;
+  auto *FnDup = dyn_cast_or_null<Function>(Links.get(Callee, HardeningLinks::Dup));
+  if (FnDup == NULL && !Callee->getReturnType()->isVoidTy() &&
+      !isa<InvokeInst>(CInstr)) {
+    if (GlobalValue *FnRet = Links.get(Callee, HardeningLinks::Ret)) {
+      FnDup = dyn_cast_or_null<Function>(Links.get(FnRet, HardeningLinks::Dup));
+    }
+    RetByRef = true;
+  }
+  if (FnDup == NULL || FnDup->isDeclaration()) {
+    return false;
+  }
+
+  unsigned NumParams = Callee->getFunctionType()->getNumParams();
+  std::vector<Value *> Originals, Copies;
+  for (unsigned i = 0; i < NumParams; i++) {
+    Originals.push_back(CInstr->getArgOperand(i));
+    Copies.push_back(Bundle->Inputs[i]);
+  }
+  AllocaInst *RetPtr = NULL;
+  if (RetByRef) {
+    IRBuilder<> AllocaB(&*CInstr->getFunction()->getEntryBlock().getFirstInsertionPt());
+    RetPtr = AllocaB.CreateAlloca(Callee->getReturnType());
+    Originals.push_back(RetPtr);
+    // in shadow memory mode the pointer is passed once, see getDupArgLayout
+    Copies.push_back(ShadowMemEnabled
+                         ? RetPtr
+                         : AllocaB.CreateAlloca(Callee->getReturnType()));
+  }
+
+  // same layout of the arguments used by EDDI for the calls to _dup functions
+  SmallVector<Type *, 8> ParamTypes;
+  for (Value *Original : Originals) {
+    ParamTypes.push_back(Original->getType());
+  }
+  DupArgLayout Layout = getDupArgLayout(
+      FunctionType::get(Callee->getReturnType(), ParamTypes, false));
+  std::vector<Value *> args(Layout.NumArgs);
+  for (unsigned i = 0; i < Originals.size(); i++) {
+    args[Layout.Orig[i]] = Originals[i];
+    if (Layout.Dup[i] >= 0) {
+      args[Layout.Dup[i]] = Copies[i];
+    }
+  }
+  // the variadic arguments are passed just once
+  for (unsigned i = NumParams; i < CInstr->arg_size(); i++) {
+    args.push_back(CInstr->getArgOperand(i));
+  }
+
+  FunctionType *FnType = FnDup->getFunctionType();
+  bool TypesMatch = FnType->getNumParams() == Layout.NumArgs &&
+                    (FnType->isVarArg() || args.size() == FnType->getNumParams());
+  for (unsigned i = 0; TypesMatch && i < FnType->getNumParams(); i++) {
+    TypesMatch = args[i]->getType() == FnType->getParamType(i);
+  }
+  if (!TypesMatch) {
+    errs() << "WARNING - Cannot call " << FnDup->getName()
+           << " with the arguments of: " << *CInstr << "\n";
+    if (RetPtr != NULL) {
+      if (Copies.back() != RetPtr) {
+        cast<Instruction>(Copies.back())->eraseFromParent();
+      }
+      RetPtr->eraseFromParent();
+    }
+    return false;
+  }
+
+  IRBuilder<> B(CInstr);
+  Instruction *NewCInstr;
+  if (auto *IInst = dyn_cast<InvokeInst>(CInstr)) {
+    NewCInstr = B.CreateInvoke(FnType, FnDup, IInst->getNormalDest(),
+                               IInst->getUnwindDest(), args);
+  } else {
+    NewCInstr = B.CreateCall(FnType, FnDup, args);
+  }
+  NewCInstr->setDebugLoc(CInstr->getDebugLoc());
+
+  if (RetByRef) {
+    B.SetInsertPoint(NewCInstr->getNextNode());
+    Value *Ret = B.CreateLoad(Callee->getReturnType(), RetPtr);
+    Ret->takeName(CInstr);
+    CInstr->replaceAllUsesWith(Ret);
+    NumRetCallsResolved++;
+  } else {
+    CInstr->replaceNonMetadataUsesWith(NewCInstr);
+  }
+  CInstr->eraseFromParent();
+  return true;
+}
+
+PreservedAnalyses EDDILink::run(Module &Md, ModuleAnalysisManager &AM) {
+  // the links of all the translation units, merged by llvm-link
+  Links.load(Md);
+  std::list<CallBase *> DeferredCalls;
+  for (Function &Fn : Md) {
+    for (BasicBlock &BB : Fn) {
+      for (Instruction &I : BB) {
+        if (auto *CInstr = dyn_cast<CallBase>(&I)) {
+          if (CInstr->getOperandBundle("aspis.dup")) {
+            DeferredCalls.push_back(CInstr);
+          }
+        }
+      }
+    }
+  }
+
+  unsigned Resolved = 0, Removed = 0;
+  for (CallBase *CInstr : DeferredCalls) {
+    if (resolveDupCall(Md, CInstr)) {
+      Resolved++;
+      continue;
+    }
+    // the back-end does not know the bundle, so it must be dropped anyway
+    SmallVector<OperandBundleDef, 2> Bundles;
+    CInstr->getOperandBundlesAsDefs(Bundles);
+    llvm::erase_if(Bundles, [](OperandBundleDef &OB) {
+      return OB.getTag() == "aspis.dup";
+    });
+    CallBase *NewCInstr = CallBase::Create(CInstr, Bundles, CInstr);
+    NewCInstr->takeName(CInstr);
+    CInstr->replaceAllUsesWith(NewCInstr);
+    CInstr->eraseFromParent();
+  }
+
+  // the exported _dup functions are kept by EDDI in per-TU mode
+  if (Md.getModuleFlag("aspis.per-tu") != nullptr) {
+    Removed = sweepUnusedFunctions(Md, [this](Function &Fn) {
+      return !Fn.isDeclaration() &&
+             Links.getSource(&Fn, HardeningLinks::Dup) != nullptr;
+    });
+  }
+
+  NumCallsResolved += Resolved;
+  NumBundlesDropped += DeferredCalls.size() - Resolved;
+  NumDupFnsRemoved += Removed;
+  LLVM_DEBUG(dbgs() << "[eddi-link] resolved " << Resolved << "/"
+                    << DeferredCalls.size() << " deferred calls, removed "
+                    << Removed << " unused _dup functions\n");
+
+  return DeferredCalls.empty() && Removed == 0
+             ? PreservedAnalyses::all()
+             : PreservedAnalyses::none();
+}
@@ -0,0 +1,408 @@
+/**
+ * ************************************************************************************************
+ * @brief  LLVM pass moving the EDDI consistency checks (tagged with the
+ *         `aspis.check` metadata by eddi-verify) out of the loop bodies:
+ *
+ *         - checks on loop-invariant values are hoisted to the loop preheader,
+ *           so that they are executed once instead of at every iteration;
+ *         - checks on the loop-carried values written by stores (e.g. an
+ *           accumulator) are sunk to the loop exits: a mismatch is recorded in
+ *           a per-loop flag, which is tested when leaving the loop and, with
+ *           -eddi-loop-check-period=N, every N iterations.
+ *
+ *         Sinking trades detection latency for speed, hence it is applied only
+ *         to loops that do not call other functions, where a corrupted value
+ *         stored in memory cannot escape before the flag is tested. The checks
+ *         on the addresses of the stores are never sunk: a corrupted address
+ *         would write to arbitrary memory (the flag included) at every
+ *         iteration before the test.
+ * ************************************************************************************************
+*/
+#include "ASPIS.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/MemorySSA.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+#include <llvm/Support/CommandLine.h>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "eddi_loop_checks"
+
+STATISTIC(NumChecksHoisted, "Number of EDDI consistency checks hoisted to loop preheaders");
+STATISTIC(NumChecksSunk, "Number of EDDI consistency checks sunk to loop exits");
+
+static cl::opt<unsigned> LoopCheckPeriod(
+    "eddi-loop-check-period",
+    cl::desc("Test the flag of the checks sunk out of a loop every N "
+             "iterations (0: only at the loop exits)"),
+    cl::init(0));
+
+namespace {
+
+struct HoistInfo {
+  // instructions computing the check, definitions first
+  SmallVector<Instruction *, 8> Tree;
+  Instruction *PreheaderTerm;
+  BasicBlock *ErrBB;
+};
+
+struct SinkInfo {
+  std::vector<Instruction *> Checks;
+  BasicBlock *ErrBB;
+  Instruction *PreheaderTerm;
+  SmallVector<BasicBlock *, 4> ExitBBs;
+  SmallVector<BasicBlock *, 4> Latches;
+};
+
+/**
+ * Returns the error block the check jumps to, or nullptr if the check does
+ * not branch to an error block (e.g. in accumulate mode).
+ */
+BasicBlock *getErrBB(Instruction &Check) {
+  auto *BI = dyn_cast<BranchInst>(Check.getParent()->getTerminator());
+  if (BI == nullptr || !BI->isConditional()) {
+    return nullptr;
+  }
+  BasicBlock *ErrBB = BI->getSuccessor(1);
+  if (!isa<UnreachableInst>(ErrBB->getTerminator())) {
+    return nullptr;
+  }
+  return ErrBB;
+}
+
+/**
+ * Collects in Tree (definitions first) the instructions of the loop L
+ * computing the check. Returns false if some of them depend on values
+ * changing across iterations, or cannot be moved to the preheader.
+ */
+bool collectHoistableTree(Instruction &I, Loop &L, MemorySSA &MSSA,
+                          bool GuaranteedToExecute,
+                          SmallVectorImpl<Instruction *> &Tree,
+                          SmallPtrSetImpl<Instruction *> &Visited) {
+  if (!Visited.insert(&I).second) {
+    return true;
+  }
+  if (isa<PHINode>(I)) {
+    return false;
+  }
+  if (auto *LI = dyn_cast<LoadInst>(&I)) {
+    // the loaded location must not be written in the loop, and the load must
+    // be executed anyway, as the pointer may be valid only in the loop
+    if (!LI->isSimple() || !GuaranteedToExecute) {
+      return false;
+    }
+    MemoryAccess *Clobber = MSSA.getWalker()->getClobberingMemoryAccess(LI);
+    if (!MSSA.isLiveOnEntryDef(Clobber) && L.contains(Clobber->getBlock())) {
+      return false;
+    }
+  } else if (!isSafeToSpeculativelyExecute(&I)) {
+    return false;
+  }
+
+  for (Value *Op : I.operand_values()) {
+    auto *OpI = dyn_cast<Instruction>(Op);
+    if (OpI != nullptr && L.contains(OpI) &&
+        !collectHoistableTree(*OpI, L, MSSA, GuaranteedToExecute, Tree,
+                              Visited)) {
+      return false;
+    }
+  }
+  Tree.push_back(&I);
+  return true;
+}
+
+/**
+ * Returns true if Check compares the value written by the store it guards,
+ * and the value is carried to the next iteration of L: it flows into a PHI of
+ * the header, or the loop loads it back from the stored location (as for the
+ * variables kept in memory).
+ */
+bool isLoopCarriedStoreCheck(Instruction &Check, Loop &L) {
+  auto *Cmp = dyn_cast<ICmpInst>(&Check);
+  auto *BI = dyn_cast<BranchInst>(Check.getParent()->getTerminator());
+  if (Cmp == nullptr || BI == nullptr || !BI->isConditional()) {
+    return false;
+  }
+  // the verification block jumps to the block starting with the store
+  auto *SI = dyn_cast<StoreInst>(&BI->getSuccessor(0)->front());
+  if (SI == nullptr) {
+    return false;
+  }
+  Value *Stored = SI->getValueOperand();
+  bool ComparesStored = any_of(Cmp->operand_values(), [&](Value *V) {
+    while (auto *BC = dyn_cast<BitCastInst>(V)) {
+      V = BC->getOperand(0);
+    }
+    return V == Stored;
+  });
+  if (!ComparesStored) {
+    return false;
+  }
+
+  for (User *U : Stored->users()) {
+    if (isa<PHINode>(U) && cast<PHINode>(U)->getParent() == L.getHeader()) {
+      return true;
+    }
+  }
+  for (User *U : SI->getPointerOperand()->users()) {
+    if (isa<LoadInst>(U) && L.contains(cast<LoadInst>(U))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Returns true if the checks at stores can be sunk out of L: the loop must
+ * have a preheader, must not call other functions and its exits must not be
+ * exception handling pads. A loop without exits (e.g. an event loop) needs
+ * the periodic test, or the sunk checks would never be tested.
+ */
+bool canSinkChecks(Loop &L) {
+  if (L.getLoopPreheader() == nullptr ||
+      (L.hasNoExitBlocks() && LoopCheckPeriod == 0)) {
+    return false;
+  }
+  for (BasicBlock *BB : L.blocks()) {
+    for (Instruction &I : *BB) {
+      auto *CB = dyn_cast<CallBase>(&I);
+      if (CB == nullptr) {
+        continue;
+      }
+      Function *Callee = CB->getCalledFunction();
+      if (Callee == nullptr ||
+          (!Callee->isIntrinsic() && !Callee->getName().starts_with("aspis."))) {
+        return false;
+      }
+    }
+  }
+  SmallVector<BasicBlock *, 4> ExitBBs;
+  L.getUniqueExitBlocks(ExitBBs);
+  for (BasicBlock *ExitBB : ExitBBs) {
+    if (ExitBB->isEHPad()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Returns true if BB is the error block ErrBB, or a copy of it doing nothing
+ * but calling DataCorruption_Handler. Other blocks ending with unreachable
+ * (e.g. a path calling exit()) may still expose the values of the loop.
+ */
+bool isErrorBlock(BasicBlock &BB, BasicBlock &ErrBB) {
+  if (&BB == &ErrBB) {
+    return true;
+  }
+  if (!isa<UnreachableInst>(BB.getTerminator())) {
+    return false;
+  }
+  bool CallsHandler = false;
+  for (Instruction &I : BB) {
+    if (I.isTerminator() || isa<DbgInfoIntrinsic>(I)) {
+      continue;
+    }
+    auto *CB = dyn_cast<CallBase>(&I);
+    if (CB == nullptr || CB->getCalledFunction() == nullptr ||
+        !CB->getCalledFunction()->getName().contains("DataCorruption_Handler")) {
+      return false;
+    }
+    CallsHandler = true;
+  }
+  return CallsHandler;
+}
+
+/**
+ * Splits the block of InsertPt before it and adds a jump to ErrBB, taken if
+ * Cond is equal to ErrIf.
+ */
+void insertCheckBranch(Instruction *InsertPt, Value *Cond, bool ErrIf,
+                       BasicBlock &ErrBB) {
+  BasicBlock *BB = InsertPt->getParent();
+  BasicBlock *Cont = BB->splitBasicBlock(InsertPt);
+  Instruction *OldBr = BB->getTerminator();
+  auto *CondBr = ErrIf ? BranchInst::Create(&ErrBB, Cont, Cond, OldBr)
+                       : BranchInst::Create(Cont, &ErrBB, Cond, OldBr);
+  if (DebugEnabled) {
+    CondBr->setDebugLoc(findNearestDebugLoc(InsertPt));
+  }
+  OldBr->eraseFromParent();
+}
+
+/**
+ * Clones the instructions computing a check before the terminator of the
+ * preheader and adds the branch to the error block.
+ */
+void hoistCheck(HoistInfo &Info) {
+  ValueToValueMapTy VMap;
+  Instruction *Clone = nullptr;
+  for (Instruction *I : Info.Tree) {
+    Clone = I->clone();
+    Clone->insertBefore(Info.PreheaderTerm);
+    VMap[I] = Clone;
+    RemapInstruction(Clone, VMap,
+                     RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+  }
+  // the check is true if the values are consistent
+  insertCheckBranch(Info.PreheaderTerm, Clone, false, *Info.ErrBB);
+}
+
+/**
+ * Moves the checks of Info out of their loop: each check updates the flag of
+ * the loop, which is tested at the exits and, if requested, periodically.
+ */
+void sinkChecks(SinkInfo &Info) {
+  Instruction *PreheaderTerm = Info.PreheaderTerm;
+  Function &Fn = *PreheaderTerm->getFunction();
+  IRBuilder<> B(&*Fn.getEntryBlock().getFirstInsertionPt());
+  AllocaInst *Flag = B.CreateAlloca(B.getInt1Ty(), nullptr, "eddi_loop_acc");
+  B.CreateStore(B.getFalse(), Flag);
+  B.SetInsertPoint(PreheaderTerm);
+  B.CreateStore(B.getFalse(), Flag);
+
+  for (Instruction *Check : Info.Checks) {
+    // the copy of the check does not verify the values anymore, so it must
+    // not be recognized as a check
+    Instruction *Copy = Check->clone();
+    Copy->setMetadata("aspis.check", nullptr);
+    Copy->insertAfter(Check);
+    B.SetInsertPoint(Copy->getNextNode());
+    Value *Mismatch = B.CreateNot(Copy);
+    B.CreateStore(B.CreateOr(B.CreateLoad(B.getInt1Ty(), Flag), Mismatch),
+                  Flag);
+  }
+
+  for (BasicBlock *ExitBB : Info.ExitBBs) {
+    // leaving the loop to an error block does not require the test
+    if (isErrorBlock(*ExitBB, *Info.ErrBB)) {
+      continue;
+    }
+    Instruction *InsertPt = &*ExitBB->getFirstInsertionPt();
+    B.SetInsertPoint(InsertPt);
+    insertCheckBranch(InsertPt, B.CreateLoad(B.getInt1Ty(), Flag), true,
+                      *Info.ErrBB);
+  }
+
+  if (LoopCheckPeriod > 0) {
+    B.SetInsertPoint(&*Fn.getEntryBlock().getFirstInsertionPt());
+    AllocaInst *Counter =
+        B.CreateAlloca(B.getInt32Ty(), nullptr, "eddi_loop_cnt");
+    B.SetInsertPoint(PreheaderTerm);
+    B.CreateStore(B.getInt32(0), Counter);
+    for (BasicBlock *Latch : Info.Latches) {
+      Instruction *LatchTerm = Latch->getTerminator();
+      B.SetInsertPoint(LatchTerm);
+      Value *Cnt =
+          B.CreateAdd(B.CreateLoad(B.getInt32Ty(), Counter), B.getInt32(1));
+      Value *IsPeriod = B.CreateICmpEQ(Cnt, B.getInt32(LoopCheckPeriod));
+      B.CreateStore(B.CreateSelect(IsPeriod, B.getInt32(0), Cnt), Counter);
+      Value *Mismatch =
+          B.CreateAnd(IsPeriod, B.CreateLoad(B.getInt1Ty(), Flag));
+      insertCheckBranch(LatchTerm, Mismatch, true, *Info.ErrBB);
+    }
+  }
+}
+
+} // namespace
+
+PreservedAnalyses EDDILoopChecks::run(Module &Md, ModuleAnalysisManager &AM) {
+  auto &FAM =
+      AM.getResult<FunctionAnalysisManagerModuleProxy>(Md).getManager();
+  bool Changed = false;
+
+  for (Function &Fn : Md) {
+    if (Fn.isDeclaration()) {
+      continue;
+    }
+    DominatorTree &DT = FAM.getResult<DominatorTreeAnalysis>(Fn);
+    LoopInfo &LI = FAM.getResult<LoopAnalysis>(Fn);
+    MemorySSA &MSSA = FAM.getResult<MemorySSAAnalysis>(Fn).getMSSA();
+
+    // first decide what to do with each check, then transform the function,
+    // as the analyses are not kept up to date
+    std::vector<HoistInfo> Hoists;
+    MapVector<Loop *, SinkInfo> Sinks;
+    std::vector<Instruction *> MovedChecks;
+
+    for (BasicBlock &BB : Fn) {
+      Loop *L = LI.getLoopFor(&BB);
+      if (L == nullptr) {
+        continue;
+      }
+      SmallVector<BasicBlock *, 4> ExitingBBs;
+      L->getExitingBlocks(ExitingBBs);
+      bool GuaranteedToExecute = all_of(ExitingBBs, [&](BasicBlock *Exiting) {
+        return DT.dominates(&BB, Exiting);
+      });
+
+      for (Instruction &I : BB) {
+        MDNode *CheckMD = I.getMetadata("aspis.check");
+        if (CheckMD == nullptr) {
+          continue;
+        }
+        BasicBlock *ErrBB = getErrBB(I);
+        if (ErrBB == nullptr) {
+          continue;
+        }
+
+        HoistInfo Hoist;
+        SmallPtrSet<Instruction *, 8> Visited;
+        if (L->getLoopPreheader() != nullptr &&
+            collectHoistableTree(I, *L, MSSA, GuaranteedToExecute, Hoist.Tree,
+                                 Visited)) {
+          Hoist.PreheaderTerm = L->getLoopPreheader()->getTerminator();
+          Hoist.ErrBB = ErrBB;
+          Hoists.push_back(Hoist);
+          MovedChecks.push_back(&I);
+        } else if (cast<MDString>(CheckMD->getOperand(0))->getString() ==
+                       "store" &&
+                   isLoopCarriedStoreCheck(I, *L) && canSinkChecks(*L)) {
+          SinkInfo &Sink = Sinks[L];
+          if (Sink.Checks.empty()) {
+            Sink.ErrBB = ErrBB;
+            Sink.PreheaderTerm = L->getLoopPreheader()->getTerminator();
+            L->getUniqueExitBlocks(Sink.ExitBBs);
+            L->getLoopLatches(Sink.Latches);
+          }
+          Sink.Checks.push_back(&I);
+          MovedChecks.push_back(&I);
+        }
+      }
+    }
+
+    if (MovedChecks.empty()) {
+      continue;
+    }
+
+    FAM.invalidate(Fn, PreservedAnalyses::none());
+
+    for (HoistInfo &Hoist : Hoists) {
+      hoistCheck(Hoist);
+    }
+    // the loops have been freed with LoopInfo, they only identify the SinkInfo
+    for (auto &[L, Sink] : Sinks) {
+      sinkChecks(Sink);
+      NumChecksSunk += Sink.Checks.size();
+    }
+    NumChecksHoisted += Hoists.size();
+    LLVM_DEBUG(dbgs() << "[eddi-loop-checks] " << Fn.getName() << ": hoisted "
+                      << Hoists.size() << ", sunk "
+                      << MovedChecks.size() - Hoists.size() << " checks\n");
+
+    removeConsistencyChecks(Fn, MovedChecks);
+    Changed = true;
+  }
+
+  return Changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+}
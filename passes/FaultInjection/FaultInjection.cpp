@@ -0,0 +1,294 @@
+/**
+ * ************************************************************************************************
+ * @brief  LLVM pass instrumenting a (hardened) module for software fault
+ *         injection campaigns (see testing/fault_injection.py).
+ *
+ *         Every injection site, i.e. an SSA value, the address of a load or
+ *         a store, or the condition of a branch, is routed through the runtime
+ *         function aspis_fi_inject(site, value) (FaultInjection/runtime.c),
+ *         which flips a single bit of the value when the site is the one
+ *         selected at runtime with the ASPIS_FI_* environment variables. The
+ *         sites are listed in a CSV file, and the ASPIS fault handlers report
+ *         the detections to the runtime through aspis_fi_detected(kind).
+ * ************************************************************************************************
+*/
+#include "../ASPIS.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+#include "../Utils/Utils.h"
+#include <fstream>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "aspis_fault_injection"
+
+STATISTIC(NumValueSites, "Number of SSA values that can be corrupted");
+STATISTIC(NumAddressSites, "Number of load/store addresses that can be corrupted");
+STATISTIC(NumBranchSites, "Number of branch conditions that can be corrupted");
+
+static cl::bits<FISiteKind> FISiteKinds(
+    "fi-sites",
+    cl::desc("Kinds of fault injection sites (default: all)"),
+    cl::CommaSeparated,
+    cl::values(clEnumValN(FIValue, "value", "Results of the instructions"),
+               clEnumValN(FIAddress, "address",
+                          "Addresses of the loads and stores"),
+               clEnumValN(FIBranch, "branch",
+                          "Conditions of the branches and switches")));
+
+static cl::opt<std::string> FISitesFile(
+    "fi-sites-file",
+    cl::desc("CSV file listing the fault injection sites"),
+    cl::init("fault_injection_sites.csv"));
+
+// codes passed to aspis_fi_detected(), see FaultInjection/runtime.c
+enum FIDetection { FIDataCorruption = 1, FISigMismatch = 2 };
+
+static bool isSiteKindEnabled(FISiteKind Kind) {
+  return FISiteKinds.getBits() == 0 || FISiteKinds.isSet(Kind);
+}
+
+static const char *getSiteKindName(FISiteKind Kind) {
+  switch (Kind) {
+  case FIValue: return "value";
+  case FIAddress: return "address";
+  case FIBranch: return "branch";
+  }
+  return "";
+}
+
+/**
+ * @returns the number of bits of V that can be corrupted, 0 if V has an
+ * unsupported type (e.g. vectors or integers wider than 64 bits)
+ */
+static unsigned getInjectableBits(Value *V, const DataLayout &DL) {
+  Type *Ty = V->getType();
+  if (Ty->isPointerTy()) {
+    return DL.getPointerSizeInBits(Ty->getPointerAddressSpace());
+  }
+  if (Ty->isIntegerTy() || Ty->isFloatingPointTy()) {
+    unsigned Bits = Ty->getPrimitiveSizeInBits().getFixedValue();
+    return Bits <= 64 ? Bits : 0;
+  }
+  return 0;
+}
+
+/**
+ * Emits the call to aspis_fi_inject() for V before the insertion point of B.
+ * @param Head set to the first emitted instruction, i.e. the one using V
+ * @returns the value of the type of V that must replace V
+ */
+Value *FaultInjection::createInjection(IRBuilder<> &B, Value *V, uint32_t Site,
+                                       Instruction *&Head) {
+  Type *Ty = V->getType();
+  Type *Int64Ty = B.getInt64Ty();
+  Value *Raw = V;
+  Head = nullptr;
+  auto track = [&Head](Value *I) {
+    if (Head == nullptr && isa<Instruction>(I)) {
+      Head = cast<Instruction>(I);
+    }
+    return I;
+  };
+
+  if (Ty->isPointerTy()) {
+    Raw = track(B.CreatePtrToInt(Raw, Int64Ty));
+  } else {
+    if (Ty->isFloatingPointTy()) {
+      Raw = track(B.CreateBitCast(
+          Raw, B.getIntNTy(Ty->getPrimitiveSizeInBits().getFixedValue())));
+    }
+    if (Raw->getType() != Int64Ty) {
+      Raw = track(B.CreateZExt(Raw, Int64Ty));
+    }
+  }
+  Value *Res = track(B.CreateCall(InjectFn, {B.getInt32(Site), Raw}));
+
+  if (Ty->isPointerTy()) {
+    return B.CreateIntToPtr(Res, Ty);
+  }
+  if (Ty->isFloatingPointTy()) {
+    Res = B.CreateTrunc(Res, B.getIntNTy(Ty->getPrimitiveSizeInBits().getFixedValue()));
+    return B.CreateBitCast(Res, Ty);
+  }
+  return Ty == Int64Ty ? Res : B.CreateTrunc(Res, Ty);
+}
+
+void FaultInjection::addSite(Instruction &I, Value &V, FISiteKind Kind, unsigned Bits) {
+  std::string Loc;
+  if (const DebugLoc &DL = I.getDebugLoc()) {
+    Loc = DL->getFilename().str() + ":" + std::to_string(DL.getLine());
+  }
+  std::string TypeName;
+  raw_string_ostream TypeOS(TypeName);
+  V.getType()->print(TypeOS);
+  Sites.push_back({Kind, I.getFunction()->getName().str(), Bits, Loc,
+                   V.getName().str(), TypeOS.str()});
+}
+
+/**
+ * Corrupts the result of I. The uses of I are redirected to the value returned
+ * by aspis_fi_inject(), which is emitted right after I.
+ */
+void FaultInjection::injectValue(Instruction &I, const DataLayout &DL) {
+  unsigned Bits = getInjectableBits(&I, DL);
+  if (Bits == 0 || I.isTerminator() || I.isEHPad() || isa<AllocaInst>(I)) {
+    return;
+  }
+  if (auto *CI = dyn_cast<CallInst>(&I)) {
+    if (CI->isMustTailCall()) return;
+  }
+
+  BasicBlock::iterator InsertPt = isa<PHINode>(I)
+                                      ? I.getParent()->getFirstInsertionPt()
+                                      : std::next(I.getIterator());
+  if (InsertPt == I.getParent()->end()) {
+    return;
+  }
+  IRBuilder<> B(I.getParent(), InsertPt);
+  B.SetCurrentDebugLocation(I.getDebugLoc());
+  Instruction *Head;
+  Value *Corrupted = createInjection(B, &I, Sites.size(), Head);
+  I.replaceUsesWithIf(Corrupted, [Head](Use &U) { return U.getUser() != Head; });
+  addSite(I, I, FIValue, Bits);
+  NumValueSites++;
+}
+
+/**
+ * Corrupts the operand OpIdx of I (the address of a load/store or the
+ * condition of a branch), right before I.
+ */
+void FaultInjection::injectOperand(Instruction &I, unsigned OpIdx,
+                                   FISiteKind Kind, const DataLayout &DL) {
+  Value *Op = I.getOperand(OpIdx);
+  unsigned Bits = getInjectableBits(Op, DL);
+  if (Bits == 0 || (isa<Constant>(Op) && !Op->getType()->isPointerTy())) {
+    return;
+  }
+  IRBuilder<> B(&I);
+  Instruction *Head;
+  I.setOperand(OpIdx, createInjection(B, Op, Sites.size(), Head));
+  addSite(I, *Op, Kind, Bits);
+  if (Kind == FIAddress) NumAddressSites++;
+  else NumBranchSites++;
+}
+
+/**
+ * Reports the detections to the runtime, at the entry of the ASPIS fault
+ * handlers (either the default ones or the ones defined by the program).
+ */
+void FaultInjection::instrumentHandlers(Module &Md) {
+  LLVMContext &C = Md.getContext();
+  FunctionCallee DetectedFn = Md.getOrInsertFunction(
+      "aspis_fi_detected", Type::getVoidTy(C), Type::getInt32Ty(C));
+  for (Function &Fn : Md) {
+    if (Fn.isDeclaration()) continue;
+    int Kind = 0;
+    if (Fn.getName().contains("DataCorruption_Handler")) Kind = FIDataCorruption;
+    else if (Fn.getName().contains("SigMismatch_Handler")) Kind = FISigMismatch;
+    else continue;
+    IRBuilder<> B(&*Fn.getEntryBlock().getFirstInsertionPt());
+    B.CreateCall(DetectedFn, {B.getInt32(Kind)});
+  }
+}
+
+void FaultInjection::persistSites() {
+  std::ofstream file;
+  file.open(FISitesFile);
+  file << "id,kind,fn_name,bits,location,name,type\n";
+  for (unsigned i = 0; i < Sites.size(); i++) {
+    file << i << "," << getSiteKindName(Sites[i].Kind) << ","
+         << Sites[i].FnName << "," << Sites[i].Bits << ","
+         << Sites[i].Location << "," << Sites[i].Name << ","
+         << Sites[i].Type << "\n";
+  }
+  file.close();
+}
+
+PreservedAnalyses FaultInjection::run(Module &Md, ModuleAnalysisManager &AM) {
+  LLVMContext &C = Md.getContext();
+  const DataLayout &DL = Md.getDataLayout();
+  Sites.clear();
+  InjectFn = Md.getOrInsertFunction("aspis_fi_inject", Type::getInt64Ty(C),
+                                    Type::getInt32Ty(C), Type::getInt64Ty(C));
+
+  // the instructions are collected first, so that the injection code is not
+  // instrumented in turn
+  std::vector<Instruction *> Instrs;
+  for (Function &Fn : Md) {
+    if (Fn.isDeclaration() || Fn.getName().starts_with("aspis") ||
+        Fn.getName().contains("DataCorruption_Handler") ||
+        Fn.getName().contains("SigMismatch_Handler")) {
+      continue;
+    }
+    for (Instruction &I : instructions(Fn)) {
+      if (!isa<DbgInfoIntrinsic>(I) && !I.isLifetimeStartOrEnd()) {
+        Instrs.push_back(&I);
+      }
+    }
+  }
+
+  for (Instruction *I : Instrs) {
+    if (isSiteKindEnabled(FIAddress)) {
+      if (auto *LI = dyn_cast<LoadInst>(I)) {
+        injectOperand(*I, LI->getPointerOperandIndex(), FIAddress, DL);
+      } else if (auto *SI = dyn_cast<StoreInst>(I)) {
+        injectOperand(*I, SI->getPointerOperandIndex(), FIAddress, DL);
+      }
+    }
+    if (isSiteKindEnabled(FIBranch)) {
+      if (auto *BI = dyn_cast<BranchInst>(I)) {
+        if (BI->isConditional()) injectOperand(*I, 0, FIBranch, DL);
+      } else if (isa<SwitchInst>(I)) {
+        injectOperand(*I, 0, FIBranch, DL);
+      }
+    }
+    if (isSiteKindEnabled(FIValue)) {
+      injectValue(*I, DL);
+    }
+  }
+
+  instrumentHandlers(Md);
+
+  // read by the runtime to size the profile of the executed sites
+  auto *NumSitesGV = new GlobalVariable(
+      Md, Type::getInt32Ty(C), true, GlobalValue::ExternalLinkage,
+      ConstantInt::get(Type::getInt32Ty(C), Sites.size()), "aspis_fi_num_sites");
+  NumSitesGV->setDSOLocal(true);
+
+  persistSites();
+  LLVM_DEBUG(dbgs() << "[fault-injection] " << Sites.size() << " sites\n");
+  return PreservedAnalyses::none();
+}
+
+//-----------------------------------------------------------------------------
+// New PM Registration
+//-----------------------------------------------------------------------------
+llvm::PassPluginLibraryInfo getFaultInjectionPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "aspis-fault-injection", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &FPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "aspis-fault-injection") {
+                    FPM.addPass(FaultInjection());
+                    return true;
+                  }
+                  return false;
+                });
+          }};
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+  return getFaultInjectionPluginInfo();
+}
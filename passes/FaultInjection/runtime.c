@@ -0,0 +1,74 @@
+/**
+ * ************************************************************************************************
+ * @brief  Runtime of the fault injection pass (FaultInjection.cpp), linked to
+ *         the instrumented binaries by `aspis.sh --fault-injection`.
+ *
+ *         The fault is selected with the environment variables:
+ *         - ASPIS_FI_SITE: id of the site to corrupt (see the sites CSV file);
+ *         - ASPIS_FI_BIT: bit of the value to flip;
+ *         - ASPIS_FI_OCCURRENCE: execution of the site to corrupt (default 1).
+ *         Without ASPIS_FI_SITE the program runs unmodified. When
+ *         ASPIS_FI_PROFILE is set, the number of executions of each site is
+ *         written to that file at exit.
+ *
+ *         The injection and the detections are reported on stderr, and a
+ *         detection terminates the program with a dedicated exit code.
+ * ************************************************************************************************
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define ASPIS_FI_EXIT_DATA_CORRUPTION 97
+#define ASPIS_FI_EXIT_SIG_MISMATCH 98
+
+/* emitted by the fault injection pass */
+extern const uint32_t aspis_fi_num_sites;
+
+static uint64_t fi_site = UINT64_MAX;
+static uint64_t fi_bit;
+static uint64_t fi_occurrence = 1;
+static uint64_t fi_executions;
+static uint64_t *fi_profile;
+static const char *fi_profile_file;
+
+static void aspis_fi_write_profile(void) {
+  FILE *f = fopen(fi_profile_file, "w");
+  if (f == NULL) return;
+  for (uint32_t i = 0; i < aspis_fi_num_sites; i++) {
+    if (fi_profile[i] != 0) {
+      fprintf(f, "%u,%llu\n", i, (unsigned long long)fi_profile[i]);
+    }
+  }
+  fclose(f);
+}
+
+__attribute__((constructor)) static void aspis_fi_init(void) {
+  const char *env;
+  if ((env = getenv("ASPIS_FI_SITE")) != NULL) fi_site = strtoull(env, NULL, 0);
+  if ((env = getenv("ASPIS_FI_BIT")) != NULL) fi_bit = strtoull(env, NULL, 0) % 64;
+  if ((env = getenv("ASPIS_FI_OCCURRENCE")) != NULL) fi_occurrence = strtoull(env, NULL, 0);
+  if ((fi_profile_file = getenv("ASPIS_FI_PROFILE")) != NULL) {
+    fi_profile = calloc(aspis_fi_num_sites, sizeof(uint64_t));
+    if (fi_profile != NULL) atexit(aspis_fi_write_profile);
+  }
+}
+
+uint64_t aspis_fi_inject(uint32_t site, uint64_t value) {
+  if (fi_profile != NULL) fi_profile[site]++;
+  if (site == fi_site && ++fi_executions == fi_occurrence) {
+    value ^= UINT64_C(1) << fi_bit;
+    fputs("ASPIS_FI: injected\n", stderr);
+  }
+  return value;
+}
+
+void aspis_fi_detected(uint32_t kind) {
+  if (kind == 1) {
+    fputs("ASPIS_FI: detected DataCorruption\n", stderr);
+    _exit(ASPIS_FI_EXIT_DATA_CORRUPTION);
+  }
+  fputs("ASPIS_FI: detected SigMismatch\n", stderr);
+  _exit(ASPIS_FI_EXIT_SIG_MISMATCH);
+}
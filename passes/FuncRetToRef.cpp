@@ -242,9 +242,11 @@ PreservedAnalyses FuncRetToRef::run(Module &Md, ModuleAnalysisManager &AM) {
         }
     }
 
+    HardeningLinks Links;
     for (Function *Fn : FnList) {
         Function *newFn = updateFnSignature(*Fn, Md);
         if (newFn != NULL) {
+            Links.add(*Fn, *newFn, HardeningLinks::Ret);
             updateFunctionCalls(*Fn, *newFn); 
         }
     }
@@ -74,51 +74,36 @@ void findCheckedOps(Instruction &I, std::set<Instruction*> *checkedOps, std::set
   }
 }
 
-/*
-Find the instruction associated with the metadata having name `name` and for which the operand in position `op_pos`
-is equal to the string `op_val`. If no instruction can be found, nullptr is returned.
-*/
-Instruction *FindInstructionWithMetadata(Module &Md, std::string name, int op_pos=-1, std::string op_val="") {
-  for (auto &Fn : Md) {
-    for (auto &BB : Fn) {
-      for (auto &I : BB) {
-        if (I.hasMetadata(name)) {
-          if (op_pos < 0 || op_val.empty() || dyn_cast<MDString>(I.getMetadata(name)->getOperand(op_pos).get())->getString() == op_val)
-            return &I;
-        }
-      }
-    }
+void initializeInstructionWeights(Module &Md, std::map<Value*, StringRef> *FuncAnnotations, std::map<Instruction*, double> *InstWeights) {
+  uint64_t Hash;
+  std::vector<uint64_t> Counts;
+  std::string FileName = Md.getName().str() + ".aspis.profraw";
+  if (!readProfile(FileName, Hash, Counts)) {
+    errs() << "Cannot read the profile " << FileName << "\n";
+    abort();
+  }
+  auto *HashGV = Md.getGlobalVariable("aspis_prof_hash");
+  if (HashGV == nullptr ||
+      cast<ConstantInt>(HashGV->getInitializer())->getZExtValue() != Hash) {
+    errs() << "The profile " << FileName << " does not match the module\n";
+    abort();
   }
-  return nullptr;
-}
 
-void initializeInstructionWeights(Module &Md, std::map<Value*, StringRef> *FuncAnnotations, std::map<Instruction*, double> *InstWeights) {
-  std::ifstream file(Md.getName().str() + ".aspis.bb.txt"); 
-  std::string ln;
-  while (std::getline(file, ln)) {
-    std::istringstream iss(ln);
-    std::string key;
-    int value;
-
-    // find the key and value stored in the line
-    if (iss >> key >> value) {
-      auto id = key.substr(key.rfind('.')+1);
-      // get the instruction associated with the metadata
-      Instruction *IWithMD = FindInstructionWithMetadata(Md, "aspis.bb", 0, id);
-      // if the instruction exists
-      if (IWithMD) {
-        // assign the weight to each instruction in the bb containing the instruction with metadata
-        for (auto &I : *(IWithMD->getParent())) {
-          InstWeights->insert(std::pair(&I, value));
+  // the counter id of each block is in the `aspis.bb` metadata of one of its
+  // instructions
+  for (auto &Fn : Md) {
+    for (auto &BB : Fn) {
+      for (auto &IWithMD : BB) {
+        if (auto *MD = IWithMD.getMetadata("aspis.bb")) {
+          uint64_t Id = mdconst::extract<ConstantInt>(MD->getOperand(0))->getZExtValue();
+          assert(Id < Counts.size() && "Block counter missing from the profile");
+          // assign the weight to each instruction in the bb
+          for (auto &I : BB) {
+            InstWeights->insert(std::pair(&I, Counts[Id]));
+          }
+          break;
         }
       }
-      else {
-        errs() << "aspis.bb" << " " << id << "\n";
-        assert(false && "Cannot find instructions associated with the metadata above");
-      }
-    } else {
-      std::cerr << "Malformed line: " << ln << std::endl;
-      abort();
     }
   }
 }
@@ -215,137 +200,102 @@ PreservedAnalyses ASPISCheckProfiler::run(Module &Md, ModuleAnalysisManager &AM)
   return PreservedAnalyses::all();
 }
 
-void createPrintProfileData(Module &M, std::string GVPrefix) {
-  // find the return of main
-  std::list<Instruction*> RetInstructions;
-  auto MainFn = M.getFunction("main");
-  for (BasicBlock &BB : *MainFn) {
-    if (auto *R = dyn_cast<ReturnInst>(BB.getTerminator())) {
-      RetInstructions.push_back(R);
-    }
-  }
-  assert(RetInstructions.size() == 1 && "Main has multiple return instructions!");
-
-  // get the functions for file handling
+/*
+Emits the values read by the profiler runtime (Profiling/runtime.c), which
+writes the counters at exit: their number, the hash of the profiled blocks and
+the prefix of the profile file.
+*/
+void createProfileTables(Module &M, unsigned NumCounters, uint64_t Hash) {
   LLVMContext &Ctx = M.getContext();
 
-  FunctionCallee FOpen = M.getOrInsertFunction("fopen",
-    PointerType::getUnqual(Type::getInt8Ty(Ctx)),
-    PointerType::getUnqual(Type::getInt8Ty(Ctx)),
-    PointerType::getUnqual(Type::getInt8Ty(Ctx))
-  );
-
-  FunctionCallee FPrintf = M.getOrInsertFunction("fprintf",
-    Type::getInt32Ty(Ctx),
-    PointerType::getUnqual(Type::getInt8Ty(Ctx)),
-    PointerType::getUnqual(Type::getInt8Ty(Ctx)),
-    Type::getInt32Ty(Ctx)
-  );
-
-  FunctionCallee FClose = M.getOrInsertFunction("fclose",
-    Type::getInt32Ty(Ctx),
-    PointerType::getUnqual(Type::getInt8Ty(Ctx))
-  );
-
-  IRBuilder<> Builder(RetInstructions.front());
-
-  // create fopen
-  Value *FileName = Builder.CreateGlobalStringPtr(M.getName().str() + "." + GVPrefix + ".txt");
-  Value *Mode = Builder.CreateGlobalStringPtr("w");
-  Value *FileHandle = Builder.CreateCall(FOpen, {FileName, Mode});
-
-  // print the counters
-  for (GlobalVariable &GV : M.globals()) {
-    if (GV.getName().starts_with(GVPrefix + ".counter.")) {
-      // Load counter
-      Value *Count = Builder.CreateLoad(Type::getInt32Ty(Ctx), &GV);
-
-      // Prepare fprintf format string
-      std::string FmtStr = GV.getName().str() + " %d\n";
-      Value *Fmt = Builder.CreateGlobalStringPtr(FmtStr);
-
-      // Call fprintf
-      Builder.CreateCall(FPrintf, {FileHandle, Fmt, Count});
-    }
-  }
+  new GlobalVariable(M, Type::getInt32Ty(Ctx), true, GlobalValue::ExternalLinkage,
+                     ConstantInt::get(Type::getInt32Ty(Ctx), NumCounters),
+                     "aspis_prof_num_counters");
 
-  // 6. fclose(f)
-  Builder.CreateCall(FClose, {FileHandle});
+  new GlobalVariable(M, Type::getInt64Ty(Ctx), true, GlobalValue::ExternalLinkage,
+                     ConstantInt::get(Type::getInt64Ty(Ctx), Hash),
+                     "aspis_prof_hash");
+
+  auto *Prefix = ConstantDataArray::getString(Ctx, M.getName());
+  new GlobalVariable(M, Prefix->getType(), true, GlobalValue::ExternalLinkage,
+                     Prefix, "aspis_prof_file_prefix");
 }
 
-/*  
-Create a counter to verify how many times instruction `I` is hit at runtime.
-MDName is the name of the metadata containing the ID of the instruction,
-the ID must be stored as a string in the operand 0 of the mdnode.
- */
-void createCounter(Instruction &I, std::string MDName) {
-  Module *Md = I.getParent()->getParent()->getParent();
-  std::string VarName = "";
-  if (MDNode *MD = I.getMetadata(MDName)) {
-    if (MD->getNumOperands() > 0) {
-      if (auto *MDS = dyn_cast<MDString>(MD->getOperand(0))) {
-          VarName = MDName + ".counter." + MDS->getString().str();
-      }
-    }
-  }
-  // create a global variable to store the counter
-  GlobalVariable *GV = Md->getGlobalVariable(VarName);
-  if (!GV) {
-    GV = new GlobalVariable(
-      *Md,
-      Type::getInt32Ty(Md->getContext()), // int32
-      false,                 // isConstant
-      GlobalValue::ExternalLinkage,
-      ConstantInt::get(Type::getInt32Ty(Md->getContext()), 0), // initializer
-      VarName
-    );
-  }
-  
-  // update the counter before I
+/*
+Returns the counters of the running thread, retrieved once at the entry of Fn
+(after the allocas). Each thread has its own array of 64 bit counters, so that
+the increments are plain loads and stores that do not race nor share cache
+lines with the other threads.
+*/
+Value *createThreadCounters(Function &Fn) {
+  Module *Md = Fn.getParent();
+  FunctionCallee GetCounters = Md->getOrInsertFunction(
+    "aspis_prof_thread_counters", PointerType::getUnqual(Md->getContext()));
+  IRBuilder<> B(&*Fn.getEntryBlock().getFirstNonPHIOrDbgOrAlloca());
+  return B.CreateCall(GetCounters);
+}
+
+/*
+Increments the counter Id of the running thread before I.
+*/
+void createCounter(Instruction &I, Value *Counters, unsigned Id) {
   IRBuilder<> B(&I);
-  auto GVInstr = B.CreateLoad(Type::getInt32Ty(Md->getContext()), GV);
-  auto NewVal = B.CreateAdd(GVInstr, ConstantInt::get(Type::getInt32Ty(Md->getContext()), 1));
-  B.CreateStore(NewVal, GV);
+  auto *I64 = B.getInt64Ty();
+  Value *Ptr = B.CreateConstInBoundsGEP1_32(I64, Counters, Id);
+  Value *Count = B.CreateLoad(I64, Ptr);
+  B.CreateStore(B.CreateAdd(Count, B.getInt64(1)), Ptr);
 }
 
-int bb_id = 0;
 PreservedAnalyses ASPISInsertCheckProfiler::run(Module &Md, ModuleAnalysisManager &AM) {
-  std::list<Instruction*> SyncPts;
-  std::list<Instruction*> BBs;
-
-  std::set<Instruction*> CheckedData;
-
-  int tot_instructions = 0;
-
   getFuncAnnotations(Md, FuncAnnotations);
-  for (auto &Fn : Md) {
-    if (shouldCompile(Fn, FuncAnnotations)) {
-      for (auto &BB : Fn) {
-        (*BB.getFirstInsertionPt()).setMetadata("aspis.bb", MDNode::get(BB.getContext(), MDString::get(BB.getContext(), std::to_string(bb_id))));
-        BBs.push_back(&*BB.getFirstInsertionPt());
-        bb_id++;
-        for (auto &I : BB) {
-          tot_instructions++;
-          if (I.hasMetadata("aspis.syncpt")) {            
-            SyncPts.push_back(&I);
-          }
-        }
+
+  // the counter ids are dense: the blocks come first, in the order of
+  // enumerateProfileBlocks (so that a profile can be matched with the same
+  // code compiled again, see loadBlockProfile), then the sync points
+  std::vector<BasicBlock*> BBs;
+  uint64_t Hash = enumerateProfileBlocks(Md, FuncAnnotations, BBs);
+  std::list<Instruction*> SyncPts;
+  for (auto *BB : BBs) {
+    for (auto &I : *BB) {
+      if (I.hasMetadata("aspis.syncpt")) {
+        SyncPts.push_back(&I);
       }
     }
   }
-  for (auto SyncPt : SyncPts) {
-    createCounter(*SyncPt, "aspis.syncpt");
+
+  // counters of the running thread in each function
+  std::map<Function*, Value*> Counters;
+  auto getCounters = [&Counters](Function &Fn) {
+    auto It = Counters.find(&Fn);
+    if (It == Counters.end()) {
+      It = Counters.insert({&Fn, createThreadCounters(Fn)}).first;
+    }
+    return It->second;
+  };
+
+  unsigned Id = 0;
+  auto *I64 = Type::getInt64Ty(Md.getContext());
+  for (auto *BB : BBs) {
+    Value *FnCounters = getCounters(*BB->getParent());
+    (*BB->getFirstInsertionPt()).setMetadata("aspis.bb", MDNode::get(BB->getContext(), ConstantAsMetadata::get(ConstantInt::get(I64, Id))));
+    // the counter of the entry block follows the retrieval of the counters
+    Instruction *InsertPt = BB->isEntryBlock()
+                                ? cast<Instruction>(FnCounters)->getNextNode()
+                                : &*BB->getFirstInsertionPt();
+    createCounter(*InsertPt, FnCounters, Id++);
   }
-  for (auto BB : BBs) {
-    createCounter(*BB, "aspis.bb");
+  for (auto *SyncPt : SyncPts) {
+    createCounter(*SyncPt, getCounters(*SyncPt->getFunction()), Id++);
   }
-  
-  createPrintProfileData(Md, "aspis.syncpt");
-  createPrintProfileData(Md, "aspis.bb");
+
+  createProfileTables(Md, Id, Hash);
 
   return PreservedAnalyses::none();
 }
 
+PreservedAnalyses ASPISLoadProfile::run(Module &Md, ModuleAnalysisManager &AM) {
+  return loadBlockProfile(Md) ? PreservedAnalyses::none() : PreservedAnalyses::all();
+}
 
 //-----------------------------------------------------------------------------
 // New PM Registration
@@ -371,6 +321,15 @@ llvm::PassPluginLibraryInfo getASPISCheckProfilerPluginInfo() {
                   }
                   return false;
                 });
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &FPM,
+                    ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "aspis-load-profile") {
+                    FPM.addPass(ASPISLoadProfile());
+                    return true;
+                  }
+                  return false;
+                });
           }};
 }
 
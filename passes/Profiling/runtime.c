@@ -0,0 +1,145 @@
+/**
+ * ************************************************************************************************
+ * @brief  Runtime of the counters inserted by aspis-insert-check-profile
+ *         (ASPISCheckProfiler.cpp), linked to the profiled binaries by
+ *         aspis.sh.
+ *
+ *         Each thread increments its own array of 64 bit counters, allocated
+ *         on its first call to aspis_prof_thread_counters() and aligned to
+ *         the cache lines, so that the increments do not need atomics and the
+ *         threads do not false-share. The counters of a thread are added to
+ *         the totals when it exits, and the totals (with the counters of the
+ *         threads still running) are written at the exit of the program to
+ *         <module>.aspis.profraw: a header (see struct aspis_prof_header)
+ *         followed by the 64 bit count of each counter id, in the byte order
+ *         of the host. The analysis passes map the ids back to the blocks
+ *         (see readProfile in Utils.cpp).
+ * ************************************************************************************************
+*/
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ASPIS_PROF_CACHE_LINE 64
+
+#define ASPIS_PROF_VERSION 1
+
+/* emitted by the profiler pass */
+extern const uint32_t aspis_prof_num_counters;
+extern const uint64_t aspis_prof_hash;
+extern const char aspis_prof_file_prefix[];
+
+struct aspis_prof_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_counters;
+  /* hash of the profiled blocks, to match the profile with the code */
+  uint64_t hash;
+};
+
+struct aspis_prof_thread {
+  uint64_t *counters;
+  struct aspis_prof_thread *prev, *next;
+};
+
+static __thread uint64_t *prof_tls_counters __attribute__((tls_model("initial-exec")));
+
+static pthread_once_t prof_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t prof_key;
+static uint64_t *prof_totals;
+/* threads that did not exit yet */
+static struct aspis_prof_thread *prof_threads;
+
+static void aspis_prof_merge(const uint64_t *counters) {
+  for (uint32_t i = 0; i < aspis_prof_num_counters; i++) {
+    prof_totals[i] += counters[i];
+  }
+}
+
+static void aspis_prof_thread_exit(void *data) {
+  struct aspis_prof_thread *t = data;
+  pthread_mutex_lock(&prof_lock);
+  aspis_prof_merge(t->counters);
+  if (t->prev != NULL) t->prev->next = t->next;
+  else prof_threads = t->next;
+  if (t->next != NULL) t->next->prev = t->prev;
+  pthread_mutex_unlock(&prof_lock);
+  /* a profiled function run later by this thread (e.g. by another TLS
+     destructor) allocates new counters instead of writing to the freed ones */
+  prof_tls_counters = NULL;
+  free(t->counters);
+  free(t);
+}
+
+static void aspis_prof_write(const uint64_t *counts) {
+  char file_name[4096];
+  snprintf(file_name, sizeof(file_name), "%s.aspis.profraw", aspis_prof_file_prefix);
+  FILE *f = fopen(file_name, "wb");
+  if (f == NULL) return;
+  struct aspis_prof_header header = {
+    .magic = {'A', 'S', 'P', 'I', 'S', 'P', 'R', 'F'},
+    .version = ASPIS_PROF_VERSION,
+    .num_counters = aspis_prof_num_counters,
+    .hash = aspis_prof_hash,
+  };
+  fwrite(&header, sizeof(header), 1, f);
+  fwrite(counts, sizeof(uint64_t), aspis_prof_num_counters, f);
+  fclose(f);
+}
+
+static void aspis_prof_exit(void) {
+  pthread_mutex_lock(&prof_lock);
+  uint64_t *counts = calloc(aspis_prof_num_counters, sizeof(uint64_t));
+  if (counts != NULL) {
+    memcpy(counts, prof_totals, aspis_prof_num_counters * sizeof(uint64_t));
+    for (struct aspis_prof_thread *t = prof_threads; t != NULL; t = t->next) {
+      for (uint32_t i = 0; i < aspis_prof_num_counters; i++) {
+        counts[i] += t->counters[i];
+      }
+    }
+    aspis_prof_write(counts);
+    free(counts);
+  }
+  pthread_mutex_unlock(&prof_lock);
+}
+
+static void aspis_prof_init(void) {
+  prof_totals = calloc(aspis_prof_num_counters, sizeof(uint64_t));
+  pthread_key_create(&prof_key, aspis_prof_thread_exit);
+  atexit(aspis_prof_exit);
+}
+
+static uint64_t *aspis_prof_thread_init(void) {
+  pthread_once(&prof_once, aspis_prof_init);
+  size_t size = (aspis_prof_num_counters * sizeof(uint64_t) + ASPIS_PROF_CACHE_LINE - 1) &
+                ~(size_t)(ASPIS_PROF_CACHE_LINE - 1);
+  struct aspis_prof_thread *t = malloc(sizeof(*t));
+  uint64_t *counters = aligned_alloc(ASPIS_PROF_CACHE_LINE, size ? size : ASPIS_PROF_CACHE_LINE);
+  if (t == NULL || counters == NULL || prof_totals == NULL) {
+    fputs("ASPIS profiler: out of memory\n", stderr);
+    abort();
+  }
+  memset(counters, 0, size);
+  t->counters = counters;
+  t->prev = NULL;
+  pthread_mutex_lock(&prof_lock);
+  t->next = prof_threads;
+  if (prof_threads != NULL) prof_threads->prev = t;
+  prof_threads = t;
+  pthread_mutex_unlock(&prof_lock);
+  pthread_setspecific(prof_key, t);
+  prof_tls_counters = counters;
+  return counters;
+}
+
+/* called at the entry of every profiled function */
+uint64_t *aspis_prof_thread_counters(void) {
+  uint64_t *counters = prof_tls_counters;
+  if (__builtin_expect(counters == NULL, 0)) {
+    counters = aspis_prof_thread_init();
+  }
+  return counters;
+}
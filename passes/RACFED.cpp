@@ -44,73 +44,44 @@
 
 #include "ASPIS.h"
 #include "Utils/Utils.h"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/Passes/PassBuilder.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 
-#include <random>
 #include <stdlib.h>
 
 #define OPTIONAL_DEBUG false
 
 using namespace llvm;
 
+#define DEBUG_TYPE "racfed"
 
-#define DISTR_START 1
-#define DISTR_END 0x7fffffff
-/// Uniform distribution for 32 bits numbers.
-///
-/// In each function using this distribution a different seed will be used.
-/// Seeds are chosen to be constant for reproducibility.
+STATISTIC(NumBatchedUpdates, "Number of RACFED intra-block signature updates kept in registers");
+STATISTIC(NumMemoryUpdates, "Number of RACFED intra-block signature updates loaded from and stored to memory");
+
+
+static cl::opt<bool> RACFEDBatchUpdates(
+    "racfed-batch-updates",
+    cl::desc("Keep the running signature of each block in a register, "
+             "writing it back to runtime_sig only before calls and at the "
+             "end of the block"),
+    cl::init(false));
+
+/// Range of the random values, drawn with a SignatureGenerator so that they
+/// are reproducible (see -aspis-seed).
 ///
 /// The range doesn't encapsulate the complete representation of 32 bits unsigned,
 /// this was a design choice since multiple 32 bits are sum between each
 /// other throughout the algorithm thus no overflow should occur when summing.
-std::uniform_int_distribution<uint32_t> dist32(DISTR_START, DISTR_END);
+#define DISTR_START 1
+#define DISTR_END 0x7fffffff
 
 // -------- INITIALIZE BLOCKS SIGNATURES --------
 
-/**
- * Checks whether the compile time signature is unique.
- *
- * @param bb_num 	 compile time signature of the current analysed basic block.
- * @param compileTimeSig already assigned compile time signatures
- */
-bool isNotUniqueCompileTimeSig(
-  const uint32_t bb_num,
-  const std::unordered_map<BasicBlock*, uint32_t> &compileTimeSig
-) {
-  for (const auto &[_, other_bb_id] : compileTimeSig) {
-    if ( other_bb_id == bb_num ) return true;
-  }
-  return false;
-}
-
-/**
- * Checks whether the compile time signature (already unique) 
- * + second unique identifier (subRanPrevVal).
- * 
- * @param current_id     compileTimeSignature + subRanPrevVal for the 
- * current basic block.
- * @param compileTimeSig already assigned compile time signatures.
- * @param subRanPrevVals already assigned subRanPrevVals.
- */
-bool isNotUnique(
-  const uint32_t current_id,
-  const std::unordered_map<BasicBlock*, uint32_t> &compileTimeSig,
-  const std::unordered_map<BasicBlock*, uint32_t> &subRanPrevVals
-) {
-  for (const auto &[other_bb, other_bb_num] : compileTimeSig) {
-    uint32_t other_id = static_cast<uint32_t>(other_bb_num) + subRanPrevVals.at(other_bb);
-    if ( other_id == current_id ) {
-      return true;
-    }
-  }
-
-  return false;
-}
-
 /*
  * initializeBlocksSignatures
  *  1:for all Basic Block (BB) in CFG do
@@ -120,22 +91,25 @@ bool isNotUnique(
  *  5: until (compileTimeSig + subRanPrevVal) is unique
  */
 void RACFED::initializeBlocksSignatures(Function &Fn) {
-  std::random_device rd;
-  std::mt19937 rng(rd()); 
+  SignatureGenerator rng(Fn, "racfed.sig");
   uint32_t randomBB;
   uint32_t randomSub;
 
+  // the signatures are only looked up for the blocks of the function being
+  // compiled, while their uniqueness is enforced on the whole module
+  compileTimeSig.clear();
+  subRanPrevVals.clear();
+  sumIntraInstruction.clear();
+
   for (BasicBlock &BB : Fn) {
     do {
-      randomBB = dist32(rng);
-    } while ( isNotUniqueCompileTimeSig(randomBB, compileTimeSig) );
+      randomBB = rng.next(DISTR_START, DISTR_END);
+    } while ( !usedCompileTimeSigs.insert(randomBB).second );
 
+    // the sum wraps around as a 32 bits unsigned
     do {
-      randomSub = dist32(rng);
-    } while ( isNotUnique(
-      randomBB + randomSub,
-      compileTimeSig,
-      subRanPrevVals) );
+      randomSub = rng.next(DISTR_START, DISTR_END);
+    } while ( !usedSigSums.insert(randomBB + randomSub).second );
 
     compileTimeSig.insert(std::pair(&BB, randomBB));
     subRanPrevVals.insert(std::pair(&BB, randomSub));
@@ -162,12 +136,15 @@ void originalInstruction(BasicBlock &BB, std::vector<Instruction*> &OrigInstruct
  *  7:   if NrInstrBB > 2 then
  *  8:    for all original instructions insert after
  *  9:      signature ← signature + random number
+ *
+ * With -racfed-batch-updates the signature is loaded once, updated in a
+ * register after each instruction, and stored back before the calls and at
+ * the end of the block.
  */
 void RACFED::insertIntraInstructionUpdates(Function &Fn,
 				    GlobalVariable *RuntimeSigGV, 
 				    Type *IntType) {
-  std::random_device rd;
-  std::mt19937 rng(rd()); 
+  SignatureGenerator rng(Fn, "racfed.intra");
 
   // 6: for all BB in CFG do
   for (auto &BB: Fn){
@@ -178,9 +155,13 @@ void RACFED::insertIntraInstructionUpdates(Function &Fn,
     if ( OrigInstructions.size() <= 2 ) continue;
 
     uint64_t partial_sum = 0;
+    // batched updates: running signature of the block, null if it has to be
+    // loaded from the global
+    Value *RunningSig = nullptr;
 
     // 8: for all original instructions insert after
-    for (Instruction *I : OrigInstructions) {
+    for (unsigned i = 0; i < OrigInstructions.size(); i++) {
+      Instruction *I = OrigInstructions[i];
       Instruction *InsertPt = nullptr;
 
       if ( I->isTerminator() ) {
@@ -192,12 +173,34 @@ void RACFED::insertIntraInstructionUpdates(Function &Fn,
       IRBuilder<> InstrIR(InsertPt);
 
       // 9: signature ← signature + random number
-      uint64_t K = dist32(rng);
+      uint64_t K = rng.next(DISTR_START, DISTR_END);
       partial_sum += K;
 
+      if (RACFEDBatchUpdates) {
+        if (RunningSig == nullptr) {
+          RunningSig = InstrIR.CreateLoad(IntType, RuntimeSigGV);
+        }
+        // the barrier keeps the additions from being folded into one, which
+        // would not detect the jumps in the middle of the block
+        RunningSig = createOpaqueCopy(
+            InstrIR, InstrIR.CreateAdd(RunningSig, ConstantInt::get(IntType, K),
+                                       "sig_add"));
+        // the callee saves and restores the global signature
+        bool BeforeCall = i + 1 < OrigInstructions.size() &&
+                          isa<CallBase>(OrigInstructions[i + 1]) &&
+                          !isa<IntrinsicInst>(OrigInstructions[i + 1]);
+        if (BeforeCall || i + 1 == OrigInstructions.size()) {
+          InstrIR.CreateStore(RunningSig, RuntimeSigGV);
+          RunningSig = nullptr;
+        }
+        NumBatchedUpdates++;
+        continue;
+      }
+
       Value *Sig = InstrIR.CreateLoad(IntType, RuntimeSigGV);
       Value *NewSig = InstrIR.CreateAdd(Sig, ConstantInt::get(IntType, K), "sig_add");
       InstrIR.CreateStore(NewSig, RuntimeSigGV);
+      NumMemoryUpdates++;
     }
     // Track total sum
     sumIntraInstruction[&BB] = partial_sum;
@@ -274,11 +277,17 @@ void RACFED::checkJumpSignature(BasicBlock &BB,
 
     // 12: if signature != compileTimeSig error()
     // add instructions for checking the runtime signature
-    Value *CmpVal = BChecker.CreateCmp(
-      llvm::CmpInst::ICMP_EQ, RuntimeSignatureVal,
-      llvm::ConstantInt::get(IntType, compileTimeSigCurrBB)
-    );
-    BChecker.CreateCondBr(CmpVal, &BB, &ErrBB);
+    // (not for the hot blocks whose check does not fit -aspis-overhead-budget:
+    // the signature is still updated, so the error is caught later)
+    if ( getProfileCount(BB) < HotThreshold ) {
+      Value *CmpVal = BChecker.CreateCmp(
+        llvm::CmpInst::ICMP_EQ, RuntimeSignatureVal,
+        llvm::ConstantInt::get(IntType, compileTimeSigCurrBB)
+      );
+      BChecker.CreateCondBr(CmpVal, &BB, &ErrBB);
+    } else {
+      BChecker.CreateBr(&BB);
+    }
 
     // Map NewBB to the same signature requirements as BB so predecessors can
     // target it correctly
@@ -297,8 +306,6 @@ Value *RACFED::getCondition(Instruction &I) {
       return cast<BranchInst>(I).getCondition();
     }
   } else if ( isa<SwitchInst>(I) ) {
-    errs() << "There is a switch!\n";
-    abort();
     return cast<SwitchInst>(I).getCondition();
   } else {
     assert(false && "Tried to get a condition on a function that is not a "
@@ -347,7 +354,8 @@ void RACFED::updateBeforeJump(Module &Md, BasicBlock &BB,  GlobalVariable *Runti
   IRBuilder<> B(&BB);
   B.SetInsertPoint(Term);
   auto *BI = dyn_cast<BranchInst>(Term);
-  if ( !BI ) return;
+  auto *SI = dyn_cast<SwitchInst>(Term);
+  if ( !BI && !SI ) return;
 
 
   // Calculate Source Static Signature: CT_BB + SumIntra
@@ -359,6 +367,26 @@ void RACFED::updateBeforeJump(Module &Md, BasicBlock &BB,  GlobalVariable *Runti
   printSig(Md, B, Current, "current");
   #endif
 
+  // switch: the adjustment is selected like the successor, through a
+  // constant table for the dense switches
+  if ( SI ) {
+    std::map<BasicBlock*, Constant*> AdjVals;
+    for ( BasicBlock *Succ : successors(&BB) ) {
+      uint64_t expected =
+          static_cast<uint64_t>(compileTimeSig[Succ] + subRanPrevVals[Succ]);
+      long int adj = expected - SourceStatic;
+      AdjVals[Succ] = ConstantInt::get(IntType, adj);
+    }
+    Value *Adj = createSwitchLookup(B, *SI, AdjVals);
+    Value *NewSig = B.CreateAdd(Current, Adj, "racfed_newsig");
+    B.CreateStore(NewSig, RuntimeSigGV);
+    #if OPTIONAL_DEBUG
+    printSig(Md, B, NewSig, "SIG after switch");
+    #endif
+
+    return;
+  }
+
   //define if conditional or unconditional branch
   //Conditional: expected= CT_succ+subRan_succ
   //adj = CTB-exp--> new signature = RT -adj
@@ -420,14 +448,7 @@ void RACFED::updateBeforeJump(Module &Md, BasicBlock &BB,  GlobalVariable *Runti
 Instruction *RACFED::checkOnReturn(BasicBlock &BB,
 			      GlobalVariable *RuntimeSigGV, 
 			      Type* IntType, BasicBlock &ErrBB,
-			      Value *BckupRunSig) {
-
-  // Uniform distribution for 64 bits numbers.
-  std::uniform_int_distribution<uint64_t> dist64(DISTR_START, DISTR_END);
-  // Constant seed for 64 bits.
-  // Fixed for reproducibility.
-  std::random_device rd;
-  std::mt19937 rng64(rd()); 
+			      Value *BckupRunSig, SignatureGenerator &RetRNG) {
 
   Instruction *Term = BB.getTerminator();
 
@@ -467,7 +488,7 @@ Instruction *RACFED::checkOnReturn(BasicBlock &BB,
   // Inserting instructions into ControlBB
   IRBuilder<> ControlIR(ControlBB);
   // 16:     returnVal ← random number
-  uint64_t random_ret_value = dist64(rng64);
+  uint64_t random_ret_value = RetRNG.next(DISTR_START, DISTR_END);
   // 17:     adjustValue ← (compileTimeSigBB + Sum) -
   // 18:                 returnVal
   //
@@ -491,6 +512,8 @@ Instruction *RACFED::checkOnReturn(BasicBlock &BB,
 }
 
 PreservedAnalyses RACFED::run(Module &Md, ModuleAnalysisManager &AM) {
+  usedCompileTimeSigs.clear();
+  usedSigSums.clear();
   createFtFuncs(Md);
   getFuncAnnotations(Md, FuncAnnotations);
   LinkageMap linkageMap = mapFunctionLinkageNames((Md));
@@ -512,16 +535,29 @@ PreservedAnalyses RACFED::run(Module &Md, ModuleAnalysisManager &AM) {
       }
     }
 
+    // common linkage, so that the translation units hardened separately
+    // share the same signature once linked
     if (!initialized_runtimesig)
       RuntimeSig = new GlobalVariable(
         Md, I64,
         /*isConstant=*/false,
-        GlobalValue::ExternalLinkage,
+        GlobalValue::CommonLinkage,
         ConstantInt::get(I64, 0),
         "runtime_sig"
       );
   }
 
+  // the comparison and the branch checking each block, to apply
+  // -aspis-overhead-budget
+  std::vector<std::pair<uint64_t, uint64_t>> ChecksCosts;
+  for (Function &Fn: Md) {
+    if (!shouldCompile(Fn, FuncAnnotations)) continue;
+    for (BasicBlock &BB : Fn) {
+      if ( !BB.isEntryBlock() ) ChecksCosts.push_back({getProfileCount(BB), 2});
+    }
+  }
+  HotThreshold = getHotBlockThreshold(Md, ChecksCosts);
+
   for (Function &Fn: Md) {
     if (!shouldCompile(Fn, FuncAnnotations)) continue;
 
@@ -563,6 +599,8 @@ PreservedAnalyses RACFED::run(Module &Md, ModuleAnalysisManager &AM) {
     // Initialize return instruction: used to reinstate 
     // the runtime signature of the callee
     Instruction *ret_inst = nullptr;
+    // Return values of the blocks ending with a return
+    SignatureGenerator RetRNG(Fn, "racfed.ret");
 
     for (BasicBlock &BB : Fn) {
       // Backup of compile time sign when entering a function
@@ -579,7 +617,7 @@ PreservedAnalyses RACFED::run(Module &Md, ModuleAnalysisManager &AM) {
       }
 
       checkJumpSignature(BB, RuntimeSig, I64, *ErrBB);
-      ret_inst = checkOnReturn(BB, RuntimeSig, I64, *ErrBB, runtime_sign_bkup);
+      ret_inst = checkOnReturn(BB, RuntimeSig, I64, *ErrBB, runtime_sign_bkup, RetRNG);
       updateBeforeJump(Md, BB, RuntimeSig, I64);
 
       // Restore signature on return
@@ -598,9 +636,7 @@ PreservedAnalyses RACFED::run(Module &Md, ModuleAnalysisManager &AM) {
   return PreservedAnalyses::none();
 }
 
-extern "C" ::llvm::PassPluginLibraryInfo LLVM_ATTRIBUTE_WEAK
-
-llvmGetPassPluginInfo() {
+llvm::PassPluginLibraryInfo getRACFEDPluginInfo() {
   return {LLVM_PLUGIN_API_VERSION, "RACFED", "v0.1", [](PassBuilder &PB) {
             PB.registerPipelineParsingCallback(
                 [](StringRef Name, ModulePassManager &MPM,
@@ -614,3 +650,7 @@ llvmGetPassPluginInfo() {
           }};
 }
 
+extern "C" ::llvm::PassPluginLibraryInfo LLVM_ATTRIBUTE_WEAK
+llvmGetPassPluginInfo() {
+  return getRACFEDPluginInfo();
+}
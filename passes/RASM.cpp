@@ -7,14 +7,18 @@
  * ************************************************************************************************
 */
 #include "ASPIS.h"
+#include "llvm/ADT/SetVector.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/Attributes.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Metadata.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
 #include "Utils/Utils.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
@@ -24,22 +28,66 @@ using namespace llvm;
 
 #define DEBUG_TYPE "rasm-verify"
 
+STATISTIC(NumSigSlots, "Number of RASM signatures kept in volatile stack slots");
+STATISTIC(NumSigsPromoted, "Number of RASM signatures promoted to SSA values");
+
 /**
+ * Default value of the inter-function control-flow checking (see the RASM and
+ * INTER_RASM libraries), can be overridden with the RASM constructor.
  * - 0: Disabled
  * - 1: Enabled
 */
-// #define INTER_FUNCTION_CFC 1
+#ifndef INTER_FUNCTION_CFC
+#define INTER_FUNCTION_CFC 0
+#endif
 #define INIT_SIGNATURE -0xDEAD // The same value has to be used as initializer for the signatures in the code
 
+enum class SigStorage { Memory, Register };
+static cl::opt<SigStorage> RASMSigStorage(
+    "rasm-sig-storage",
+    cl::desc("Where intra-function RASM keeps the runtime signatures"),
+    cl::values(clEnumValN(SigStorage::Memory, "memory",
+                          "volatile stack slots (default)"),
+               clEnumValN(SigStorage::Register, "register",
+                          "SSA values threaded through PHIs")),
+    cl::init(SigStorage::Memory));
+
+enum class SigBarrier { None, Asm, FakeUse };
+static cl::opt<SigBarrier> RASMSigBarrier(
+    "rasm-sig-barrier",
+    cl::desc("Barrier applied to the signature updates with "
+             "-rasm-sig-storage=register"),
+    cl::values(clEnumValN(SigBarrier::Asm, "asm",
+                          "opaque inline asm, the optimizer cannot fold the "
+                          "signatures (default)"),
+               clEnumValN(SigBarrier::FakeUse, "fake-use",
+                          "llvm.fake.use, only keeps the signatures alive"),
+               clEnumValN(SigBarrier::None, "none", "no barrier")),
+    cl::init(SigBarrier::Asm));
+
+/**
+ * The signatures are even and the SubRanPrevVals odd, so that the values of
+ * the signature at the entry of a block (signature + SubRanPrevVal) never
+ * match a signature. Both are unique in the module, and small enough to never
+ * overflow when summed and subtracted.
+ */
 void RASM::initializeBlocksSignatures(Module &Md, std::map<BasicBlock*, int> &RandomNumberBBs, std::map<BasicBlock*, int> &SubRanPrevVals) {
-    int i = 0;
+    std::unordered_set<int> UsedSigs;
+    std::unordered_set<int> UsedEntrySigs;
     for (Function &Fn : Md) {
         if (shouldCompile(Fn, FuncAnnotations)) {
+            SignatureGenerator RNG(Fn, "rasm.sig");
             for (BasicBlock &BB : Fn) {
                 if (!BB.getName().equals_insensitive("errbb")) {
-                    RandomNumberBBs.insert(std::pair<BasicBlock*, int>(&BB, i));
-                    SubRanPrevVals.insert(std::pair<BasicBlock*, int>(&BB, 1));
-                    i=i+2;
+                    int Sig, SubRanPrevVal;
+                    do {
+                        Sig = 2 * RNG.next(1, 0x7ffffff);
+                    } while (!UsedSigs.insert(Sig).second);
+                    do {
+                        SubRanPrevVal = 2 * RNG.next(0, 0x7fff) + 1;
+                    } while (!UsedEntrySigs.insert(Sig + SubRanPrevVal).second);
+                    RandomNumberBBs.insert(std::pair<BasicBlock*, int>(&BB, Sig));
+                    SubRanPrevVals.insert(std::pair<BasicBlock*, int>(&BB, SubRanPrevVal));
                 }
             }
         }
@@ -47,11 +95,34 @@ void RASM::initializeBlocksSignatures(Module &Md, std::map<BasicBlock*, int> &Ra
     return;
 }
 
-#if (INTER_FUNCTION_CFC == 1)
+RASM::RASM() : RASM(INTER_FUNCTION_CFC == 1) {}
+
+Value *RASM::loadSig(IRBuilder<> &B, Value &Sig) {
+  return B.CreateLoad(B.getInt32Ty(), &Sig, !RegisterSig);
+}
+
+/**
+ * Stores Val in the signature Sig. When the signatures are promoted to SSA
+ * values, the stores are not volatile and the barrier hides Val from the
+ * optimizer, otherwise the constant signatures would be propagated and all
+ * the checks folded away.
+ */
+void RASM::storeSig(IRBuilder<> &B, Value *Val, Value &Sig) {
+  if (RegisterSig) {
+    switch (RASMSigBarrier) {
+    case SigBarrier::Asm:
+      Val = createOpaqueCopy(B, Val);
+      break;
+    case SigBarrier::FakeUse:
+      B.CreateIntrinsic(Intrinsic::fake_use, {}, {Val});
+      break;
+    default:
+      break;
+    }
+  }
+  B.CreateStore(Val, &Sig, !RegisterSig);
+}
 
-std::map<BasicBlock*, CallBase *> CallBBs;
-std::map<Function*, BasicBlock*> FuncEntryBlocks;
-std::map<BasicBlock*, BasicBlock*> SplitBBs;
 /**
  * Navigates the module's (not declared for linker and not externally linked) functions.
  * For each such function, split all the basic blocks calling it before the
@@ -112,8 +183,6 @@ void RASM::initializeEntryBlocksMap(Module &Md) {
   }
 }
 
-#endif
-
 Value *RASM::getCondition(Instruction &I) {
   if (isa<BranchInst>(I) && cast<BranchInst>(I).isConditional()) {
     if (!cast<BranchInst>(I).isConditional()) {
@@ -124,8 +193,6 @@ Value *RASM::getCondition(Instruction &I) {
     }
   }
   else if (isa<SwitchInst>(I)) {
-    errs() << "There is a switch!\n";
-    abort();
     return cast<SwitchInst>(I).getCondition();
   }
   else {
@@ -133,6 +200,19 @@ Value *RASM::getCondition(Instruction &I) {
   }
 }
 
+/**
+ * Makes all the predecessors of BB branch to NewBB instead. NewBB must not
+ * branch to BB yet.
+ */
+void RASM::redirectPredecessors(BasicBlock &BB, BasicBlock &NewBB) {
+    // the predecessors are collected first, as replacing the successors
+    // changes the uses of BB
+    SmallSetVector<BasicBlock*, 8> Preds(pred_begin(&BB), pred_end(&BB));
+    for (BasicBlock *Pred : Preds) {
+      Pred->getTerminator()->replaceSuccessorWith(&BB, &NewBB);
+    }
+}
+
 void RASM::createCFGVerificationBB (  BasicBlock &BB, 
                                 std::map<BasicBlock*, int> &RandomNumberBBs, 
                                 std::map<BasicBlock*, int> &SubRanPrevVals, 
@@ -148,17 +228,17 @@ void RASM::createCFGVerificationBB (  BasicBlock &BB,
     if (!BB.isEntryBlock()) {
         if (isa<LandingPadInst>(BB.getFirstNonPHI()) || BB.getName().contains_insensitive("verification")) {
           IRBuilder<> BChecker(&*BB.getFirstInsertionPt());
-          BChecker.CreateStore(llvm::ConstantInt::get(IntType, randomNumberBB),&RuntimeSig, true);
+          storeSig(BChecker, llvm::ConstantInt::get(IntType, randomNumberBB), RuntimeSig);
         }
         else if (!BB.getName().contains_insensitive("errbb")){
         BasicBlock *NewBB = BasicBlock::Create(BB.getContext(), "RASM_Verification_BB", BB.getParent(), &BB);
         IRBuilder<> BChecker(NewBB);
 
           // add instructions for the first runtime signature update
-          Value *InstrRuntimeSig = BChecker.CreateLoad(IntType, &RuntimeSig, true);
+          Value *InstrRuntimeSig = loadSig(BChecker, RuntimeSig);
 
           Value *RuntimeSignatureVal = BChecker.CreateSub(InstrRuntimeSig, llvm::ConstantInt::get(IntType, subRanPrevVal));
-          BChecker.CreateStore(RuntimeSignatureVal, &RuntimeSig, true);
+          storeSig(BChecker, RuntimeSignatureVal, RuntimeSig);
 
           // update phi placing them in the new block
           while (isa<PHINode>(&BB.front())) {
@@ -168,16 +248,18 @@ void RASM::createCFGVerificationBB (  BasicBlock &BB,
           }
 
           // replace the uses of BB with NewBB
-          for (BasicBlock &BB_ : *BB.getParent()) {
-            if (&BB_ != NewBB) {
-              BB_.getTerminator()->replaceSuccessorWith(&BB, NewBB);
-            }
+          redirectPredecessors(BB, *NewBB);
+
+          // add instructions for checking the runtime signature, unless BB is
+          // a hot block whose check does not fit -aspis-overhead-budget (the
+          // signature is still updated, so the error is caught later)
+          if (getProfileCount(BB) < HotThreshold) {
+            Value *CmpVal = BChecker.CreateCmp(llvm::CmpInst::ICMP_EQ, RuntimeSignatureVal, llvm::ConstantInt::get(IntType, randomNumberBB));
+            BChecker.CreateCondBr(CmpVal, &BB, &ErrBB);
+          } else {
+            BChecker.CreateBr(&BB);
           }
 
-          // add instructions for checking the runtime signature
-          Value *CmpVal = BChecker.CreateCmp(llvm::CmpInst::ICMP_EQ, RuntimeSignatureVal, llvm::ConstantInt::get(IntType, randomNumberBB));
-          BChecker.CreateCondBr(CmpVal, &BB, &ErrBB);
-
           // add NewBB and BB into the NewBBs map
           NewBBs.insert(std::pair<BasicBlock*, BasicBlock*>(NewBB, &BB));
       }
@@ -191,9 +273,8 @@ void RASM::createCFGVerificationBB (  BasicBlock &BB,
      * C) all the other cases
     */
 
-    #if (INTER_FUNCTION_CFC == 1) 
     // Case A, we need to update the RetSig
-    CallBase *CallIn = isCallBB(BB);
+    CallBase *CallIn = InterFunctionCFC ? isCallBB(BB) : nullptr;
     if (CallIn != nullptr && (*CallIn).getCalledFunction() != nullptr && shouldCompile(*(*CallIn).getCalledFunction(), FuncAnnotations)) {
       // Get the signature of the called basic block after the call
       BasicBlock *SuccBB = SplitBBs.find(&BB)->second;
@@ -222,29 +303,24 @@ void RASM::createCFGVerificationBB (  BasicBlock &BB,
       B.CreateStore(RetSigBackup, &RetSig, true);
     }
     else
-    #endif
     // Case B, we need to add a check on the RetSig and update the RuntimeSig
     if (isa<ReturnInst>(BB.getTerminator())) {
       // add a control basic block before the return instruction
       BB.splitBasicBlockBefore(BB.getTerminator());
       BasicBlock *NewBB = BasicBlock::Create(BB.getContext(), "RASM_ret_Verification_BB", BB.getParent(), &BB);
       // replace the uses of BB with NewBB
-      for (BasicBlock &BB_ : *BB.getParent()) {
-        if (&BB_ != NewBB) {
-          BB_.getTerminator()->replaceSuccessorWith(&BB, NewBB);
-        }
-      }
+      redirectPredecessors(BB, *NewBB);
       int primeNum = randomNumberBB - subRanPrevVal;
 
       // compute the adjustment value as AdjVal = primeNum+SubRanPrevVal-RetSig = randomNumberBB-subRanPrevVal+SubRanPrevVal-RetSig = randomNumberBB-RetSig
       IRBuilder<> B(NewBB);
-      Value *InstrRetSig = B.CreateLoad(IntType, &RetSig, true);
+      Value *InstrRetSig = loadSig(B, RetSig);
       Value* AdjVal = B.CreateSub(llvm::ConstantInt::get(IntType, randomNumberBB), InstrRetSig);
 
       // update the signature
-      Value *InstrRuntimeSig = B.CreateLoad(IntType, &RuntimeSig, true);
+      Value *InstrRuntimeSig = loadSig(B, RuntimeSig);
       Value* NewSig = B.CreateSub(InstrRuntimeSig, AdjVal);
-      B.CreateStore(NewSig, &RuntimeSig, true);
+      storeSig(B, NewSig, RuntimeSig);
 
       // compare the new signature with RetSig
       Value *CmpValRet = B.CreateCmp(llvm::CmpInst::ICMP_EQ, NewSig, InstrRetSig);
@@ -259,69 +335,89 @@ void RASM::createCFGVerificationBB (  BasicBlock &BB,
        * We have three cases:
        * 1) one successor -> the branch is unconditional, so we use one single successor
        * 2) two successors -> the branch is conditional, so we use a `select` instruction
-       * 3) more than three successors -> we have a switch: impossible since we lower switches in a previous pass
+       * 3) a switch -> the adjustment value is selected like the successor
       */
-      int numSuccessors = Terminator->getNumSuccessors();
-      if (numSuccessors>1 and Terminator->isSpecialTerminator()){
-        numSuccessors=1;
-      }
-      switch (numSuccessors)
-      {
-        case 0: break;
-        case 1: {
-          BasicBlock *Successor = Terminator->getSuccessor(0);
-          if (NewBBs.find(Successor) != NewBBs.end()) { // we want to find the correct successor, i.e. if Successor is in NewBBs, it means that it has been added now so it doesn't have a signature... Therefore we take the successor's successor
-            Successor = NewBBs.find(Successor)->second;
+      if (auto *SI = dyn_cast<SwitchInst>(Terminator)) {
+        std::map<BasicBlock*, Constant*> AdjVals;
+        for (BasicBlock *Successor : successors(&BB)) {
+          BasicBlock *SigBB = Successor;
+          if (NewBBs.find(SigBB) != NewBBs.end()) {
+            SigBB = NewBBs.find(SigBB)->second;
           }
-          int succRandomNumberBB = RandomNumberBBs.find(Successor)->second;
-          int succSubRanPrevVal = SubRanPrevVals.find(Successor)->second;
+          int succRandomNumberBB = RandomNumberBBs.find(SigBB)->second;
+          int succSubRanPrevVal = SubRanPrevVals.find(SigBB)->second;
           int adjVal = randomNumberBB - (succRandomNumberBB + succSubRanPrevVal);
-
-          Value *InstrRuntimeSig = B.CreateLoad(IntType, &RuntimeSig, true);
-          Value *NewSig = B.CreateSub(InstrRuntimeSig, llvm::ConstantInt::get(IntType, adjVal));
-          B.CreateStore(NewSig, &RuntimeSig, true);
-          break;
+          AdjVals[Successor] = llvm::ConstantInt::get(IntType, adjVal);
         }
-        case 2: {
-          BasicBlock *Successor_1 = Terminator->getSuccessor(0);
-          if (NewBBs.find(Successor_1) != NewBBs.end()) {
-            Successor_1 = NewBBs.find(Successor_1)->second;
-          }
-          int succRandomNumberBB_1 = RandomNumberBBs.find(Successor_1)->second;
-          int succSubRanPrevVal_1 = SubRanPrevVals.find(Successor_1)->second;
-          int adjVal_1 = randomNumberBB - (succRandomNumberBB_1 + succSubRanPrevVal_1);
+        Value *AdjustValue = createSwitchLookup(B, *SI, AdjVals);
+        Value *InstrRuntimeSig = loadSig(B, RuntimeSig);
+        Value *NewSig = B.CreateSub(InstrRuntimeSig, AdjustValue);
+        storeSig(B, NewSig, RuntimeSig);
+      }
+      else {
+        int numSuccessors = Terminator->getNumSuccessors();
+        if (numSuccessors>1 and Terminator->isSpecialTerminator()){
+          numSuccessors=1;
+        }
+        switch (numSuccessors)
+        {
+          case 0: break;
+          case 1: {
+            BasicBlock *Successor = Terminator->getSuccessor(0);
+            if (NewBBs.find(Successor) != NewBBs.end()) { // we want to find the correct successor, i.e. if Successor is in NewBBs, it means that it has been added now so it doesn't have a signature... Therefore we take the successor's successor
+              Successor = NewBBs.find(Successor)->second;
+            }
+            int succRandomNumberBB = RandomNumberBBs.find(Successor)->second;
+            int succSubRanPrevVal = SubRanPrevVals.find(Successor)->second;
+            int adjVal = randomNumberBB - (succRandomNumberBB + succSubRanPrevVal);
 
-          BasicBlock *Successor_2 = Terminator->getSuccessor(1);
-          if (NewBBs.find(Successor_2) != NewBBs.end()) {
-            Successor_2 = NewBBs.find(Successor_2)->second;
+            Value *InstrRuntimeSig = loadSig(B, RuntimeSig);
+            Value *NewSig = B.CreateSub(InstrRuntimeSig, llvm::ConstantInt::get(IntType, adjVal));
+            storeSig(B, NewSig, RuntimeSig);
+            break;
           }
-          int succRandomNumberBB_2 = RandomNumberBBs.find(Successor_2)->second;
-          int succSubRanPrevVal_2 = SubRanPrevVals.find(Successor_2)->second;
-          int adjVal_2 = randomNumberBB - (succRandomNumberBB_2 + succSubRanPrevVal_2);
+          case 2: {
+            BasicBlock *Successor_1 = Terminator->getSuccessor(0);
+            if (NewBBs.find(Successor_1) != NewBBs.end()) {
+              Successor_1 = NewBBs.find(Successor_1)->second;
+            }
+            int succRandomNumberBB_1 = RandomNumberBBs.find(Successor_1)->second;
+            int succSubRanPrevVal_1 = SubRanPrevVals.find(Successor_1)->second;
+            int adjVal_1 = randomNumberBB - (succRandomNumberBB_1 + succSubRanPrevVal_1);
+
+            BasicBlock *Successor_2 = Terminator->getSuccessor(1);
+            if (NewBBs.find(Successor_2) != NewBBs.end()) {
+              Successor_2 = NewBBs.find(Successor_2)->second;
+            }
+            int succRandomNumberBB_2 = RandomNumberBBs.find(Successor_2)->second;
+            int succSubRanPrevVal_2 = SubRanPrevVals.find(Successor_2)->second;
+            int adjVal_2 = randomNumberBB - (succRandomNumberBB_2 + succSubRanPrevVal_2);
 
-          Value *BrCondition = getCondition(*Terminator);
+            Value *BrCondition = getCondition(*Terminator);
 
-          Value *AdjustValue;
-          if (Successor_1->getName().contains_insensitive("errbb")) {
-            B.CreateStore(llvm::ConstantInt::get(IntType, randomNumberBB-adjVal_2), &RuntimeSig, true);
-          }
-          if (Successor_2->getName().contains_insensitive("errbb")) {
-            B.CreateStore(llvm::ConstantInt::get(IntType, randomNumberBB-adjVal_1), &RuntimeSig, true);
-          }
-          else {
-            AdjustValue = B.CreateSelect(BrCondition, llvm::ConstantInt::get(IntType, adjVal_1)
-                                    , llvm::ConstantInt::get(IntType, adjVal_2));
-            Value *InstrRuntimeSig = B.CreateLoad(IntType, &RuntimeSig, true);
-            Value *NewSig = B.CreateSub(InstrRuntimeSig, AdjustValue);
-            B.CreateStore(NewSig, &RuntimeSig, true);
+            Value *AdjustValue;
+            if (Successor_1->getName().contains_insensitive("errbb")) {
+              storeSig(B, llvm::ConstantInt::get(IntType, randomNumberBB-adjVal_2), RuntimeSig);
+            }
+            if (Successor_2->getName().contains_insensitive("errbb")) {
+              storeSig(B, llvm::ConstantInt::get(IntType, randomNumberBB-adjVal_1), RuntimeSig);
+            }
+            else {
+              AdjustValue = B.CreateSelect(BrCondition, llvm::ConstantInt::get(IntType, adjVal_1)
+                                      , llvm::ConstantInt::get(IntType, adjVal_2));
+              Value *InstrRuntimeSig = loadSig(B, RuntimeSig);
+              Value *NewSig = B.CreateSub(InstrRuntimeSig, AdjustValue);
+              storeSig(B, NewSig, RuntimeSig);
+            }
+            break;
           }
-          break;
-        }
         
-        default:{ 
-          errs() << "There is a switch!\n";
-          abort();
-          break;
+          default:{ 
+            // e.g. indirectbr, whose targets are not known statically
+            errs() << "Unsupported terminator: " << *Terminator << "\n";
+            abort();
+            break;
+          }
         }
       }
     }
@@ -339,11 +435,12 @@ PreservedAnalyses RASM::run(Module &Md, ModuleAnalysisManager &AM) {
 
     auto *IntType = llvm::Type::getInt32Ty(Md.getContext());
 
-    #if (INTER_FUNCTION_CFC == 1)
-      splitBBsAtCalls(Md);
-      GlobalVariable *RuntimeSig ;
-      GlobalVariable *RetSig ;
+    RegisterSig = !InterFunctionCFC && RASMSigStorage == SigStorage::Register;
 
+    GlobalVariable *GlobalRuntimeSig = nullptr;
+    GlobalVariable *GlobalRetSig = nullptr;
+    if (InterFunctionCFC) {
+      splitBBsAtCalls(Md);
       {
         bool initialized_runtimesig = false;
         bool initialized_retsig = false;
@@ -352,17 +449,17 @@ PreservedAnalyses RASM::run(Module &Md, ModuleAnalysisManager &AM) {
         for (GlobalVariable &GV : Md.globals()) {
           if (!isa<Function>(GV) && FuncAnnotations.find(&GV) != FuncAnnotations.end()) {
             if ((FuncAnnotations.find(&GV))->second.starts_with("runtime_sig")) {
-              RuntimeSig = &GV;
+              GlobalRuntimeSig = &GV;
               initialized_runtimesig = true;
             } else if ((FuncAnnotations.find(&GV))->second.starts_with("run_adj_sig")) {
-              RetSig = &GV;
+              GlobalRetSig = &GV;
               initialized_retsig = true;
             }
           }
         }
 
         if (!initialized_runtimesig) {
-          RuntimeSig = new GlobalVariable(
+          GlobalRuntimeSig = new GlobalVariable(
             Md, IntType, /*isConstant=*/false,
             GlobalVariable::ExternalLinkage,
             ConstantInt::get(IntType, INIT_SIGNATURE),
@@ -371,7 +468,7 @@ PreservedAnalyses RASM::run(Module &Md, ModuleAnalysisManager &AM) {
         }
 
         if (!initialized_retsig) {
-          RetSig = new GlobalVariable(
+          GlobalRetSig = new GlobalVariable(
             Md, IntType, /*isConstant=*/false,
             GlobalVariable::ExternalLinkage,
             ConstantInt::get(IntType, INIT_SIGNATURE),
@@ -379,14 +476,21 @@ PreservedAnalyses RASM::run(Module &Md, ModuleAnalysisManager &AM) {
           );
         }
       }
-
-    #endif
+    }
 
     initializeBlocksSignatures(Md, RandomNumberBBs, SubRanPrevVals);
 
-    #if (INTER_FUNCTION_CFC == 1)
-    initializeEntryBlocksMap(Md);
-    #endif
+    // the comparison and the branch checking each block, to apply
+    // -aspis-overhead-budget
+    std::vector<std::pair<uint64_t, uint64_t>> ChecksCosts;
+    for (auto &[BB, Sig] : RandomNumberBBs) {
+      ChecksCosts.push_back({getProfileCount(*BB), 2});
+    }
+    HotThreshold = getHotBlockThreshold(Md, ChecksCosts);
+
+    if (InterFunctionCFC) {
+      initializeEntryBlocksMap(Md);
+    }
 
     for (Function &Fn : Md) {
       if (shouldCompile(Fn, FuncAnnotations)) {
@@ -400,15 +504,26 @@ PreservedAnalyses RASM::run(Module &Md, ModuleAnalysisManager &AM) {
         #if (LOG_COMPILED_FUNCS == 1)
           CompiledFuncs.insert(&Fn);
         #endif
+        // the original blocks of the function, collected before adding new ones
+        std::vector<BasicBlock*> FnBBs;
+        for (BasicBlock &BB : Fn) {
+          if (RandomNumberBBs.find(&BB) != RandomNumberBBs.end()) {
+            FnBBs.push_back(&BB);
+          }
+        }
         int currSig = RandomNumberBBs.find(&Fn.front())->second;
-        #if (INTER_FUNCTION_CFC == 0)
+        Value *RuntimeSig;
+        Value *RetSig;
+        if (!InterFunctionCFC) {
           IRBuilder<> B(&*(Fn.front().getFirstInsertionPt()));
           // initialize the runtime signature for the first basic block of the function
-          Value *RuntimeSig = B.CreateAlloca(IntType);
-          Value *RetSig = B.CreateAlloca(IntType);
-          B.CreateStore(llvm::ConstantInt::get(IntType, currSig), RuntimeSig, true);
-          B.CreateStore(llvm::ConstantInt::get(IntType, RandomNumberBBs.size() + currSig), RetSig, true);
-        #elif (INTER_FUNCTION_CFC == 1)
+          RuntimeSig = B.CreateAlloca(IntType);
+          RetSig = B.CreateAlloca(IntType);
+          storeSig(B, llvm::ConstantInt::get(IntType, currSig), *RuntimeSig);
+          storeSig(B, llvm::ConstantInt::get(IntType, RandomNumberBBs.size() + currSig), *RetSig);
+        } else {
+          RuntimeSig = GlobalRuntimeSig;
+          RetSig = GlobalRetSig;
           int subCurrSig = SubRanPrevVals.find(&Fn.front())->second;
           // add instructions for initializing the runtime signatures in case they have not been initialized
           
@@ -434,7 +549,7 @@ PreservedAnalyses RASM::run(Module &Md, ModuleAnalysisManager &AM) {
 
           // add the branch to the previous frontBB
           B.CreateBr(FrontBB);
-        #endif
+        }
         // create the ErrBB
         BasicBlock *ErrBB = BasicBlock::Create(Fn.getContext(), "ErrBB", &Fn);
         IRBuilder<> ErrB(ErrBB);
@@ -445,11 +560,17 @@ PreservedAnalyses RASM::run(Module &Md, ModuleAnalysisManager &AM) {
         ErrB.CreateCall(CalleeF)->setDebugLoc(debugLoc);
         ErrB.CreateUnreachable();
 
-        for (auto &Elem : RandomNumberBBs) {
-          BasicBlock *BB = Elem.first;
-          if (BB->getParent() == &Fn) {
-            createCFGVerificationBB(*BB, RandomNumberBBs, SubRanPrevVals, *RuntimeSig, *RetSig, *ErrBB);
-          }
+        for (BasicBlock *BB : FnBBs) {
+          createCFGVerificationBB(*BB, RandomNumberBBs, SubRanPrevVals, *RuntimeSig, *RetSig, *ErrBB);
+        }
+
+        // thread the signatures through PHIs at the block entries
+        if (RegisterSig) {
+          DominatorTree DT(Fn);
+          PromoteMemToReg({cast<AllocaInst>(RuntimeSig), cast<AllocaInst>(RetSig)}, DT);
+          NumSigsPromoted += 2;
+        } else if (!InterFunctionCFC) {
+          NumSigSlots += 2;
         }
       }
     }
@@ -0,0 +1,109 @@
+/**
+ * ************************************************************************************************
+ * @brief  Runtime of the shadow memory mode of EDDI (-eddi-shadow-mem), linked
+ *         to the hardened binaries by `aspis.sh --eddi-shadow-mem`.
+ *
+ *         The duplicate of each byte of the program lives at aspis_shadow_offset
+ *         (emitted by EDDI) from it. Before the constructors of the program,
+ *         the shadow of the user address space where Linux places the
+ *         position-independent executables, the libraries, the heap and the
+ *         stacks ([ASPIS_SHADOW_APP_LO, ASPIS_SHADOW_APP_HI) on x86-64) is
+ *         reserved without committing memory, and the memory mapped so far
+ *         (the globals, the arguments and the environment) is copied to its
+ *         shadow. The memory mapped later is zero-filled on both sides.
+ *         EDDI redirects the calls to calloc and realloc to the functions
+ *         below, which do the same on the shadow of the block.
+ * ************************************************************************************************
+*/
+#define _GNU_SOURCE
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#define ASPIS_SHADOW_APP_LO UINT64_C(0x500000000000)
+#define ASPIS_SHADOW_APP_HI UINT64_C(0x800000000000)
+
+/* emitted by EDDI */
+extern const int64_t aspis_shadow_offset;
+
+static void aspis_shadow_fail(const char *msg) {
+  fprintf(stderr, "ASPIS shadow memory: %s\n", msg);
+  abort();
+}
+
+static void aspis_shadow_reserve(void) {
+  uint64_t lo = ASPIS_SHADOW_APP_LO + (uint64_t)aspis_shadow_offset;
+  uint64_t hi = ASPIS_SHADOW_APP_HI + (uint64_t)aspis_shadow_offset;
+  if (aspis_shadow_offset == 0 || lo > hi ||
+      (lo < ASPIS_SHADOW_APP_HI && hi > ASPIS_SHADOW_APP_LO)) {
+    aspis_shadow_fail("the offset maps the address space onto itself");
+  }
+  void *shadow = mmap((void *)(uintptr_t)lo, hi - lo, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE,
+                      -1, 0);
+  if (shadow != (void *)(uintptr_t)lo) {
+    aspis_shadow_fail("cannot reserve the shadow of the address space");
+  }
+}
+
+/* copies the readable mappings to their shadow */
+static void aspis_shadow_mirror(void) {
+  FILE *maps = fopen("/proc/self/maps", "r");
+  if (maps == NULL) {
+    aspis_shadow_fail("cannot read /proc/self/maps");
+  }
+  char line[4096];
+  while (fgets(line, sizeof(line), maps) != NULL) {
+    unsigned long start, end;
+    char perms[5];
+    if (sscanf(line, "%lx-%lx %4s", &start, &end, perms) != 3 || perms[0] != 'r') {
+      continue;
+    }
+    if (strstr(line, "[vvar") != NULL || strstr(line, "[vsyscall]") != NULL) {
+      continue;
+    }
+    if (start < ASPIS_SHADOW_APP_LO || end > ASPIS_SHADOW_APP_HI) {
+      /* e.g. a non-PIE executable, whose globals would have no shadow */
+      if (strchr(line, '/') != NULL) {
+        aspis_shadow_fail("data mapped out of the shadowed range, build a PIE");
+      }
+      continue;
+    }
+    memcpy((char *)start + aspis_shadow_offset, (const char *)start, end - start);
+  }
+  fclose(maps);
+}
+
+__attribute__((constructor(101))) static void aspis_shadow_init(void) {
+  aspis_shadow_reserve();
+  aspis_shadow_mirror();
+}
+
+void *aspis_shadow_calloc(size_t nmemb, size_t size) {
+  void *ptr = calloc(nmemb, size);
+  if (ptr != NULL) {
+    /* the block may have been freed before, leaving its shadow dirty */
+    memset((char *)ptr + aspis_shadow_offset, 0, nmemb * size);
+  }
+  return ptr;
+}
+
+void *aspis_shadow_realloc(void *ptr, size_t size) {
+  size_t old_size = ptr != NULL ? malloc_usable_size(ptr) : 0;
+  uintptr_t old_addr = (uintptr_t)ptr;
+  void *new_ptr = realloc(ptr, size);
+  if (new_ptr != NULL && (uintptr_t)new_ptr != old_addr && old_size != 0) {
+    /* the shadows of the two blocks may overlap */
+    memmove((char *)new_ptr + aspis_shadow_offset,
+            (const char *)old_addr + aspis_shadow_offset,
+            old_size < size ? old_size : size);
+  }
+  return new_ptr;
+}
@@ -1,17 +1,28 @@
 #include "Utils.h"
 
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/InstructionSimplify.h"
 #include "llvm/IR/Attributes.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/ValueHandle.h"
 #include "llvm/Pass.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
 #include <list>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include "llvm/IR/DebugInfoMetadata.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Transforms/Utils/Local.h"
 
 using namespace llvm;
 using LinkageMap = std::unordered_map<std::string, std::vector<StringRef>>;
@@ -33,6 +44,21 @@ static cl::opt<std::string, true> DuplicateSecNameOpt("duplicate-sec", cl::desc(
 bool ProfilingEnabled;
 static cl::opt<bool, true> ProfilingFuncCalls("enable-profiling", cl::desc("Enable the insertion of profiling function calls at synchonization points"), cl::location(ProfilingEnabled), cl::init(false));
 
+bool ShadowMemEnabled;
+static cl::opt<bool, true> ShadowMem("eddi-shadow-mem", cl::desc("Keep the duplicate of each memory object at a fixed offset from the original (shadow memory) instead of duplicating the objects and the pointer arguments"), cl::location(ShadowMemEnabled), cl::init(false));
+
+long long ShadowMemOffset;
+static cl::opt<long long, true> ShadowMemOffsetOpt("eddi-shadow-offset", cl::desc("Offset of the shadow memory from the original objects (see passes/ShadowMemory/runtime.c)"), cl::location(ShadowMemOffset), cl::init(-0x400000000000LL));
+
+unsigned EDDIReplicas;
+static cl::opt<unsigned, true> EDDIReplicasOpt("eddi-replicas", cl::desc("Copies of each value kept by EDDI: 2 detects the mismatches, 3 also corrects them by majority voting at the synchronization points"), cl::location(EDDIReplicas), cl::init(2));
+
+static cl::opt<unsigned long long> ASPISSeed("aspis-seed", cl::desc("Seed of the signatures of the control-flow checking passes"), cl::init(0));
+
+static cl::opt<std::string> ASPISProfile("aspis-profile", cl::desc("Execution counts of the basic blocks (.aspis.profraw) collected on the unhardened program"), cl::init(""));
+
+static cl::opt<double> ASPISOverheadBudget("aspis-overhead-budget", cl::desc("Maximum overhead of the checks, as a percentage of the instructions executed by the unhardened program (needs -aspis-profile)"), cl::init(-1));
+
 
 bool IsNotAPHINode (Use &U){
   return !isa<PHINode>(U.getUser());
@@ -214,6 +240,43 @@ bool isIntrinsicToDuplicate(CallBase *CInstr) {
     return false; 
 }
 
+DupArgLayout getDupArgLayout(FunctionType *FnTy) {
+  DupArgLayout Layout;
+  // in shadow memory mode the duplicate of a pointer is derived from it
+  auto isDuplicated = [](Type *ParamTy) {
+    return !(ShadowMemEnabled && ParamTy->isPointerTy());
+  };
+  bool HasThird = EDDIReplicas == 3;
+  unsigned NumDups = llvm::count_if(FnTy->params(), isDuplicated);
+  unsigned NumCopies = HasThird ? 2 * NumDups : NumDups;
+  unsigned Pos = 0, DupPos = 0;
+  for (Type *ParamTy : FnTy->params()) {
+    bool IsDuplicated = isDuplicated(ParamTy);
+    if (AlternateMemMapEnabled) {
+      Layout.Orig.push_back(Pos++);
+      Layout.Dup.push_back(IsDuplicated ? Pos++ : -1);
+      Layout.Third.push_back(IsDuplicated && HasThird ? Pos++ : -1);
+    } else {
+      Layout.Orig.push_back(NumCopies + Layout.Orig.size());
+      Layout.Dup.push_back(IsDuplicated ? DupPos : -1);
+      Layout.Third.push_back(IsDuplicated && HasThird ? NumDups + DupPos : -1);
+      DupPos += IsDuplicated;
+    }
+  }
+  Layout.NumArgs = FnTy->getNumParams() + NumCopies;
+  return Layout;
+}
+
+Value *createShadowPtr(IRBuilder<> &B, Value *Ptr) {
+  // computed on integers, so that the optimizer does not take the access to
+  // the shadow for an out-of-bounds access to the original object
+  const DataLayout &DL = B.GetInsertBlock()->getModule()->getDataLayout();
+  Type *IntPtrTy = DL.getIntPtrType(Ptr->getType());
+  Value *Addr = B.CreatePtrToInt(Ptr, IntPtrTy);
+  Addr = B.CreateAdd(Addr, ConstantInt::get(IntPtrTy, ShadowMemOffset, true));
+  return B.CreateIntToPtr(Addr, Ptr->getType());
+}
+
 void createFtFunc(Module &Md, StringRef name) {
   Value *FnValue = Md.getFunction(name);
   Function *Fn;
@@ -225,6 +288,9 @@ void createFtFunc(Module &Md, StringRef name) {
     Fn = cast<Function>(FnValue);
   
     if (Fn->isDeclaration()) {
+      // weak, so that a handler defined in another translation unit takes
+      // precedence when the units are hardened separately and then linked
+      Fn->setLinkage(GlobalValue::WeakAnyLinkage);
       BasicBlock *StartBB = BasicBlock::Create(Md.getContext(), "start", Fn);
       BasicBlock *LoopBB = BasicBlock::Create(Md.getContext(), "loop", Fn);
   
@@ -277,8 +343,9 @@ void createProfilingFunc(Module &Md, StringRef name, ProfilingType PT) {
   Fn->setAttributes(AL);
   Fn->setOnlyReadsMemory();
 
-  // create the body
+  // create the body, the same in every translation unit
   if (Fn->isDeclaration()) {
+    Fn->setLinkage(GlobalValue::WeakAnyLinkage);
     BasicBlock *StartBB = BasicBlock::Create(Md.getContext(), "start", Fn);
     IRBuilder<> B(StartBB);
     Value *RetVal;
@@ -308,3 +375,383 @@ void createFtFuncs(Module &Md) {
     createProfilingFunc(Md, "aspis.datacheck.end", ProfilingType::ConsistencyCheck);
   }
 }
+
+Value *createOpaqueCopy(IRBuilder<> &B, Value *V) {
+  FunctionType *FnType = FunctionType::get(V->getType(), {V->getType()}, false);
+  return B.CreateCall(InlineAsm::get(FnType, "", "=r,0", false), {V});
+}
+
+Value *createSwitchLookup(IRBuilder<> &B, SwitchInst &SI,
+                          const std::map<BasicBlock *, Constant *> &SuccValues) {
+  Constant *DefaultVal = SuccValues.at(SI.getDefaultDest());
+  if (SI.getNumCases() == 0) {
+    return DefaultVal;
+  }
+  Value *Cond = SI.getCondition();
+
+  APInt Min = SI.case_begin()->getCaseValue()->getValue();
+  APInt Max = Min;
+  for (auto Case : SI.cases()) {
+    const APInt &CaseVal = Case.getCaseValue()->getValue();
+    if (CaseVal.slt(Min)) Min = CaseVal;
+    if (CaseVal.sgt(Max)) Max = CaseVal;
+  }
+  // the number of table entries minus one, which always fits the condition
+  APInt Range = Max - Min;
+
+  // same density threshold (40%) used by SimplifyCFG for the lookup tables
+  if (Range.getActiveBits() > 32 ||
+      (Range.getZExtValue() + 1) * 10 > SI.getNumCases() * 25) {
+    Value *Res = DefaultVal;
+    for (auto Case : SI.cases()) {
+      Value *IsCase = B.CreateICmpEQ(Cond, Case.getCaseValue());
+      Res = B.CreateSelect(IsCase, SuccValues.at(Case.getCaseSuccessor()), Res);
+    }
+    return Res;
+  }
+
+  std::vector<Constant *> Table(Range.getZExtValue() + 1, DefaultVal);
+  for (auto Case : SI.cases()) {
+    uint64_t Idx = (Case.getCaseValue()->getValue() - Min).getZExtValue();
+    Table[Idx] = SuccValues.at(Case.getCaseSuccessor());
+  }
+  ArrayType *TableType = ArrayType::get(DefaultVal->getType(), Table.size());
+  auto *TableGV = new GlobalVariable(*SI.getModule(), TableType, true,
+                                     GlobalValue::PrivateLinkage,
+                                     ConstantArray::get(TableType, Table),
+                                     "switch.table");
+  TableGV->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+
+  // out-of-range conditions take the default value, without reading the table
+  Value *Idx = B.CreateSub(Cond, ConstantInt::get(Cond->getType(), Min));
+  Value *InRange = B.CreateICmpULE(Idx, ConstantInt::get(Cond->getType(), Range));
+  Value *SafeIdx = B.CreateSelect(InRange, Idx, ConstantInt::get(Cond->getType(), 0));
+  SafeIdx = B.CreateZExtOrTrunc(SafeIdx, B.getInt64Ty());
+  Value *Elem = B.CreateInBoundsGEP(TableType, TableGV, {B.getInt64(0), SafeIdx});
+  Value *TableVal = B.CreateLoad(DefaultVal->getType(), Elem);
+  return B.CreateSelect(InRange, TableVal, DefaultVal);
+}
+
+void BlockReachability::compute(Function &Fn) {
+  SCCOf.clear();
+  Reaches.clear();
+
+  // scc_iterator visits the SCCs in reverse topological order, so the
+  // successors of an SCC always have a smaller index than the SCC itself
+  std::vector<std::vector<BasicBlock*>> SCCs;
+  for (scc_iterator<Function*> It = scc_begin(&Fn); !It.isAtEnd(); ++It) {
+    if (SCCs.size() == MaxSCCs) {
+      SCCOf.clear();
+      return;
+    }
+    for (BasicBlock *BB : *It) {
+      SCCOf.insert({BB, SCCs.size()});
+    }
+    SCCs.push_back(*It);
+  }
+
+  Reaches.resize(SCCs.size(), BitVector(SCCs.size()));
+  for (unsigned i = 0; i < SCCs.size(); i++) {
+    for (BasicBlock *BB : SCCs[i]) {
+      for (BasicBlock *Succ : successors(BB)) {
+        unsigned j = SCCOf.find(Succ)->second;
+        if (j != i && !Reaches[i].test(j)) {
+          Reaches[i].set(j);
+          Reaches[i] |= Reaches[j];
+        }
+      }
+    }
+  }
+}
+
+void BlockReachability::recordSplit(BasicBlock &NewBB, BasicBlock &OldBB) {
+  auto SCC = SCCOf.find(&OldBB);
+  if (SCC != SCCOf.end()) {
+    SCCOf.insert({&NewBB, SCC->second});
+  }
+}
+
+bool BlockReachability::isKnown(BasicBlock &BB) const {
+  return SCCOf.find(&BB) != SCCOf.end();
+}
+
+bool BlockReachability::isReachable(BasicBlock &From, BasicBlock &To) const {
+  unsigned FromSCC = SCCOf.find(&From)->second;
+  unsigned ToSCC = SCCOf.find(&To)->second;
+  return FromSCC == ToSCC || Reaches[FromSCC].test(ToSCC);
+}
+
+void removeConsistencyChecks(Function &Fn, ArrayRef<Instruction *> Checks) {
+  const DataLayout &DL = Fn.getParent()->getDataLayout();
+  // instructions may be deleted while in the worklist
+  SmallVector<WeakTrackingVH, 16> Worklist;
+
+  for (Instruction *Check : Checks) {
+    for (User *U : Check->users()) {
+      Worklist.push_back(U);
+    }
+    Check->replaceAllUsesWith(ConstantInt::getTrue(Check->getType()));
+    RecursivelyDeleteTriviallyDeadInstructions(Check);
+  }
+
+  // fold the and chains (and the accumulator updates) of the checks
+  while (!Worklist.empty()) {
+    auto *I = dyn_cast_or_null<Instruction>(Worklist.pop_back_val());
+    if (I == nullptr) {
+      continue;
+    }
+    if (Value *V = simplifyInstruction(I, SimplifyQuery(DL, I))) {
+      for (User *U : I->users()) {
+        Worklist.push_back(U);
+      }
+      I->replaceAllUsesWith(V);
+      RecursivelyDeleteTriviallyDeadInstructions(I);
+    }
+  }
+
+  // the branches on constant conditions do not need the error block anymore
+  for (BasicBlock &BB : Fn) {
+    auto *BI = dyn_cast<BranchInst>(BB.getTerminator());
+    if (BI != nullptr && BI->isConditional() &&
+        isa<ConstantInt>(BI->getCondition())) {
+      ConstantFoldTerminator(&BB, true);
+    }
+  }
+  removeUnreachableBlocks(Fn);
+}
+
+unsigned sweepUnusedFunctions(Module &Md,
+                              function_ref<bool(Function &)> IsRemovable) {
+  auto isUnused = [&](Function &Fn) {
+    if (!IsRemovable(Fn)) {
+      return false;
+    }
+    Fn.removeDeadConstantUsers();
+    return Fn.use_empty();
+  };
+
+  SmallSetVector<Function *, 16> Worklist;
+  for (Function &Fn : Md) {
+    if (isUnused(Fn)) {
+      Worklist.insert(&Fn);
+    }
+  }
+  unsigned Removed = 0;
+  while (!Worklist.empty()) {
+    Function *Fn = Worklist.pop_back_val();
+    // the functions referenced by Fn
+    SmallPtrSet<Function *, 8> Callees;
+    for (Instruction &I : instructions(Fn)) {
+      for (Value *Op : I.operand_values()) {
+        if (auto *Callee = dyn_cast<Function>(Op->stripPointerCasts())) {
+          Callees.insert(Callee);
+        }
+      }
+    }
+    Fn->eraseFromParent();
+    Removed++;
+    for (Function *Callee : Callees) {
+      if (Callee != Fn && isUnused(*Callee)) {
+        Worklist.insert(Callee);
+      }
+    }
+  }
+  return Removed;
+}
+
+uint64_t enumerateProfileBlocks(Module &Md,
+                                const std::map<Value*, StringRef> &FuncAnnotations,
+                                std::vector<BasicBlock*> &BBs) {
+  uint64_t Hash = 0;
+  for (Function &Fn : Md) {
+    if (shouldCompile(Fn, FuncAnnotations)) {
+      Hash = (Hash * 0x100000001b3ULL) ^ xxh3_64bits(Fn.getName()) ^ Fn.size();
+      for (BasicBlock &BB : Fn) {
+        BBs.push_back(&BB);
+      }
+    }
+  }
+  return Hash;
+}
+
+// see Profiling/runtime.c
+struct ProfileHeader {
+  char Magic[8];
+  uint32_t Version;
+  uint32_t NumCounters;
+  uint64_t Hash;
+};
+
+bool readProfile(StringRef FileName, uint64_t &Hash, std::vector<uint64_t> &Counts) {
+  std::ifstream file(FileName.str(), std::ios::binary);
+  ProfileHeader Header;
+  if (!file.read(reinterpret_cast<char *>(&Header), sizeof(Header)) ||
+      std::memcmp(Header.Magic, "ASPISPRF", 8) != 0 || Header.Version != 1) {
+    return false;
+  }
+  Hash = Header.Hash;
+  Counts.resize(Header.NumCounters);
+  return (bool)file.read(reinterpret_cast<char *>(Counts.data()),
+                         Counts.size() * sizeof(uint64_t));
+}
+
+bool loadBlockProfile(Module &Md) {
+  if (ASPISProfile.empty() || Md.getModuleFlag("aspis.profile.cost")) {
+    return false;
+  }
+  uint64_t Hash;
+  std::vector<uint64_t> Counts;
+  if (!readProfile(ASPISProfile, Hash, Counts)) {
+    errs() << "Cannot read the profile " << ASPISProfile << "\n";
+    return false;
+  }
+
+  // the counter id of each block is its position in the enumeration
+  std::map<Value*, StringRef> FuncAnnotations;
+  getFuncAnnotations(Md, FuncAnnotations);
+  std::vector<BasicBlock*> BBs;
+  if (enumerateProfileBlocks(Md, FuncAnnotations, BBs) != Hash ||
+      BBs.size() > Counts.size()) {
+    errs() << "The profile " << ASPISProfile
+           << " was collected on different code, ignoring it\n";
+    return false;
+  }
+
+  LLVMContext &C = Md.getContext();
+  uint64_t TotalCost = 0;
+  for (size_t Id = 0; Id < BBs.size(); Id++) {
+    MDNode *ProfMD = MDNode::get(
+        C, ConstantAsMetadata::get(ConstantInt::get(Type::getInt64Ty(C), Counts[Id])));
+    for (Instruction &I : *BBs[Id]) {
+      I.setMetadata("aspis.prof", ProfMD);
+    }
+    TotalCost += Counts[Id] * BBs[Id]->size();
+  }
+
+  Md.addModuleFlag(Module::Max, "aspis.profile.cost",
+                   ConstantAsMetadata::get(
+                       ConstantInt::get(Type::getInt64Ty(C), TotalCost)));
+  return true;
+}
+
+uint64_t getProfileCount(const BasicBlock &BB) {
+  for (const Instruction &I : BB) {
+    if (MDNode *ProfMD = I.getMetadata("aspis.prof")) {
+      return mdconst::extract<ConstantInt>(ProfMD->getOperand(0))->getZExtValue();
+    }
+  }
+  return 0;
+}
+
+uint64_t getHotBlockThreshold(Module &Md,
+                              std::vector<std::pair<uint64_t, uint64_t>> Costs) {
+  auto *TotalCost = mdconst::extract_or_null<ConstantInt>(
+      Md.getModuleFlag("aspis.profile.cost"));
+  if (TotalCost == nullptr || ASPISOverheadBudget < 0) {
+    return UINT64_MAX;
+  }
+  // the budget is shared by all the passes of the hardening
+  auto *SpentMD = mdconst::extract_or_null<ConstantInt>(
+      Md.getModuleFlag("aspis.profile.spent"));
+  uint64_t Spent = SpentMD ? SpentMD->getZExtValue() : 0;
+  double Budget = TotalCost->getZExtValue() * ASPISOverheadBudget / 100;
+
+  uint64_t Threshold = UINT64_MAX;
+  llvm::sort(Costs);
+  // the blocks with the same count are all checked or all relaxed, so that
+  // the threshold does not relax blocks already charged to the budget
+  for (size_t I = 0; I < Costs.size();) {
+    uint64_t Count = Costs[I].first;
+    uint64_t GroupCost = 0;
+    for (; I < Costs.size() && Costs[I].first == Count; I++) {
+      GroupCost += Count * Costs[I].second;
+    }
+    if (Spent + (double)GroupCost > Budget) {
+      // the blocks that are never executed are always checked
+      Threshold = std::max<uint64_t>(Count, 1);
+      break;
+    }
+    Spent += GroupCost;
+  }
+
+  Md.setModuleFlag(Module::Max, "aspis.profile.spent",
+                   ConstantAsMetadata::get(ConstantInt::get(
+                       Type::getInt64Ty(Md.getContext()), Spent)));
+  return Threshold;
+}
+
+void HardeningLinks::load(Module &Md) {
+  for (unsigned K = 0; K < NumKinds; K++) {
+    Counterparts[K].clear();
+    Sources[K].clear();
+  }
+  NamedMDNode *LinksMD = Md.getNamedMetadata("aspis.links");
+  if (LinksMD == nullptr) {
+    return;
+  }
+  for (MDNode *Link : LinksMD->operands()) {
+    // the links of the erased values have null operands
+    auto *From = mdconst::dyn_extract_or_null<GlobalValue>(Link->getOperand(0));
+    auto *To = mdconst::dyn_extract_or_null<GlobalValue>(Link->getOperand(1));
+    auto *K = mdconst::dyn_extract_or_null<ConstantInt>(Link->getOperand(2));
+    if (From != nullptr && To != nullptr && K != nullptr &&
+        K->getZExtValue() < NumKinds) {
+      Counterparts[K->getZExtValue()][From] = To;
+      Sources[K->getZExtValue()][To] = From;
+    }
+  }
+}
+
+void HardeningLinks::add(GlobalValue &From, GlobalValue &To, Kind K) {
+  Counterparts[K][&From] = &To;
+  Sources[K][&To] = &From;
+  LLVMContext &C = From.getContext();
+  From.getParent()->getOrInsertNamedMetadata("aspis.links")->addOperand(
+      MDNode::get(C, {ConstantAsMetadata::get(&From), ConstantAsMetadata::get(&To),
+                      ConstantAsMetadata::get(
+                          ConstantInt::get(Type::getInt32Ty(C), K))}));
+}
+
+GlobalValue *HardeningLinks::get(const GlobalValue *V, Kind K) const {
+  return Counterparts[K].lookup(V);
+}
+
+GlobalValue *HardeningLinks::getSource(const GlobalValue *V, Kind K) const {
+  return Sources[K].lookup(V);
+}
+
+void recordCompiledFunctions(Module &Md, StringRef Name,
+                             const std::set<Function*> &CompiledFuncs) {
+  NamedMDNode *CompiledMD = Md.getOrInsertNamedMetadata(Name);
+  for (Function *Fn : CompiledFuncs) {
+    CompiledMD->addOperand(
+        MDNode::get(Md.getContext(), ConstantAsMetadata::get(Fn)));
+  }
+}
+
+void getCompiledFunctions(Module &Md, StringRef Name,
+                          std::set<Function*> &CompiledFuncs) {
+  if (NamedMDNode *CompiledMD = Md.getNamedMetadata(Name)) {
+    for (MDNode *Node : CompiledMD->operands()) {
+      if (auto *Fn = mdconst::dyn_extract_or_null<Function>(Node->getOperand(0))) {
+        CompiledFuncs.insert(Fn);
+      }
+    }
+  }
+}
+
+SignatureGenerator::SignatureGenerator(const Function &Fn, StringRef Stream) {
+  // stable hashes, unlike std::hash they do not change across hosts
+  State = ASPISSeed ^ xxh3_64bits(Fn.getName()) ^
+          (xxh3_64bits(Stream) * 0x9e3779b97f4a7c15ULL);
+}
+
+uint64_t SignatureGenerator::next(uint64_t Min, uint64_t Max) {
+  // splitmix64
+  State += 0x9e3779b97f4a7c15ULL;
+  uint64_t Z = State;
+  Z = (Z ^ (Z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  Z = (Z ^ (Z >> 27)) * 0x94d049bb133111ebULL;
+  Z = Z ^ (Z >> 31);
+  return Min + Z % (Max - Min + 1);
+}
@@ -1,6 +1,9 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLFunctionalExtras.h"
 #include "llvm/IR/Attributes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
@@ -18,6 +21,9 @@ extern bool AlternateMemMapEnabled;
 extern std::string DuplicateSecName;
 extern bool DebugEnabled;
 extern bool ProfilingEnabled;
+extern bool ShadowMemEnabled;
+extern long long ShadowMemOffset;
+extern unsigned EDDIReplicas;
 
 // Given a Use U, it returns true if the instruction is a PHI instruction
 bool IsNotAPHINode (Use &U);
@@ -48,4 +54,188 @@ bool isIntrinsicToDuplicate(CallBase *CInstr);
 
 void createFtFuncs(Module &Md);
 
+/**
+ * Positions of the arguments of the _dup version of a function of type FnTy:
+ * the i-th fixed parameter is passed at Orig[i], its duplicate at Dup[i] and,
+ * with -eddi-replicas=3, its third copy at Third[i]. The pointers are passed
+ * only once in shadow memory mode (Dup[i] == Third[i] == -1). The duplicates
+ * and then the third copies precede the originals, or follow each of them
+ * with -alternate-memmap.
+ */
+struct DupArgLayout {
+  SmallVector<int, 8> Orig;
+  SmallVector<int, 8> Dup;
+  SmallVector<int, 8> Third;
+  unsigned NumArgs = 0;
+};
+DupArgLayout getDupArgLayout(FunctionType *FnTy);
+
+/**
+ * Returns the address of the shadow copy of the object pointed by Ptr, at
+ * -eddi-shadow-offset from it (see -eddi-shadow-mem).
+ */
+Value *createShadowPtr(IRBuilder<> &B, Value *Ptr);
+
+/**
+ * Returns a copy of V produced by an empty inline asm statement: no code is
+ * emitted, but the optimizer can no longer see that the copy is equal to V
+ * (e.g. to keep the CFC signatures from being constant-folded).
+ */
+Value *createOpaqueCopy(IRBuilder<> &B, Value *V);
+
+/**
+ * Emits the selection of the constant that SuccValues associates with the
+ * successor SI jumps to, without adding blocks to the CFG. Dense switches read
+ * it from a constant table indexed by the condition (O(1), like a jump table),
+ * the sparse ones use a chain of selects.
+ */
+Value *createSwitchLookup(IRBuilder<> &B, SwitchInst &SI,
+                          const std::map<BasicBlock *, Constant *> &SuccValues);
+
+/**
+ * Removes the EDDI consistency checks in Checks (tagged with `aspis.check`),
+ * replacing them with `true`. The and chains, accumulator updates and branches
+ * to the error blocks left useless are folded, and the unreachable blocks are
+ * removed from Fn.
+ */
+void removeConsistencyChecks(Function &Fn, ArrayRef<Instruction*> Checks);
+
+/**
+ * Erases the functions of Md left without users for which IsRemovable returns
+ * true. Erasing a function may leave the functions it referenced without
+ * users, so only these are checked again. Dead constant users (e.g. casts) do
+ * not keep a function alive. Returns the number of erased functions.
+ */
+unsigned sweepUnusedFunctions(Module &Md,
+                              function_ref<bool(Function &)> IsRemovable);
+
+/**
+ * Lists in BBs the basic blocks counted by aspis-insert-check-profile, in the
+ * order of their counter ids (the functions to compile, in module order).
+ * Returns a hash of the names and sizes of the functions, used to match a
+ * profile with the code it was collected on.
+ */
+uint64_t enumerateProfileBlocks(Module &Md,
+                                const std::map<Value*, StringRef> &FuncAnnotations,
+                                std::vector<BasicBlock*> &BBs);
+
+/**
+ * Reads a profile written by the runtime of aspis-insert-check-profile
+ * (Profiling/runtime.c): a header with the magic "ASPISPRF", the version, the
+ * number of counters and the hash of the profiled blocks, followed by one 64
+ * bit count for each counter id, in the byte order of the host. Returns false
+ * if the file cannot be read or is not a profile.
+ */
+bool readProfile(StringRef FileName, uint64_t &Hash, std::vector<uint64_t> &Counts);
+
+/**
+ * Execution profile of the basic blocks (-aspis-profile), collected with
+ * aspis-insert-check-profile on the unhardened code. loadBlockProfile()
+ * attaches the count of each block to its instructions (`aspis.prof`), so that
+ * it follows them through the transformations of the hardening, and records
+ * the instructions executed by the unhardened program as the reference of
+ * -aspis-overhead-budget. Returns false if there is no profile to load.
+ */
+bool loadBlockProfile(Module &Md);
+
+// Returns the execution count of BB in the profile, 0 if unknown
+uint64_t getProfileCount(const BasicBlock &BB);
+
+/**
+ * Applies -aspis-overhead-budget to the checks a pass is about to add. Costs
+ * holds, for each block to harden, its execution count and the instructions
+ * added by its checks at each execution. The checks are kept starting from the
+ * coldest blocks until the budget left by the passes run before is used up;
+ * the blocks with the same count are kept or relaxed together.
+ * @returns the minimum count of the blocks whose checks must be relaxed, i.e.
+ * UINT64_MAX when there is no profile or no budget
+ */
+uint64_t getHotBlockThreshold(Module &Md,
+                              std::vector<std::pair<uint64_t, uint64_t>> Costs);
+
+/**
+ * Links between the functions and globals of the program and their
+ * counterparts created by the hardening: the copies with duplicated arguments
+ * or data (Dup), the functions returning by reference (Ret, see FuncRetToRef),
+ * the unhardened copies (Original) and the third copies of the globals with
+ * -eddi-replicas=3 (Third). The links are recorded in the named metadata
+ * `aspis.links`, so that they are handed from a pass to the next (and kept by
+ * llvm-link), and each pass resolves them through the table built once by
+ * load().
+ */
+class HardeningLinks {
+  public:
+    enum Kind { Dup, Ret, Original, Third, NumKinds };
+
+    // Builds the table from the links recorded in Md
+    void load(Module &Md);
+    // Records that To is the Kind counterpart of From, in the table and in Md
+    void add(GlobalValue &From, GlobalValue &To, Kind K);
+    // Returns the Kind counterpart of V, nullptr if it has none
+    GlobalValue *get(const GlobalValue *V, Kind K) const;
+    // Returns the value whose Kind counterpart is V, nullptr if none
+    GlobalValue *getSource(const GlobalValue *V, Kind K) const;
+
+  private:
+    DenseMap<const GlobalValue*, GlobalValue*> Counterparts[NumKinds];
+    DenseMap<const GlobalValue*, GlobalValue*> Sources[NumKinds];
+};
+
+/**
+ * Records in Md the functions hardened by a pass (e.g. "aspis.eddi.compiled"),
+ * for the passes run after it.
+ */
+void recordCompiledFunctions(Module &Md, StringRef Name,
+                             const std::set<Function*> &CompiledFuncs);
+void getCompiledFunctions(Module &Md, StringRef Name,
+                          std::set<Function*> &CompiledFuncs);
+
+/**
+ * Answers reachability queries between the basic blocks of a function in
+ * constant time. The strongly connected components (SCCs) of the CFG are
+ * computed once, and the transitive closure of the condensed graph is stored
+ * as one bitset per SCC.
+ *
+ * Blocks carved out of an analyzed block (e.g. with splitBasicBlockBefore)
+ * can be registered with recordSplit() instead of recomputing the analysis:
+ * they inherit the SCC of the block they come from, hence pieces of the same
+ * block are conservatively considered reachable from each other.
+ */
+class BlockReachability {
+  private:
+    // SCC index of each analyzed block
+    DenseMap<BasicBlock*, unsigned> SCCOf;
+    // Reaches[i] has bit j set if SCC j is reachable from SCC i
+    std::vector<BitVector> Reaches;
+
+  public:
+    // Functions with more SCCs than this are not analyzed (isKnown() is
+    // always false), as the closure takes quadratic memory.
+    static const unsigned MaxSCCs = 16384;
+
+    void compute(Function &Fn);
+    void recordSplit(BasicBlock &NewBB, BasicBlock &OldBB);
+    bool isKnown(BasicBlock &BB) const;
+    // Returns true if To can be reached from From. Both blocks must be known.
+    bool isReachable(BasicBlock &From, BasicBlock &To) const;
+};
+
+/**
+ * Deterministic generator of the random values used by the control-flow
+ * checking passes. The values drawn for a function depend only on the seed
+ * (-aspis-seed), on the name of the function, on the Stream they are drawn for
+ * and on how many values have been drawn before, so the hardened code is
+ * reproducible and the signatures of a function do not change when the rest
+ * of the program does.
+ */
+class SignatureGenerator {
+  private:
+    uint64_t State;
+
+  public:
+    SignatureGenerator(const Function &Fn, StringRef Stream);
+    // Returns the next value, uniformly distributed in [Min, Max]
+    uint64_t next(uint64_t Min, uint64_t Max);
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,256 @@
+"""
+Overhead benchmark of the ASPIS hardening configurations.
+
+Builds the benchmark programs (mibench and malardalen by default) with every
+combination of data protection and control-flow checking and records, for each
+build:
+- the wall time of each pass of the aspis<...> pipeline (opt -time-passes);
+- the number of IR instructions before and after the hardening;
+- the size of the .text, .data and .dup_data sections of the binary;
+- the cycles taken by the binary (perf stat), when perf is available.
+
+The results are written as JSON and CSV and can be compared against a baseline
+saved by a previous run, failing when an overhead grows more than allowed.
+
+Usage (from the testing directory, after building ASPIS):
+    python benchmark.py --save-baseline config/benchmark_baseline.json
+    python benchmark.py --baseline config/benchmark_baseline.json
+"""
+import argparse
+import csv
+import json
+import os
+import re
+import shutil
+import statistics
+import subprocess
+import sys
+import time
+
+import tomllib
+
+ASPIS_SCRIPT = "../aspis.sh"
+ASPIS_BUILD_DIR = "../build/passes"
+TEST_DIR = "./tests"
+BUILD_DIR = "./build/benchmark"
+
+DATA_TECHNIQUES = ["no-dup", "eddi", "seddi", "fdsc"]
+CFC_TECHNIQUES = ["no-cfc", "cfcss", "rasm", "racfed", "inter-rasm"]
+SECTIONS = [".text", ".data", ".dup_data"]
+
+# metrics compared with --tolerance, the others with --time-tolerance
+EXACT_METRICS = ["ir_before", "ir_after"] + [f"size{s}" for s in SECTIONS]
+TIMED_METRICS = ["pass_time", "cycles"]
+
+def load_llvm_bin():
+  with open("config/llvm.toml", "rb") as f:
+    return tomllib.load(f)["llvm_bin"]
+
+def load_programs(tests_files, suites):
+  """Returns the <name, source file> couples of the tests in the given suites,
+  skipping the variants of the same source file."""
+  programs = {}
+  for tests_file in tests_files:
+    with open(tests_file, "rb") as f:
+      for test in tomllib.load(f).get("tests", []):
+        source = test["source_file"]
+        # the benchmarks are single files
+        if isinstance(source, list):
+          continue
+        if source.split("/")[1] in suites and source not in programs.values():
+          programs[test["test_name"]] = source
+  return programs
+
+def run(command, cwd=None):
+  process = subprocess.run(command, cwd=cwd, text=True, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+  if process.returncode != 0:
+    raise RuntimeError(f"{' '.join(command)} failed:\n{process.stderr}")
+  return process
+
+def count_ir_instructions(ll_file):
+  """Counts the instructions in the function bodies of a textual IR file."""
+  count = 0
+  in_function = False
+  with open(ll_file) as f:
+    for line in f:
+      if line.startswith("define "):
+        in_function = True
+      elif line.startswith("}"):
+        in_function = False
+      elif in_function and line.startswith("  ") and not line.lstrip().startswith(";"):
+        count += 1
+  return count
+
+def parse_pass_times(report):
+  """Returns the wall time of each pass from the output of opt -time-passes."""
+  times = {}
+  in_report = False
+  for line in report.splitlines():
+    if "Pass execution timing report" in line:
+      in_report = True
+      continue
+    if not in_report:
+      continue
+    columns = list(re.finditer(r"([\d.]+) \(\s*[\d.]+%\)", line))
+    if not columns:
+      continue
+    name = re.sub(r"^\s*\d+\s+", " ", line[columns[-1].end():]).strip()
+    if name == "Total":
+      in_report = False
+      continue
+    times[name] = times.get(name, 0.0) + float(columns[-1].group(1))
+  return times
+
+def section_sizes(llvm_bin, binary):
+  sizes = {s: 0 for s in SECTIONS}
+  output = run([os.path.join(llvm_bin, "llvm-size"), "-A", binary]).stdout
+  for line in output.splitlines():
+    fields = line.split()
+    if len(fields) >= 2 and fields[0] in sizes:
+      sizes[fields[0]] = int(fields[1])
+  return sizes
+
+def measure_cycles(binary, runs):
+  """Median of the cycles reported by perf stat, None if perf is not usable."""
+  if shutil.which("perf") is None:
+    return None
+  samples = []
+  for _ in range(runs):
+    process = subprocess.run(["perf", "stat", "-x,", "-e", "cycles", binary],
+                             text=True, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    match = re.search(r"^(\d+),[^,]*,cycles", process.stderr, re.MULTILINE)
+    if process.returncode != 0 or match is None:
+      return None
+    samples.append(int(match.group(1)))
+  return statistics.median(samples)
+
+def frontend(llvm_bin, source, ll_file):
+  """Same front-end invocation of aspis.sh."""
+  clang = os.path.join(llvm_bin, "clang")
+  run([clang, source, "-S", "-emit-llvm", "-O0", "-Xclang", "-disable-O0-optnone", "-o", ll_file])
+
+def harden(llvm_bin, pipeline, ll_file, out_file):
+  """Applies the aspis<...> pipeline, returning the wall time of each pass."""
+  opt = os.path.join(llvm_bin, "opt")
+  plugin = os.path.abspath(os.path.join(ASPIS_BUILD_DIR, "libASPIS.so"))
+  process = run([opt, f"-load-pass-plugin={plugin}", f"-passes=aspis<{pipeline}>", "-time-passes",
+                 ll_file, "-S", "-o", out_file])
+  return parse_pass_times(process.stderr)
+
+def build(llvm_bin, source, data, cfc, build_dir, binary):
+  command = [ASPIS_SCRIPT, "--llvm-bin", llvm_bin, f"--{data}", f"--{cfc}", source,
+             "-o", binary, "--build-dir", build_dir]
+  run(command)
+  return os.path.join(build_dir, binary)
+
+def benchmark_program(llvm_bin, name, source, args):
+  results = []
+  program_dir = os.path.join(BUILD_DIR, name)
+  os.makedirs(program_dir, exist_ok=True)
+  base_ll = os.path.join(program_dir, "base.ll")
+  frontend(llvm_bin, source, base_ll)
+  ir_before = count_ir_instructions(base_ll)
+
+  for data in DATA_TECHNIQUES:
+    for cfc in CFC_TECHNIQUES:
+      config = f"{data};{cfc}"
+      config_dir = os.path.join(program_dir, f"{data}_{cfc}")
+      os.makedirs(config_dir, exist_ok=True)
+      hardened_ll = os.path.join(config_dir, "hardened.ll")
+
+      start = time.perf_counter()
+      pass_times = harden(llvm_bin, config, base_ll, hardened_ll)
+      pipeline_time = time.perf_counter() - start
+
+      binary = build(llvm_bin, source, data, cfc, config_dir, f"{name}.out")
+      result = {
+        "program": name,
+        "config": config,
+        "ir_before": ir_before,
+        "ir_after": count_ir_instructions(hardened_ll),
+        "pass_time": sum(pass_times.values()),
+        "pipeline_time": pipeline_time,
+        "cycles": measure_cycles(binary, args.runs),
+        "pass_times": pass_times,
+      }
+      for section, size in section_sizes(llvm_bin, binary).items():
+        result[f"size{section}"] = size
+      print(f"{name:>28} {config:>18} {result['ir_after']:>8} {result['size.text']:>8} "
+            f"{result['pass_time']:>8.3f} {result['cycles'] if result['cycles'] is not None else '-':>12}")
+      results.append(result)
+  return results
+
+def write_results(results, output_dir):
+  os.makedirs(output_dir, exist_ok=True)
+  with open(os.path.join(output_dir, "benchmark.json"), "w") as f:
+    json.dump(results, f, indent=2)
+  columns = ["program", "config", "ir_before", "ir_after", "pass_time", "pipeline_time", "cycles"] + \
+            [f"size{s}" for s in SECTIONS]
+  with open(os.path.join(output_dir, "benchmark.csv"), "w", newline="") as f:
+    writer = csv.DictWriter(f, fieldnames=columns, extrasaction="ignore")
+    writer.writeheader()
+    writer.writerows(results)
+  # one row per <program, configuration, pass>
+  with open(os.path.join(output_dir, "benchmark_passes.csv"), "w", newline="") as f:
+    writer = csv.writer(f)
+    writer.writerow(["program", "config", "pass", "wall_time"])
+    for result in results:
+      for pass_name, wall_time in result["pass_times"].items():
+        writer.writerow([result["program"], result["config"], pass_name, wall_time])
+
+def compare(results, baseline, tolerance, time_tolerance):
+  """Returns the metrics that grew more than allowed with respect to baseline."""
+  reference = {(r["program"], r["config"]): r for r in baseline}
+  regressions = []
+  for result in results:
+    old = reference.get((result["program"], result["config"]))
+    if old is None:
+      continue
+    for metric in EXACT_METRICS + TIMED_METRICS:
+      allowed = tolerance if metric in EXACT_METRICS else time_tolerance
+      if result.get(metric) is None or not old.get(metric):
+        continue
+      growth = result[metric] / old[metric] - 1
+      if growth > allowed:
+        regressions.append((result["program"], result["config"], metric, old[metric], result[metric], growth))
+  return regressions
+
+def main():
+  parser = argparse.ArgumentParser(description="ASPIS overhead benchmark")
+  parser.add_argument("--tests-file", nargs="+", default=["config/tests.toml"])
+  parser.add_argument("--suites", nargs="+", default=["mibench", "malardalen"],
+                      help="Directories of tests/c whose programs are benchmarked")
+  parser.add_argument("--runs", type=int, default=5, help="Runs of each binary under perf stat")
+  parser.add_argument("--llvm-bin", default=None, help="Overrides llvm_bin of config/llvm.toml")
+  parser.add_argument("--output-dir", default=BUILD_DIR)
+  parser.add_argument("--baseline", default=None, help="JSON results of a previous run to compare with")
+  parser.add_argument("--save-baseline", default=None, help="Also store the results as a baseline")
+  parser.add_argument("--tolerance", type=float, default=0.02,
+                      help="Allowed growth of the IR and section sizes")
+  parser.add_argument("--time-tolerance", type=float, default=0.25,
+                      help="Allowed growth of the pass times and cycles")
+  args = parser.parse_args()
+
+  llvm_bin = args.llvm_bin if args.llvm_bin else load_llvm_bin()
+  programs = load_programs(args.tests_file, args.suites)
+
+  print(f"{'program':>28} {'config':>18} {'IR':>8} {'.text':>8} {'time [s]':>8} {'cycles':>12}")
+  results = []
+  for name, source in programs.items():
+    results.extend(benchmark_program(llvm_bin, name, os.path.join(TEST_DIR, source), args))
+
+  write_results(results, args.output_dir)
+  if args.save_baseline:
+    with open(args.save_baseline, "w") as f:
+      json.dump(results, f, indent=2)
+
+  if args.baseline:
+    with open(args.baseline) as f:
+      regressions = compare(results, json.load(f), args.tolerance, args.time_tolerance)
+    for program, config, metric, old, new, growth in regressions:
+      print(f"Regression: {program} [{config}] {metric}: {old} -> {new} (+{growth:.1%})")
+    if regressions:
+      sys.exit(1)
+
+if __name__ == "__main__":
+  main()
@@ -0,0 +1,148 @@
+"""
+Compile-time scaling benchmark for the ASPIS passes.
+
+Generates synthetic LLVM IR modules of increasing size, applies a single ASPIS
+pass to each of them with `opt` and reports the time taken, together with the
+log-log slope between two consecutive sizes (~1.0 means linear scaling).
+
+Usage (from the testing directory, after building ASPIS):
+    python compile_time.py --pass eddi --sizes 1000 10000 100000 1000000
+    python compile_time.py --pass cfcss rasm racfed --block-size 10 --max-slope 1.3
+"""
+import argparse
+import math
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+import tomllib
+
+ASPIS_BUILD_DIR = "../build/passes"
+
+# <pass name>: (<plugin>, <pipeline>)
+PASSES = {
+  "eddi": ("libEDDI.so", "eddi-verify"),
+  "seddi": ("libSEDDI.so", "eddi-verify"),
+  "fdsc": ("libFDSC.so", "eddi-verify"),
+  "cfcss": ("libCFCSS.so", "cfcss-verify"),
+  "rasm": ("libRASM.so", "rasm-verify"),
+  "inter-rasm": ("libINTER_RASM.so", "rasm-verify"),
+  "racfed": ("libRACFED.so", "racfed-verify"),
+}
+
+def load_llvm_bin():
+  with open("config/llvm.toml", "rb") as f:
+    return tomllib.load(f)["llvm_bin"]
+
+def generate_function(idx, num_instructions, block_size):
+  """Emits a function made of `num_instructions` instructions, split into
+  basic blocks of `block_size` instructions, containing arithmetic, loads,
+  stores, branches and a call to the previous function."""
+  lines = [f"define void @fn{idx}(i32 %a, ptr %out) {{", "entry:", "  %x = alloca i32", "  store i32 %a, ptr %x"]
+  prev = "%a"
+  emitted = 2
+  blk = 0
+  while emitted < num_instructions:
+    if emitted % block_size == 0:
+      cond = f"%c{emitted}"
+      lines.append(f"  {cond} = icmp slt i32 {prev}, {emitted}")
+      lines.append(f"  br i1 {cond}, label %bb{blk}, label %bb{blk}")
+      lines.append(f"bb{blk}:")
+      blk += 1
+      emitted += 2
+      continue
+    name = f"%v{emitted}"
+    kind = emitted % 4
+    if kind == 0:
+      lines.append(f"  {name} = load i32, ptr %x")
+    elif kind == 1:
+      lines.append(f"  {name} = add i32 {prev}, {emitted}")
+    elif kind == 2:
+      lines.append(f"  {name} = mul i32 {prev}, 3")
+    else:
+      lines.append(f"  store i32 {prev}, ptr %x")
+      emitted += 1
+      continue
+    prev = name
+    emitted += 1
+  if idx > 0:
+    lines.append(f"  call void @fn{idx - 1}(i32 {prev}, ptr %out)")
+  lines.append(f"  store i32 {prev}, ptr %out")
+  lines.append("  ret void")
+  lines.append("}")
+  return "\n".join(lines)
+
+def generate_module(path, num_instructions, fn_size, block_size):
+  num_functions = max(1, num_instructions // fn_size)
+  with open(path, "w") as f:
+    for idx in range(num_functions):
+      f.write(generate_function(idx, fn_size, block_size))
+      f.write("\n\n")
+  return num_functions
+
+def run_pass(opt, plugin, pipeline, input_file, cwd):
+  command = [opt, f"-load-pass-plugin={plugin}", f"-passes={pipeline}", input_file, "-disable-output"]
+  start = time.perf_counter()
+  process = subprocess.run(command, cwd=cwd, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True)
+  elapsed = time.perf_counter() - start
+  if process.returncode != 0:
+    raise RuntimeError(f"{' '.join(command)} failed:\n{process.stderr}")
+  return elapsed
+
+def benchmark(opt, pass_name, args):
+  """Runs pass_name on the synthetic modules, prints the results and returns
+  False if the scaling is worse than args.max_slope."""
+  plugin_name, pipeline = PASSES[pass_name]
+  plugin = os.path.abspath(os.path.join(ASPIS_BUILD_DIR, plugin_name))
+
+  results = []
+  with tempfile.TemporaryDirectory() as tmp:
+    for size in sorted(args.sizes):
+      input_file = os.path.join(tmp, f"synthetic_{size}.ll")
+      num_functions = generate_module(input_file, size, min(args.fn_size, size), args.block_size)
+      elapsed = run_pass(opt, plugin, pipeline, input_file, tmp)
+      results.append((size, num_functions, elapsed))
+
+  print(f"[{pass_name}]")
+  print(f"{'instructions':>12} {'functions':>10} {'time [s]':>10} {'us/instr':>10} {'slope':>6}")
+  failed = False
+  for i, (size, num_functions, elapsed) in enumerate(results):
+    slope = ""
+    if i > 0:
+      prev_size, _, prev_elapsed = results[i - 1]
+      if prev_elapsed > 0 and elapsed > 0:
+        value = math.log(elapsed / prev_elapsed) / math.log(size / prev_size)
+        slope = f"{value:.2f}"
+        if args.max_slope is not None and value > args.max_slope:
+          failed = True
+    print(f"{size:>12} {num_functions:>10} {elapsed:>10.3f} {elapsed / size * 1e6:>10.2f} {slope:>6}")
+
+  if failed:
+    print(f"Scaling of {pass_name} is worse than the allowed slope {args.max_slope}")
+  return not failed
+
+def main():
+  parser = argparse.ArgumentParser(description="ASPIS compile-time scaling benchmark")
+  parser.add_argument("--pass", dest="pass_names", choices=PASSES.keys(), nargs="+", default=["eddi"])
+  parser.add_argument("--sizes", type=int, nargs="+", default=[1000, 10000, 100000, 1000000],
+                      help="Number of IR instructions of each synthetic module")
+  parser.add_argument("--fn-size", type=int, default=1000, help="Instructions per function")
+  parser.add_argument("--block-size", type=int, default=50, help="Instructions per basic block")
+  parser.add_argument("--llvm-bin", default=None, help="Overrides llvm_bin of config/llvm.toml")
+  parser.add_argument("--max-slope", type=float, default=None,
+                      help="Fail if the log-log slope between two sizes exceeds this value")
+  args = parser.parse_args()
+
+  llvm_bin = args.llvm_bin if args.llvm_bin else load_llvm_bin()
+  opt = os.path.join(llvm_bin, "opt")
+
+  passed = True
+  for pass_name in args.pass_names:
+    passed = benchmark(opt, pass_name, args) and passed
+  if not passed:
+    sys.exit(1)
+
+if __name__ == "__main__":
+  main()
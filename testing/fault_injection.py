@@ -0,0 +1,208 @@
+"""
+Software fault injection campaign for the ASPIS hardening configurations.
+
+For each configuration, the program is built with `aspis.sh --fault-injection`
+(see passes/FaultInjection), profiled to find the executed injection sites, and
+then run once per injected fault, flipping a single bit of an SSA value, of a
+load/store address or of a branch condition. The runs are spread over all the
+cores and each one is classified as:
+- masked: same output and exit code of the fault-free run;
+- detected-data: detected by DataCorruption_Handler;
+- detected-cfc: detected by SigMismatch_Handler;
+- sdc: silent data corruption, i.e. the program ends with a different output;
+- crash: the program is killed by a signal or fails;
+- hang: the program exceeds the time limit.
+
+The slowdown of each configuration is measured on a build without the fault
+injection instrumentation, so that the detection coverage can be weighed
+against the overhead. Everything runs on the local machine.
+
+Usage (from the testing directory, after building ASPIS):
+    python fault_injection.py tests/c/malardalen/matmult.c --configs "--eddi --cfcss" "--seddi --rasm" --injections 2000
+"""
+import argparse
+import concurrent.futures
+import csv
+import json
+import os
+import random
+import statistics
+import subprocess
+import time
+
+import tomllib
+
+ASPIS_SCRIPT = "../aspis.sh"
+BUILD_DIR = "./build/fault_injection"
+
+# see passes/FaultInjection/runtime.c
+EXIT_DATA_CORRUPTION = 97
+EXIT_SIG_MISMATCH = 98
+INJECTED_MARKER = "ASPIS_FI: injected"
+
+OUTCOMES = ["masked", "detected-data", "detected-cfc", "sdc", "crash", "hang", "not-activated"]
+
+def load_llvm_bin():
+  with open("config/llvm.toml", "rb") as f:
+    return tomllib.load(f)["llvm_bin"]
+
+def build(llvm_bin, source, flags, build_dir, fault_injection, fi_sites=None):
+  os.makedirs(build_dir, exist_ok=True)
+  command = [ASPIS_SCRIPT, "--llvm-bin", llvm_bin] + flags.split() + [source, "-o", "program.out",
+             "--build-dir", build_dir]
+  if fault_injection:
+    command.append("--fault-injection")
+    if fi_sites:
+      command.append(f"--fi-sites={fi_sites}")
+  process = subprocess.run(command, text=True, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+  if process.returncode != 0:
+    raise RuntimeError(f"{' '.join(command)} failed:\n{process.stderr}")
+  return os.path.join(build_dir, "program.out")
+
+def run_binary(binary, env=None, timeout=None):
+  full_env = dict(os.environ)
+  full_env.update(env or {})
+  start = time.perf_counter()
+  try:
+    process = subprocess.run([binary], env=full_env, text=True, stdout=subprocess.PIPE,
+                             stderr=subprocess.PIPE, timeout=timeout, errors="replace")
+  except subprocess.TimeoutExpired:
+    return None, None, None, timeout
+  return process.returncode, process.stdout, process.stderr, time.perf_counter() - start
+
+def median_time(binary, runs):
+  times = []
+  for _ in range(runs):
+    returncode, _, stderr, elapsed = run_binary(binary)
+    if returncode != 0:
+      raise RuntimeError(f"{binary} failed:\n{stderr}")
+    times.append(elapsed)
+  return statistics.median(times)
+
+def load_sites(build_dir):
+  with open(os.path.join(build_dir, "fault_injection_sites.csv")) as f:
+    return {int(row["id"]): row for row in csv.DictReader(f)}
+
+def profile_sites(binary, build_dir):
+  """Returns the number of executions of each site in a fault-free run."""
+  profile_file = os.path.abspath(os.path.join(build_dir, "fault_injection_profile.csv"))
+  returncode, stdout, stderr, _ = run_binary(binary, {"ASPIS_FI_PROFILE": profile_file})
+  if returncode != 0:
+    raise RuntimeError(f"{binary} failed without faults:\n{stderr}")
+  counts = {}
+  with open(profile_file) as f:
+    for line in f:
+      site, count = line.strip().split(",")
+      counts[int(site)] = int(count)
+  return counts, returncode, stdout
+
+def sample_faults(sites, counts, injections, rng):
+  """Samples the faults uniformly over the dynamic instances of the sites."""
+  executed = [site for site in counts if int(sites[site]["bits"]) > 0]
+  weights = [counts[site] for site in executed]
+  faults = []
+  for site in rng.choices(executed, weights=weights, k=injections):
+    faults.append((site, rng.randrange(int(sites[site]["bits"])), rng.randint(1, counts[site])))
+  return faults
+
+def classify(result, golden_returncode, golden_stdout):
+  returncode, stdout, stderr, _ = result
+  if returncode is None:
+    return "hang"
+  if INJECTED_MARKER not in stderr:
+    return "not-activated"
+  if returncode == EXIT_DATA_CORRUPTION:
+    return "detected-data"
+  if returncode == EXIT_SIG_MISMATCH:
+    return "detected-cfc"
+  if returncode < 0 or returncode >= 128:
+    return "crash"
+  if returncode == golden_returncode and stdout == golden_stdout:
+    return "masked"
+  if returncode == golden_returncode:
+    return "sdc"
+  return "crash"
+
+def run_campaign(binary, faults, golden, timeout, jobs):
+  golden_returncode, golden_stdout = golden
+  def inject(fault):
+    site, bit, occurrence = fault
+    env = {"ASPIS_FI_SITE": str(site), "ASPIS_FI_BIT": str(bit), "ASPIS_FI_OCCURRENCE": str(occurrence)}
+    return classify(run_binary(binary, env, timeout), golden_returncode, golden_stdout)
+  with concurrent.futures.ThreadPoolExecutor(max_workers=jobs) as executor:
+    return list(executor.map(inject, faults))
+
+def summarize(config, outcomes, slowdown):
+  counts = {outcome: outcomes.count(outcome) for outcome in OUTCOMES}
+  activated = len(outcomes) - counts["not-activated"]
+  detected = counts["detected-data"] + counts["detected-cfc"]
+  # share of the faults that are not masked and are detected
+  unmasked = activated - counts["masked"]
+  coverage = detected / unmasked if unmasked > 0 else 1.0
+  return {
+    "config": config,
+    "injections": len(outcomes),
+    **counts,
+    "coverage": coverage,
+    "sdc_rate": counts["sdc"] / activated if activated > 0 else 0.0,
+    "slowdown": slowdown,
+    "coverage_per_slowdown": coverage / slowdown if slowdown > 0 else None,
+  }
+
+def main():
+  parser = argparse.ArgumentParser(description="ASPIS fault injection campaign")
+  parser.add_argument("source", help="Program to harden and inject")
+  parser.add_argument("--configs", nargs="+", default=["--eddi --cfcss"],
+                      help="aspis.sh flags of each configuration to evaluate")
+  parser.add_argument("--injections", type=int, default=1000, help="Faults injected per configuration")
+  parser.add_argument("--jobs", type=int, default=os.cpu_count(), help="Parallel runs")
+  parser.add_argument("--fi-sites", default=None, help="Kinds of sites: value, address, branch (default: all)")
+  parser.add_argument("--timeout-factor", type=float, default=10.0,
+                      help="A run hangs when it takes this many times the fault-free run")
+  parser.add_argument("--timing-runs", type=int, default=5, help="Runs to measure the slowdown")
+  parser.add_argument("--seed", type=int, default=0)
+  parser.add_argument("--llvm-bin", default=None, help="Overrides llvm_bin of config/llvm.toml")
+  parser.add_argument("--output-dir", default=BUILD_DIR)
+  args = parser.parse_args()
+
+  llvm_bin = args.llvm_bin if args.llvm_bin else load_llvm_bin()
+  rng = random.Random(args.seed)
+  os.makedirs(args.output_dir, exist_ok=True)
+
+  baseline = build(llvm_bin, args.source, "--no-dup --no-cfc", os.path.join(args.output_dir, "baseline"), False)
+  baseline_time = median_time(baseline, args.timing_runs)
+
+  summaries = []
+  with open(os.path.join(args.output_dir, "injections.csv"), "w", newline="") as f:
+    writer = csv.writer(f)
+    writer.writerow(["config", "site", "kind", "fn_name", "bit", "occurrence", "outcome"])
+    for i, config in enumerate(args.configs):
+      config_dir = os.path.abspath(os.path.join(args.output_dir, f"config{i}"))
+      hardened = build(llvm_bin, args.source, config, os.path.join(config_dir, "timing"), False)
+      slowdown = median_time(hardened, args.timing_runs) / baseline_time
+
+      fi_dir = os.path.join(config_dir, "injection")
+      binary = build(llvm_bin, args.source, config, fi_dir, True, args.fi_sites)
+      sites = load_sites(fi_dir)
+      counts, golden_returncode, golden_stdout = profile_sites(binary, fi_dir)
+      _, _, _, golden_time = run_binary(binary)
+      timeout = max(1.0, golden_time * args.timeout_factor)
+
+      faults = sample_faults(sites, counts, args.injections, rng)
+      outcomes = run_campaign(binary, faults, (golden_returncode, golden_stdout), timeout, args.jobs)
+      for (site, bit, occurrence), outcome in zip(faults, outcomes):
+        writer.writerow([config, site, sites[site]["kind"], sites[site]["fn_name"], bit, occurrence, outcome])
+      summaries.append(summarize(config, outcomes, slowdown))
+
+  with open(os.path.join(args.output_dir, "summary.json"), "w") as f:
+    json.dump(summaries, f, indent=2)
+
+  print(f"{'config':>24} {'masked':>7} {'det-data':>8} {'det-cfc':>8} {'sdc':>6} {'crash':>6} {'hang':>6} "
+        f"{'coverage':>9} {'slowdown':>9} {'cov/slow':>9}")
+  for s in summaries:
+    print(f"{s['config']:>24} {s['masked']:>7} {s['detected-data']:>8} {s['detected-cfc']:>8} {s['sdc']:>6} "
+          f"{s['crash']:>6} {s['hang']:>6} {s['coverage']:>9.1%} {s['slowdown']:>9.2f} "
+          f"{s['coverage_per_slowdown']:>9.3f}")
+
+if __name__ == "__main__":
+  main()
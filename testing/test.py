@@ -1,4 +1,6 @@
+import csv
 import os
+import re
 import subprocess
 import pytest
 
@@ -38,7 +40,7 @@ def compile_with_aspis(source_file, output_file, options, llvm_bin, build_dir):
   stdout, stderr, exit_code = run_command(command)
   if exit_code != 0:
     raise RuntimeError(f"[{output_file}] Compilation failed: {stderr}")
-  return stdout
+  return stdout, stderr
 
 # Compile without ASPIS to get expected output
 def compile_without_aspis(source_file, output_file, llvm_bin, build_dir):
@@ -58,6 +60,65 @@ def execute_binary(local_build_dir, test_name):
     raise RuntimeError(f"[{test_name}] Execution failed: {stderr}")
   return stdout.strip()
 
+def check_masked_faults(local_build_dir, test_name, expected_output, max_faults):
+  """Flips a bit of the third copies kept by --eddi-replicas=3 (the values
+  named *_tmr, except the pointers) in a binary built with --fault-injection,
+  one site per run, and checks that each fault is outvoted: the output does
+  not change and the error handler is not reached."""
+  binary = f"./{local_build_dir}/{test_name}.out"
+  profile_file = os.path.abspath(os.path.join(local_build_dir, "fault_injection_profile.csv"))
+  _, stderr, exit_code = run_command(f"ASPIS_FI_PROFILE={profile_file} {binary}")
+  assert exit_code == 0, f"Test {test_name} failed without faults: {stderr}"
+  with open(profile_file) as f:
+    executed = {int(line.split(",")[0]) for line in f if line.strip()}
+  with open(os.path.join(local_build_dir, "fault_injection_sites.csv")) as f:
+    sites = [site for site in csv.DictReader(f)
+             if site["kind"] == "value" and re.search(r"_tmr\d*$", site["name"])
+             and site["type"] != "ptr" and int(site["id"]) in executed]
+  assert sites, f"Test {test_name} failed: no third copy executed"
+  for site in sites[:max_faults]:
+    stdout, stderr, exit_code = run_command(f"ASPIS_FI_SITE={site['id']} ASPIS_FI_BIT=0 {binary}")
+    assert "ASPIS_FI: injected" in stderr, f"Test {test_name} failed: site {site['id']} not injected"
+    assert exit_code == 0 and "ASPIS_FI: detected" not in stderr, \
+      f"Test {test_name} failed: fault at site {site['id']} ({site['name']}) not masked: {stderr}"
+    assert stdout.strip() == expected_output, \
+      f"Test {test_name} failed: fault at site {site['id']} ({site['name']}) changed the output: {stdout}"
+
+def stats_enabled(llvm_bin):
+  """True if opt collects the statistics printed by -stats, i.e. if LLVM was
+  built with assertions or with -DLLVM_FORCE_ENABLE_STATS=ON."""
+  stdout, _, exit_code = run_command(f"{llvm_bin}/llvm-config --assertion-mode")
+  if exit_code == 0 and stdout.strip() == "ON":
+    return True
+  headers = [os.path.join(llvm_bin, "../include/llvm/Config/llvm-config.h")]
+  stdout, _, exit_code = run_command(f"{llvm_bin}/llvm-config --includedir")
+  if exit_code == 0:
+    headers.append(os.path.join(stdout.strip(), "llvm/Config/llvm-config.h"))
+  for header in headers:
+    if os.path.exists(header):
+      with open(header) as f:
+        if re.search(r"#define LLVM_FORCE_ENABLE_STATS 1", f.read()):
+          return True
+  return False
+
+def parse_stats(output):
+  """Sums the statistics printed by the opt invocations of aspis.sh with
+  -stats -stats-json, indexed by `<DEBUG_TYPE>.<name>`."""
+  stats = {}
+  for name, value in re.findall(r'^\s*"([^"]+)": (\d+)\s*,?$', output, re.MULTILINE):
+    stats[name] = stats.get(name, 0) + int(value)
+  return stats
+
+def check_stats(expected, stats, test_name):
+  """Checks the statistics against the conditions of `expect_stats`, e.g.
+  `{ "eddi_check_elim.NumChecksRemoved" = "> 0" }`. The statistics that are
+  not printed are 0."""
+  ops = {">": int.__gt__, ">=": int.__ge__, "==": int.__eq__, "<=": int.__le__, "<": int.__lt__}
+  for name, condition in expected.items():
+    op, value = condition.split()
+    actual = stats.get(name, 0)
+    assert ops[op](actual, int(value)), f"Test {test_name} failed: {name} = {actual}, expected {condition}"
+
 def pytest_generate_tests(metafunc):
     """Custom hook to parametrize tests based on the CLI --tests-file flag."""
     if "test_data" in metafunc.fixturenames:
@@ -89,6 +150,10 @@ def test_aspis(test_data, use_container, aspis_addopt, data_technique, cfc_techn
   if("add_compiler_flags" in test_data):
     aspis_addopt += " " + test_data["add_compiler_flags"]
 
+  # the statistics show that the transformation under test was applied
+  if("expect_stats" in test_data):
+    aspis_addopt += " --aspis-stats"
+
   if("black_list" in test_data):
     black_list = test_data["black_list"]
     if(data_technique in black_list or cfc_technique in black_list):
@@ -107,7 +172,9 @@ def test_aspis(test_data, use_container, aspis_addopt, data_technique, cfc_techn
   # Create build directory if it doesn't exist
   os.makedirs(local_build_dir, exist_ok=True)
 
-  source_path = os.path.join(TEST_DIR, source_file)
+  # several files are compiled and linked together
+  source_files = source_file if isinstance(source_file, list) else [source_file]
+  source_path = " ".join(os.path.join(TEST_DIR, f) for f in source_files)
   if not os.path.exists(docker_build_dir + "/" + test_name + ".out"):
     print("Compiling without ASPIS to get expected output...")
     compile_without_aspis(source_path, test_name, llvm_bin, docker_build_dir)
@@ -120,12 +187,37 @@ def test_aspis(test_data, use_container, aspis_addopt, data_technique, cfc_techn
 
   test_name_complete = f"{test_name}_{data_technique}_{cfc_technique}"
 
+  # collect the block profile on the unhardened program, then harden it under
+  # the overhead budget
+  if("profile_budget" in test_data):
+    profile_file = os.path.join(local_build_dir, "out.ll.aspis.profraw")
+    if os.path.exists(profile_file):
+      os.remove(profile_file)
+    compile_with_aspis(source_path, f"{test_name_complete}_profile", aspis_addopt + " --collect-profile", llvm_bin, docker_build_dir)
+    result = execute_binary(local_build_dir, f"{test_name_complete}_profile")
+    assert result == expected_output, f"Test {test_name_complete} failed collecting the profile: {result}"
+    assert os.path.exists(profile_file), f"Test {test_name_complete} failed: {profile_file} not written"
+    aspis_options += f" --aspis-profile={os.path.join(docker_build_dir, 'out.ll.aspis.profraw')} --aspis-overhead-budget={test_data['profile_budget']}"
+
   # Compile the source file
-  compile_with_aspis(source_path, test_name_complete, aspis_options, llvm_bin, docker_build_dir)
+  _, compile_stderr = compile_with_aspis(source_path, test_name_complete, aspis_options, llvm_bin, docker_build_dir)
 
   # Execute the binary and check output
   result = execute_binary(local_build_dir, test_name_complete)
   assert result == expected_output, f"Test {test_name_complete} failed: {result}"
 
+  if("profile_budget" in test_data):
+    # the profile is ignored if its hash does not match the hardened code
+    assert "Cannot read the profile" not in compile_stderr and "collected on different code" not in compile_stderr, \
+      f"Test {test_name_complete} failed loading the profile: {compile_stderr}"
+
+  if("masked_faults" in test_data):
+    check_masked_faults(local_build_dir, test_name_complete, expected_output, test_data["masked_faults"])
+
+  if("expect_stats" in test_data):
+    if not stats_enabled(llvm_bin):
+      pytest.skip(f"Skipping the statistics of {test_name_complete}: LLVM was built without statistics")
+    check_stats(test_data["expect_stats"], parse_stats(compile_stderr), test_name_complete)
+
 if __name__ == "__main__":
   pytest.main()
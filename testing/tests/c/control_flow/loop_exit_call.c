@@ -0,0 +1,23 @@
+/*
+* Loop leaving the program through a call to exit().
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int main() {
+    int last[4] = {0, 0, 0, 0};
+    int sum = 0;
+    for (int i = 0; ; i++) {
+        sum += i * i;
+        last[i % 4] = sum;
+        if (sum > 100) {
+            printf("%d %d %d", i, last[i % 4], last[(i + 3) % 4]);
+            exit(0);
+        }
+    }
+    return 1;
+}
+
+// expected output
+// 7 140 91
@@ -0,0 +1,210 @@
+#include <stdio.h>
+
+// a generated state machine with many basic blocks
+int main() {
+    int state = 0;
+    unsigned int acc = 1;
+    for (int step = 0; step < 200; step++) {
+        switch (state) {
+        case 0:
+            acc = acc * 3 + 0;
+            state = (acc % 3 == 0) ? 1 : 2;
+            break;
+        case 1:
+            acc = acc * 5 + 1;
+            state = (acc % 3 == 0) ? 8 : 7;
+            break;
+        case 2:
+            acc = acc * 7 + 2;
+            state = (acc % 3 == 0) ? 15 : 12;
+            break;
+        case 3:
+            acc = acc * 9 + 3;
+            state = (acc % 3 == 0) ? 22 : 17;
+            break;
+        case 4:
+            acc = acc * 11 + 4;
+            state = (acc % 3 == 0) ? 29 : 22;
+            break;
+        case 5:
+            acc = acc * 13 + 5;
+            state = (acc % 3 == 0) ? 36 : 27;
+            break;
+        case 6:
+            acc = acc * 15 + 6;
+            state = (acc % 3 == 0) ? 43 : 32;
+            break;
+        case 7:
+            acc = acc * 17 + 7;
+            state = (acc % 3 == 0) ? 2 : 37;
+            break;
+        case 8:
+            acc = acc * 19 + 8;
+            state = (acc % 3 == 0) ? 9 : 42;
+            break;
+        case 9:
+            acc = acc * 21 + 9;
+            state = (acc % 3 == 0) ? 16 : 47;
+            break;
+        case 10:
+            acc = acc * 23 + 10;
+            state = (acc % 3 == 0) ? 23 : 4;
+            break;
+        case 11:
+            acc = acc * 25 + 11;
+            state = (acc % 3 == 0) ? 30 : 9;
+            break;
+        case 12:
+            acc = acc * 27 + 12;
+            state = (acc % 3 == 0) ? 37 : 14;
+            break;
+        case 13:
+            acc = acc * 29 + 13;
+            state = (acc % 3 == 0) ? 44 : 19;
+            break;
+        case 14:
+            acc = acc * 31 + 14;
+            state = (acc % 3 == 0) ? 3 : 24;
+            break;
+        case 15:
+            acc = acc * 33 + 15;
+            state = (acc % 3 == 0) ? 10 : 29;
+            break;
+        case 16:
+            acc = acc * 35 + 16;
+            state = (acc % 3 == 0) ? 17 : 34;
+            break;
+        case 17:
+            acc = acc * 37 + 17;
+            state = (acc % 3 == 0) ? 24 : 39;
+            break;
+        case 18:
+            acc = acc * 39 + 18;
+            state = (acc % 3 == 0) ? 31 : 44;
+            break;
+        case 19:
+            acc = acc * 41 + 19;
+            state = (acc % 3 == 0) ? 38 : 1;
+            break;
+        case 20:
+            acc = acc * 43 + 20;
+            state = (acc % 3 == 0) ? 45 : 6;
+            break;
+        case 21:
+            acc = acc * 45 + 21;
+            state = (acc % 3 == 0) ? 4 : 11;
+            break;
+        case 22:
+            acc = acc * 47 + 22;
+            state = (acc % 3 == 0) ? 11 : 16;
+            break;
+        case 23:
+            acc = acc * 49 + 23;
+            state = (acc % 3 == 0) ? 18 : 21;
+            break;
+        case 24:
+            acc = acc * 51 + 24;
+            state = (acc % 3 == 0) ? 25 : 26;
+            break;
+        case 25:
+            acc = acc * 53 + 25;
+            state = (acc % 3 == 0) ? 32 : 31;
+            break;
+        case 26:
+            acc = acc * 55 + 26;
+            state = (acc % 3 == 0) ? 39 : 36;
+            break;
+        case 27:
+            acc = acc * 57 + 27;
+            state = (acc % 3 == 0) ? 46 : 41;
+            break;
+        case 28:
+            acc = acc * 59 + 28;
+            state = (acc % 3 == 0) ? 5 : 46;
+            break;
+        case 29:
+            acc = acc * 61 + 29;
+            state = (acc % 3 == 0) ? 12 : 3;
+            break;
+        case 30:
+            acc = acc * 63 + 30;
+            state = (acc % 3 == 0) ? 19 : 8;
+            break;
+        case 31:
+            acc = acc * 65 + 31;
+            state = (acc % 3 == 0) ? 26 : 13;
+            break;
+        case 32:
+            acc = acc * 67 + 32;
+            state = (acc % 3 == 0) ? 33 : 18;
+            break;
+        case 33:
+            acc = acc * 69 + 33;
+            state = (acc % 3 == 0) ? 40 : 23;
+            break;
+        case 34:
+            acc = acc * 71 + 34;
+            state = (acc % 3 == 0) ? 47 : 28;
+            break;
+        case 35:
+            acc = acc * 73 + 35;
+            state = (acc % 3 == 0) ? 6 : 33;
+            break;
+        case 36:
+            acc = acc * 75 + 36;
+            state = (acc % 3 == 0) ? 13 : 38;
+            break;
+        case 37:
+            acc = acc * 77 + 37;
+            state = (acc % 3 == 0) ? 20 : 43;
+            break;
+        case 38:
+            acc = acc * 79 + 38;
+            state = (acc % 3 == 0) ? 27 : 0;
+            break;
+        case 39:
+            acc = acc * 81 + 39;
+            state = (acc % 3 == 0) ? 34 : 5;
+            break;
+        case 40:
+            acc = acc * 83 + 40;
+            state = (acc % 3 == 0) ? 41 : 10;
+            break;
+        case 41:
+            acc = acc * 85 + 41;
+            state = (acc % 3 == 0) ? 0 : 15;
+            break;
+        case 42:
+            acc = acc * 87 + 42;
+            state = (acc % 3 == 0) ? 7 : 20;
+            break;
+        case 43:
+            acc = acc * 89 + 43;
+            state = (acc % 3 == 0) ? 14 : 25;
+            break;
+        case 44:
+            acc = acc * 91 + 44;
+            state = (acc % 3 == 0) ? 21 : 30;
+            break;
+        case 45:
+            acc = acc * 93 + 45;
+            state = (acc % 3 == 0) ? 28 : 35;
+            break;
+        case 46:
+            acc = acc * 95 + 46;
+            state = (acc % 3 == 0) ? 35 : 40;
+            break;
+        case 47:
+            acc = acc * 97 + 47;
+            state = (acc % 3 == 0) ? 42 : 45;
+            break;
+        default:
+            state = 0;
+        }
+    }
+    printf("%u %d", acc, state);
+    return 0;
+}
+
+// expected output
+// 2979081407 24
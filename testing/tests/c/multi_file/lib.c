@@ -0,0 +1,17 @@
+/*
+* Called by main.c, calls back scale() and report() of main.c.
+*/
+
+int scale(int x);
+void report(int i, int v);
+
+void accumulate(int *acc, int x) {
+    *acc += scale(x);
+    if (x % 4 == 0) {
+        report(x, *acc);
+    }
+}
+
+int weight(int x) {
+    return x % 7 + x / 3;
+}
@@ -0,0 +1,45 @@
+/*
+* Functions defined in another file (lib.c), which calls back the functions
+* of this one. With aspis.sh -j each file is hardened separately, and the
+* calls between them are redirected to the _dup (and _ret_dup) functions
+* when the hardened files are linked.
+*/
+
+#include <stdio.h>
+
+void accumulate(int *acc, int x);
+int weight(int x);
+
+int scale(int x) {
+    return 3 * x + 1;
+}
+
+void report(int i, int v) {
+    printf("%d: %d\n", i, v);
+}
+
+int main() {
+    int acc = 0;
+    for (int i = 0; i < 10; i++) {
+        accumulate(&acc, i);
+        report(i, weight(acc));
+    }
+    printf("%d\n", acc);
+    return 0;
+}
+
+// expected output
+// 0: 1
+// 0: 1
+// 1: 6
+// 2: 9
+// 3: 8
+// 4: 35
+// 4: 11
+// 5: 19
+// 6: 23
+// 7: 31
+// 8: 117
+// 8: 44
+// 9: 53
+// 145